@@ -17,6 +17,7 @@
 
 #include "utils.h"
 #include "tc_util.h"
+#include "marco_fq.h"
 
 static void explain(void)
 {
@@ -32,7 +33,14 @@ static void explain(void)
             "		[ timer_slack TIME]\n"
             "		[ ce_threshold TIME ]\n"
             "		[ horizon TIME ]\n"
-            "		[ horizon_{cap|drop} ]\n");
+            "		[ horizon_{cap|drop} ]\n"
+            "		[ gso_split_rate RATE ]\n"
+            "		[ [no]retrans_prio ]\n"
+            "		[ dump_min_backlog BYTES ] [ dump_{throttled|all} ]\n"
+            "		[ occupancy_interval TIME ] [ event_sample N ]\n"
+            "		[ [no]profile ] [ tx_sample N ]\n"
+            "		[ telemetry_dscp DSCP ] [ telemetry_threshold TIME ]\n"
+            "		[ [no]telemetry_option ] [ [no]limit_trim ]\n");
 }
 
 static unsigned int ilog2(unsigned int val)
@@ -59,12 +67,18 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
     unsigned int buckets = 0;
     unsigned int maxrate;
     unsigned int low_rate_threshold;
+    unsigned int gso_split_rate;
+    unsigned int dump_min_backlog;
     unsigned int defrate;
     unsigned int refill_delay;
     unsigned int orphan_mask;
     unsigned int ce_threshold;
     unsigned int timer_slack;
     unsigned int horizon;
+    unsigned int occ_interval;
+    unsigned int event_sample;
+    unsigned int tx_sample;
+    unsigned int telemetry_threshold;
     __u8 horizon_drop = 255;
     bool set_plimit = false;
     bool set_flow_plimit = false;
@@ -75,13 +89,25 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
     bool set_refill_delay = false;
     bool set_orphan_mask = false;
     bool set_low_rate_threshold = false;
+    bool set_gso_split_rate = false;
+    bool set_dump_min_backlog = false;
     bool set_ce_threshold = false;
     bool set_timer_slack = false;
     bool set_horizon = false;
+    bool set_occ_interval = false;
+    bool set_event_sample = false;
+    bool set_tx_sample = false;
+    bool set_telemetry_threshold = false;
     bool set_priomap = false;
     bool set_weights = false;
     int weights[FQ_BANDS];
     int pacing = -1;
+    __u8 retrans_prio = 255;
+    __u8 dump_throttled = 255;
+    __u8 profile = 255;
+    __u8 limit_trim = 255;
+    __u8 telemetry_dscp = 255;
+    __u8 telemetry_option = 255;
     struct rtattr *tail;
 
     while (argc > 0)
@@ -143,6 +169,16 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
             }
             set_low_rate_threshold = true;
         }
+        else if (strcmp(*argv, "gso_split_rate") == 0)
+        {
+            NEXT_ARG();
+            if (get_rate(&gso_split_rate, *argv))
+            {
+                fprintf(stderr, "Illegal \"gso_split_rate\"\n");
+                return -1;
+            }
+            set_gso_split_rate = true;
+        }
         else if (strcmp(*argv, "ce_threshold") == 0)
         {
             NEXT_ARG();
@@ -255,6 +291,105 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
         {
             pacing = 0;
         }
+        else if (strcmp(*argv, "retrans_prio") == 0)
+        {
+            retrans_prio = 1;
+        }
+        else if (strcmp(*argv, "noretrans_prio") == 0)
+        {
+            retrans_prio = 0;
+        }
+        else if (strcmp(*argv, "dump_min_backlog") == 0)
+        {
+            NEXT_ARG();
+            if (get_size(&dump_min_backlog, *argv))
+            {
+                fprintf(stderr, "Illegal \"dump_min_backlog\"\n");
+                return -1;
+            }
+            set_dump_min_backlog = true;
+        }
+        else if (strcmp(*argv, "dump_throttled") == 0)
+        {
+            dump_throttled = 1;
+        }
+        else if (strcmp(*argv, "dump_all") == 0)
+        {
+            dump_throttled = 0;
+        }
+        else if (strcmp(*argv, "occupancy_interval") == 0)
+        {
+            NEXT_ARG();
+            if (get_time(&occ_interval, *argv))
+            {
+                fprintf(stderr, "Illegal \"occupancy_interval\"\n");
+                return -1;
+            }
+            set_occ_interval = true;
+        }
+        else if (strcmp(*argv, "profile") == 0)
+        {
+            profile = 1;
+        }
+        else if (strcmp(*argv, "noprofile") == 0)
+        {
+            profile = 0;
+        }
+        else if (strcmp(*argv, "limit_trim") == 0)
+        {
+            limit_trim = 1;
+        }
+        else if (strcmp(*argv, "nolimit_trim") == 0)
+        {
+            limit_trim = 0;
+        }
+        else if (strcmp(*argv, "telemetry_dscp") == 0)
+        {
+            NEXT_ARG();
+            if (get_u8(&telemetry_dscp, *argv, 0) || telemetry_dscp > 63)
+            {
+                fprintf(stderr, "Illegal \"telemetry_dscp\"\n");
+                return -1;
+            }
+        }
+        else if (strcmp(*argv, "telemetry_threshold") == 0)
+        {
+            NEXT_ARG();
+            if (get_time(&telemetry_threshold, *argv))
+            {
+                fprintf(stderr, "Illegal \"telemetry_threshold\"\n");
+                return -1;
+            }
+            set_telemetry_threshold = true;
+        }
+        else if (strcmp(*argv, "telemetry_option") == 0)
+        {
+            telemetry_option = 1;
+        }
+        else if (strcmp(*argv, "notelemetry_option") == 0)
+        {
+            telemetry_option = 0;
+        }
+        else if (strcmp(*argv, "tx_sample") == 0)
+        {
+            NEXT_ARG();
+            if (get_unsigned(&tx_sample, *argv, 0))
+            {
+                fprintf(stderr, "Illegal \"tx_sample\"\n");
+                return -1;
+            }
+            set_tx_sample = true;
+        }
+        else if (strcmp(*argv, "event_sample") == 0)
+        {
+            NEXT_ARG();
+            if (get_unsigned(&event_sample, *argv, 0))
+            {
+                fprintf(stderr, "Illegal \"event_sample\"\n");
+                return -1;
+            }
+            set_event_sample = true;
+        }
         else if (strcmp(*argv, "bands") == 0)
         {
             int idx;
@@ -384,6 +519,9 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
     if (set_low_rate_threshold)
         addattr_l(n, 1024, TCA_FQ_LOW_RATE_THRESHOLD,
                   &low_rate_threshold, sizeof(low_rate_threshold));
+    if (set_gso_split_rate)
+        addattr_l(n, 1024, TCA_MARCO_FQ_GSO_SPLIT_RATE,
+                  &gso_split_rate, sizeof(gso_split_rate));
     if (set_defrate)
         addattr_l(n, 1024, TCA_FQ_FLOW_DEFAULT_RATE,
                   &defrate, sizeof(defrate));
@@ -405,6 +543,39 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
     if (horizon_drop != 255)
         addattr_l(n, 1024, TCA_FQ_HORIZON_DROP,
                   &horizon_drop, sizeof(horizon_drop));
+    if (retrans_prio != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_RETRANS_PRIO,
+                  &retrans_prio, sizeof(retrans_prio));
+    if (set_dump_min_backlog)
+        addattr_l(n, 1024, TCA_MARCO_FQ_DUMP_MIN_BACKLOG,
+                  &dump_min_backlog, sizeof(dump_min_backlog));
+    if (dump_throttled != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_DUMP_THROTTLED,
+                  &dump_throttled, sizeof(dump_throttled));
+    if (set_occ_interval)
+        addattr_l(n, 1024, TCA_MARCO_FQ_OCC_INTERVAL,
+                  &occ_interval, sizeof(occ_interval));
+    if (set_event_sample)
+        addattr_l(n, 1024, TCA_MARCO_FQ_EVENT_SAMPLE,
+                  &event_sample, sizeof(event_sample));
+    if (set_tx_sample)
+        addattr_l(n, 1024, TCA_MARCO_FQ_TX_SAMPLE,
+                  &tx_sample, sizeof(tx_sample));
+    if (set_telemetry_threshold)
+        addattr_l(n, 1024, TCA_MARCO_FQ_TELEMETRY_THRESHOLD,
+                  &telemetry_threshold, sizeof(telemetry_threshold));
+    if (telemetry_dscp != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_TELEMETRY_DSCP,
+                  &telemetry_dscp, sizeof(telemetry_dscp));
+    if (telemetry_option != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_TELEMETRY_OPTION,
+                  &telemetry_option, sizeof(telemetry_option));
+    if (profile != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_PROFILE,
+                  &profile, sizeof(profile));
+    if (limit_trim != 255)
+        addattr_l(n, 1024, TCA_MARCO_FQ_LIMIT_TRIM,
+                  &limit_trim, sizeof(limit_trim));
     if (set_priomap)
         addattr_l(n, 1024, TCA_FQ_PRIOMAP,
                   &prio2band, sizeof(prio2band));
@@ -417,7 +588,7 @@ static int marco_fq_parse_opt(const struct qdisc_util *qu, int argc, char **argv
 
 static int marco_fq_print_opt(const struct qdisc_util *qu, FILE *f, struct rtattr *opt)
 {
-    struct rtattr *tb[TCA_FQ_MAX + 1];
+    struct rtattr *tb[TCA_MARCO_FQ_MAX + 1];
     unsigned int plimit, flow_plimit;
     unsigned int buckets_log;
     int pacing;
@@ -434,7 +605,7 @@ static int marco_fq_print_opt(const struct qdisc_util *qu, FILE *f, struct rtatt
     if (opt == NULL)
         return 0;
 
-    parse_rtattr_nested(tb, TCA_FQ_MAX, opt);
+    parse_rtattr_nested(tb, TCA_MARCO_FQ_MAX, opt);
 
     if (tb[TCA_FQ_PLIMIT] &&
         RTA_PAYLOAD(tb[TCA_FQ_PLIMIT]) >= sizeof(__u32))
@@ -533,6 +704,15 @@ static int marco_fq_print_opt(const struct qdisc_util *qu, FILE *f, struct rtatt
             tc_print_rate(PRINT_ANY, "low_rate_threshold",
                           "low_rate_threshold %s ", rate);
     }
+    if (tb[TCA_MARCO_FQ_GSO_SPLIT_RATE] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_GSO_SPLIT_RATE]) >= sizeof(__u32))
+    {
+        rate = rta_getattr_u32(tb[TCA_MARCO_FQ_GSO_SPLIT_RATE]);
+
+        if (rate != 0)
+            tc_print_rate(PRINT_ANY, "gso_split_rate",
+                          "gso_split_rate %s ", rate);
+    }
     if (tb[TCA_FQ_FLOW_REFILL_DELAY] &&
         RTA_PAYLOAD(tb[TCA_FQ_FLOW_REFILL_DELAY]) >= sizeof(__u32))
     {
@@ -583,19 +763,301 @@ static int marco_fq_print_opt(const struct qdisc_util *qu, FILE *f, struct rtatt
             print_null(PRINT_ANY, "horizon_drop", "horizon_drop ", NULL);
     }
 
+    if (tb[TCA_MARCO_FQ_RETRANS_PRIO] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_RETRANS_PRIO]) >= sizeof(__u8))
+    {
+        if (rta_getattr_u8(tb[TCA_MARCO_FQ_RETRANS_PRIO]))
+            print_null(PRINT_ANY, "retrans_prio", "retrans_prio ", NULL);
+    }
+
+    if (tb[TCA_MARCO_FQ_DUMP_MIN_BACKLOG] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_DUMP_MIN_BACKLOG]) >= sizeof(__u32))
+    {
+        unsigned int dump_min_backlog;
+
+        dump_min_backlog = rta_getattr_u32(tb[TCA_MARCO_FQ_DUMP_MIN_BACKLOG]);
+        if (dump_min_backlog)
+            print_size(PRINT_ANY, "dump_min_backlog", "dump_min_backlog %s ",
+                       dump_min_backlog);
+    }
+
+    if (tb[TCA_MARCO_FQ_DUMP_THROTTLED] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_DUMP_THROTTLED]) >= sizeof(__u8))
+    {
+        if (rta_getattr_u8(tb[TCA_MARCO_FQ_DUMP_THROTTLED]))
+            print_null(PRINT_ANY, "dump_throttled", "dump_throttled ", NULL);
+    }
+
+    if (tb[TCA_MARCO_FQ_OCC_INTERVAL] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_OCC_INTERVAL]) >= sizeof(__u32))
+    {
+        unsigned int occ_interval;
+
+        occ_interval = rta_getattr_u32(tb[TCA_MARCO_FQ_OCC_INTERVAL]);
+        if (occ_interval)
+        {
+            print_uint(PRINT_JSON, "occupancy_interval", NULL, occ_interval);
+            print_string(PRINT_FP, NULL, "occupancy_interval %s ",
+                         sprint_time(occ_interval, b1));
+        }
+    }
+
+    if (tb[TCA_MARCO_FQ_EVENT_SAMPLE] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_EVENT_SAMPLE]) >= sizeof(__u32))
+    {
+        unsigned int event_sample;
+
+        event_sample = rta_getattr_u32(tb[TCA_MARCO_FQ_EVENT_SAMPLE]);
+        if (event_sample)
+            print_uint(PRINT_ANY, "event_sample", "event_sample %u ",
+                       event_sample);
+    }
+
+    if (tb[TCA_MARCO_FQ_PROFILE] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_PROFILE]) >= sizeof(__u8))
+    {
+        if (rta_getattr_u8(tb[TCA_MARCO_FQ_PROFILE]))
+            print_null(PRINT_ANY, "profile", "profile ", NULL);
+    }
+
+    if (tb[TCA_MARCO_FQ_LIMIT_TRIM] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_LIMIT_TRIM]) >= sizeof(__u8))
+    {
+        if (rta_getattr_u8(tb[TCA_MARCO_FQ_LIMIT_TRIM]))
+            print_null(PRINT_ANY, "limit_trim", "limit_trim ", NULL);
+    }
+
+    if (tb[TCA_MARCO_FQ_TX_SAMPLE] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_TX_SAMPLE]) >= sizeof(__u32))
+    {
+        unsigned int tx_sample;
+
+        tx_sample = rta_getattr_u32(tb[TCA_MARCO_FQ_TX_SAMPLE]);
+        if (tx_sample)
+            print_uint(PRINT_ANY, "tx_sample", "tx_sample %u ", tx_sample);
+    }
+
+    if (tb[TCA_MARCO_FQ_TELEMETRY_DSCP] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_TELEMETRY_DSCP]) >= sizeof(__u8))
+    {
+        __u8 dscp = rta_getattr_u8(tb[TCA_MARCO_FQ_TELEMETRY_DSCP]);
+
+        if (dscp)
+        {
+            print_uint(PRINT_ANY, "telemetry_dscp", "telemetry_dscp %u ", dscp);
+            if (tb[TCA_MARCO_FQ_TELEMETRY_THRESHOLD] &&
+                RTA_PAYLOAD(tb[TCA_MARCO_FQ_TELEMETRY_THRESHOLD]) >= sizeof(__u32))
+            {
+                unsigned int threshold;
+
+                threshold = rta_getattr_u32(tb[TCA_MARCO_FQ_TELEMETRY_THRESHOLD]);
+                print_uint(PRINT_JSON, "telemetry_threshold", NULL, threshold);
+                print_string(PRINT_FP, NULL, "telemetry_threshold %s ",
+                             sprint_time(threshold, b1));
+            }
+        }
+    }
+
+    if (tb[TCA_MARCO_FQ_TELEMETRY_OPTION] &&
+        RTA_PAYLOAD(tb[TCA_MARCO_FQ_TELEMETRY_OPTION]) >= sizeof(__u8))
+    {
+        if (rta_getattr_u8(tb[TCA_MARCO_FQ_TELEMETRY_OPTION]))
+            print_null(PRINT_ANY, "telemetry_option", "telemetry_option ", NULL);
+    }
+
+    return 0;
+}
+
+static const char *marco_fq_class_names[TC_MARCO_FQ_NR_CLASSES] = {
+    [TC_MARCO_FQ_CLASS_INTERNAL] = "internal",
+    [TC_MARCO_FQ_CLASS_LOCAL] = "local",
+    [TC_MARCO_FQ_CLASS_ORPHAN] = "orphan",
+};
+
+/* Upper bound of the bucket holding the permille-th value */
+static __u64 marco_fq_hist_percentile(const __u64 *buckets, __u64 total,
+                                      unsigned int permille)
+{
+    __u64 target = (total * permille + 999) / 1000;
+    __u64 sum = 0;
+    int i;
+
+    for (i = 0; i < TC_MARCO_FQ_HIST_BUCKETS; i++)
+    {
+        sum += buckets[i];
+        if (sum >= target)
+            break;
+    }
+    return i ? 1ULL << i : 0;
+}
+
+static void marco_fq_print_hist(const char *name, const __u64 *buckets)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned int permille;
+    } pct[] = {{"p50", 500}, {"p99", 990}, {"p999", 999}};
+    __u64 total = 0;
+    int i;
+
+    SPRINT_BUF(b1);
+
+    for (i = 0; i < TC_MARCO_FQ_HIST_BUCKETS; i++)
+        total += buckets[i];
+    if (!total)
+        return;
+
+    open_json_object(name);
+    print_string(PRINT_FP, NULL, " %s", name);
+    print_lluint(PRINT_ANY, "pkts", " pkts %llu", total);
+    for (i = 0; i < ARRAY_SIZE(pct); i++)
+    {
+        __u64 ns = marco_fq_hist_percentile(buckets, total, pct[i].permille);
+
+        print_lluint(PRINT_JSON, pct[i].name, NULL, ns);
+        print_string(PRINT_FP, NULL, " %s", pct[i].name);
+        print_string(PRINT_FP, NULL, " %s", sprint_time64(ns, b1));
+    }
+    open_json_array(PRINT_JSON, "buckets");
+    for (i = 0; i < TC_MARCO_FQ_HIST_BUCKETS; i++)
+        print_lluint(PRINT_JSON, NULL, NULL, buckets[i]);
+    close_json_array(PRINT_JSON, NULL);
+    close_json_object();
+}
+
+static void marco_fq_print_class_hists(const char *name,
+                                       const __u64 (*hists)[TC_MARCO_FQ_HIST_BUCKETS])
+{
+    int c;
+
+    open_json_object(name);
+    for (c = 0; c < TC_MARCO_FQ_NR_CLASSES; c++)
+    {
+        __u64 total = 0;
+        int i;
+
+        for (i = 0; i < TC_MARCO_FQ_HIST_BUCKETS; i++)
+            total += hists[c][i];
+        if (!total)
+            continue;
+        print_nl();
+        print_string(PRINT_FP, NULL, "  %s", name);
+        marco_fq_print_hist(marco_fq_class_names[c], hists[c]);
+    }
+    close_json_object();
+}
+
+static void marco_fq_print_topk(const char *name, const char *value_name,
+                               const struct tc_marco_fq_topk_entry *e)
+{
+    int i;
+
+    if (!e[0].value)
+        return;
+
+    print_nl();
+    print_string(PRINT_FP, NULL, "  %s:", name);
+    open_json_array(PRINT_JSON, name);
+    for (i = 0; i < TC_MARCO_FQ_TOPK && e[i].value; i++)
+    {
+        open_json_object(NULL);
+        print_nl();
+        print_hex(PRINT_ANY, "id", "    id %08x", e[i].id);
+        if (e[i].saddr || e[i].daddr)
+        {
+            print_string(PRINT_ANY, "src", " %s",
+                         format_host(AF_INET, 4, &e[i].saddr));
+            print_string(PRINT_ANY, "dst", " > %s",
+                         format_host(AF_INET, 4, &e[i].daddr));
+        }
+        print_string(PRINT_FP, NULL, " %s", value_name);
+        print_lluint(PRINT_ANY, value_name, " %llu", e[i].value);
+        if (e[i].error)
+            print_lluint(PRINT_ANY, "error", " (error %llu)", e[i].error);
+        close_json_object();
+    }
+    close_json_array(PRINT_JSON, NULL);
+}
+
+static void marco_fq_print_pacing_worst(const struct tc_marco_fq_pacing_worst *w)
+{
+    SPRINT_BUF(b1);
+
+    if (!w->late_ns)
+        return;
+
+    print_nl();
+    open_json_object("pacing_worst");
+    print_hex(PRINT_ANY, "id", "  pacing_worst id %08x", w->id);
+    if (w->saddr || w->daddr)
+    {
+        print_string(PRINT_ANY, "src", " %s",
+                     format_host(AF_INET, 4, &w->saddr));
+        print_string(PRINT_ANY, "dst", " > %s",
+                     format_host(AF_INET, 4, &w->daddr));
+    }
+    if (w->class < TC_MARCO_FQ_NR_CLASSES)
+        print_string(PRINT_ANY, "class", " %s", marco_fq_class_names[w->class]);
+    print_lluint(PRINT_JSON, "late", NULL, w->late_ns);
+    print_string(PRINT_FP, NULL, " late %s", sprint_time64(w->late_ns, b1));
+    print_lluint(PRINT_JSON, "age", NULL, w->age_ns);
+    print_string(PRINT_FP, NULL, " %s ago", sprint_time64(w->age_ns, b1));
+    close_json_object();
+}
+
+static int marco_fq_print_class_xstats(struct rtattr *xstats)
+{
+    struct tc_marco_fq_cl_stats *st, _st;
+
+    SPRINT_BUF(b1);
+
+    memset(&_st, 0, sizeof(_st));
+    memcpy(&_st, RTA_DATA(xstats), min(RTA_PAYLOAD(xstats), sizeof(*st)));
+
+    st = &_st;
+
+    print_hex(PRINT_ANY, "id", "  id %08x", st->id);
+    print_uint(PRINT_ANY, "bucket", " bucket %u", st->bucket);
+    if (st->flags & TC_MARCO_FQ_FLOW_LOCAL)
+        print_null(PRINT_ANY, "local", " local", NULL);
+    if (st->flags & TC_MARCO_FQ_FLOW_DETACHED)
+        print_null(PRINT_ANY, "detached", " detached", NULL);
+    print_int(PRINT_ANY, "credit", " credit %d", st->credit);
+    if (st->flags & TC_MARCO_FQ_FLOW_THROTTLED)
+    {
+        print_lluint(PRINT_JSON, "next_packet_delay", NULL,
+                     st->time_next_packet);
+        print_string(PRINT_FP, NULL, " next_packet_delay %s",
+                     sprint_time64(st->time_next_packet, b1));
+    }
+
+    print_nl();
+    print_lluint(PRINT_ANY, "bytes", "  bytes %llu", st->bytes);
+    print_lluint(PRINT_ANY, "packets", " packets %llu", st->packets);
+    print_uint(PRINT_ANY, "drops", " drops %u", st->drops);
+    print_uint(PRINT_ANY, "throttled", " throttled %u", st->throttled);
+    print_lluint(PRINT_JSON, "throttled_time", NULL, st->throttled_ns);
+    print_string(PRINT_FP, NULL, " throttled_time %s",
+                 sprint_time64(st->throttled_ns, b1));
+
     return 0;
 }
 
 static int marco_fq_print_xstats(const struct qdisc_util *qu, FILE *f,
                            struct rtattr *xstats)
 {
-    struct tc_fq_qd_stats *st, _st;
+    struct tc_marco_fq_qd_stats *st, _st;
 
     SPRINT_BUF(b1);
 
     if (xstats == NULL)
         return 0;
 
+    if (RTA_PAYLOAD(xstats) >= sizeof(__u32) &&
+        rta_getattr_u32(xstats) == TCA_MARCO_FQ_XSTATS_CLASS)
+        return marco_fq_print_class_xstats(xstats);
+
     memset(&_st, 0, sizeof(_st));
     memcpy(&_st, RTA_DATA(xstats), min(RTA_PAYLOAD(xstats), sizeof(*st)));
 
@@ -606,10 +1068,6 @@ static int marco_fq_print_xstats(const struct qdisc_util *qu, FILE *f,
     print_uint(PRINT_ANY, "throttled", " throttled %u)",
                st->throttled_flows);
 
-    print_uint(PRINT_ANY, "band0_pkts", " band0_pkts %u", st->band_pkt_count[0]);
-    print_uint(PRINT_ANY, "band1_pkts", " band1_pkts %u", st->band_pkt_count[1]);
-    print_uint(PRINT_ANY, "band2_pkts", " band2_pkts %u", st->band_pkt_count[2]);
-
     if (st->time_next_delayed_flow > 0)
     {
         print_lluint(PRINT_JSON, "next_packet_delay", NULL,
@@ -623,10 +1081,6 @@ static int marco_fq_print_xstats(const struct qdisc_util *qu, FILE *f,
     print_lluint(PRINT_ANY, "highprio", " highprio %llu",
                  st->highprio_packets);
 
-    if (st->fastpath_packets)
-        print_lluint(PRINT_ANY, "fastpath", " fastpath %llu",
-                     st->fastpath_packets);
-
     if (st->tcp_retrans)
         print_lluint(PRINT_ANY, "retrans", " retrans %llu",
                      st->tcp_retrans);
@@ -649,11 +1103,16 @@ static int marco_fq_print_xstats(const struct qdisc_util *qu, FILE *f,
         print_lluint(PRINT_ANY, "flows_plimit", " flows_plimit %llu",
                      st->flows_plimit);
 
+    if (st->gso_segmented)
+        print_lluint(PRINT_ANY, "gso_segmented", " gso_segmented %llu",
+                     st->gso_segmented);
+
+    if (st->penalties)
+        print_lluint(PRINT_ANY, "penalties", " penalties %llu",
+                     st->penalties);
+
     if (st->pkts_too_long || st->allocation_errors ||
-        st->horizon_drops || st->horizon_caps ||
-        st->band_drops[0] ||
-        st->band_drops[1] ||
-        st->band_drops[2])
+        st->horizon_drops || st->horizon_caps)
     {
         print_nl();
         if (st->pkts_too_long)
@@ -672,20 +1131,19 @@ static int marco_fq_print_xstats(const struct qdisc_util *qu, FILE *f,
             print_lluint(PRINT_ANY, "horizon_caps",
                          "  horizon_caps %llu",
                          st->horizon_caps);
-        if (st->band_drops[0])
-            print_lluint(PRINT_ANY, "band0_drops",
-                         " band0_drops %llu",
-                         st->band_drops[0]);
-        if (st->band_drops[1])
-            print_lluint(PRINT_ANY, "band1_drops",
-                         " band1_drops %llu",
-                         st->band_drops[1]);
-        if (st->band_drops[2])
-            print_lluint(PRINT_ANY, "band2_drops",
-                         " band2_drops %llu",
-                         st->band_drops[2]);
     }
 
+    marco_fq_print_topk("top_bytes", "bytes", st->top_bytes);
+    marco_fq_print_topk("top_backlog", "backlog", st->top_backlog);
+
+    marco_fq_print_class_hists("sojourn",
+                               (const __u64 (*)[TC_MARCO_FQ_HIST_BUCKETS])st->sojourn);
+    marco_fq_print_class_hists("pacing_late",
+                               (const __u64 (*)[TC_MARCO_FQ_HIST_BUCKETS])st->pacing_late);
+    marco_fq_print_pacing_worst(&st->pacing_worst);
+    marco_fq_print_class_hists("tx_latency",
+                               (const __u64 (*)[TC_MARCO_FQ_HIST_BUCKETS])st->tx_latency);
+
     return 0;
 }
 
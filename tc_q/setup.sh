@@ -1,4 +1,4 @@
 git clone https://github.com/iproute2/iproute2.git
-cp q_marco_fq.c iproute2/tc 
+cp q_marco_fq.c ../tc_sch/marco_fq.h iproute2/tc
 cd iproute2
-make TCSO=q_marco_fq.so
\ No newline at end of file
+make TCSO=q_marco_fq.so
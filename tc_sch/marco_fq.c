@@ -45,11 +45,24 @@
 #include <linux/prefetch.h>
 #include <linux/vmalloc.h>
 #include <linux/hashtable.h>
+#include <linux/ipv6.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 #include <net/sock.h>
 #include <net/tcp_states.h>
 #include <net/tcp.h>
+#include <net/ipv6.h>
+#include <net/dsfield.h>
+
+#include "marco_fq.h"
 
 DEFINE_HASHTABLE(ip_count_table, 16); // 16 is the number of bits in the hash table
 
@@ -61,9 +74,19 @@ struct hash_ip_count
     struct hlist_node hnode; // Node for hash table
 };
 
+#define MARCO_FQ_SKB_RETRANS BIT(0) /* TCP retransmit, see marco_fq_tcp_retrans() */
+#define MARCO_FQ_SKB_SAMPLED BIT(1) /* events of this packet are logged */
+#define MARCO_FQ_SKB_PENALIZED BIT(2) /* delayed by the pair table */
+
+#define MARCO_FQ_PAIR_PENALTY_NS (10 * NSEC_PER_MSEC)
+
+#define MARCO_FQ_SKB_TIME_SHIFT 10 /* unit of enqueue_time, ~1 usec */
+
 struct marco_fq_skb_cb
 {
     u64 time_to_send;
+    u32 enqueue_time; /* ktime_get_ns() >> MARCO_FQ_SKB_TIME_SHIFT */
+    u32 flags;        /* MARCO_FQ_SKB_* */
 };
 
 static inline struct marco_fq_skb_cb *marco_fq_skb_cb(struct sk_buff *skb)
@@ -72,6 +95,11 @@ static inline struct marco_fq_skb_cb *marco_fq_skb_cb(struct sk_buff *skb)
     return (struct marco_fq_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+static bool marco_fq_skb_is_retrans(struct sk_buff *skb)
+{
+    return marco_fq_skb_cb(skb)->flags & MARCO_FQ_SKB_RETRANS;
+}
+
 /*
  * Per flow structure, dynamically allocated.
  * If packets have monotically increasing time_to_send, they are placed in O(1)
@@ -94,12 +122,25 @@ struct marco_fq_flow
 
     /* Second cache line, used in marco_fq_dequeue() */
     int credit;
-    /* 32bit hole on 64bit arches */
+    u32 backlog; /* bytes queued in flow */
 
     struct marco_fq_flow *next; /* next pointer in RR lists */
 
     struct rb_node rate_node; /* anchor in q->delayed tree */
     u64 time_next_packet;
+
+    u32 rtx_hash;     /* skb hash of the connection rtx_high_seq belongs to */
+    u32 rtx_high_seq; /* highest TCP sequence seen, for forwarded traffic */
+
+    /* Per flow statistics, dumped by marco_fq_walk() */
+    u64 stat_bytes;
+    u64 stat_packets;
+    u64 stat_throttled_ns; /* sum of the delays flow was throttled for */
+    u32 stat_throttled;
+    u32 stat_drops;
+
+    u8 topk_bytes_slot;   /* hints for marco_fq_topk_find() */
+    u8 topk_backlog_slot;
 } ____cacheline_aligned_in_smp;
 
 struct marco_fq_flow_head
@@ -108,6 +149,151 @@ struct marco_fq_flow_head
     struct marco_fq_flow *last;
 };
 
+struct marco_fq_topk_entry
+{
+    u32 id; /* marco_fq_flow_id() */
+    __be32 saddr;
+    __be32 daddr;
+    u64 value;
+    u64 error;
+};
+
+enum
+{
+    MARCO_FQ_STAT_GC_FLOWS,
+    MARCO_FQ_STAT_INTERNAL_PACKETS,
+    MARCO_FQ_STAT_THROTTLED,
+    MARCO_FQ_STAT_CE_MARK,
+    MARCO_FQ_STAT_HORIZON_DROPS,
+    MARCO_FQ_STAT_HORIZON_CAPS,
+    MARCO_FQ_STAT_FLOWS_PLIMIT,
+    MARCO_FQ_STAT_PKTS_TOO_LONG,
+    MARCO_FQ_STAT_ALLOCATION_ERRORS,
+    MARCO_FQ_STAT_GSO_SEGMENTED,
+    MARCO_FQ_STAT_TCP_RETRANS,
+    MARCO_FQ_STAT_PENALTIES,
+    MARCO_FQ_STAT_MAX
+};
+
+/* Stages of the datapath timed when profiling, see marco_fq_prof_end() */
+enum
+{
+    MARCO_FQ_PROF_CLASSIFY,
+    MARCO_FQ_PROF_PAIR_ENQUEUE, /* pair table lookup and update */
+    MARCO_FQ_PROF_QUEUE_ADD,
+    MARCO_FQ_PROF_CHECK_THROTTLED,
+    MARCO_FQ_PROF_PAIR_DEQUEUE,
+    MARCO_FQ_PROF_DEQUEUE, /* whole marco_fq_dequeue() */
+    MARCO_FQ_PROF_MAX
+};
+
+/* Per cpu statistics, written locklessly by the datapath of each cpu
+ * and summed by marco_fq_dump_stats() without taking the qdisc lock
+ */
+struct marco_fq_pcpu_stats
+{
+    struct u64_stats_sync syncp;
+    u64_stats_t stats[MARCO_FQ_STAT_MAX];
+    u64_stats_t sojourn[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+    u64_stats_t pacing_late[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+
+    u64_stats_t prof_ns[MARCO_FQ_PROF_MAX];
+    u64_stats_t prof_calls[MARCO_FQ_PROF_MAX];
+    u64_stats_t prof_packets; /* dequeued while profiling */
+};
+
+/* See marco_fq_record_pacing() */
+struct marco_fq_pacing_worst
+{
+    u32 id;
+    __be32 saddr;
+    __be32 daddr;
+    u32 cls;
+    u64 late_ns;
+    u64 stamp; /* ktime_get_ns() at departure */
+};
+
+/* Occupancy flight recorder, see marco_fq_occ_sample() */
+#define MARCO_FQ_OCC_SAMPLES 1024 /* power of two */
+
+struct marco_fq_occ_sample
+{
+    u64 time; /* ktime_get_ns() */
+    u32 qlen;
+    u32 backlog;
+    u32 active_flows;
+    u32 throttled_flows;
+    u32 penalties; /* applied since the previous sample */
+    u32 pad;
+};
+
+/* Per cpu event ring, see marco_fq_event() */
+#define MARCO_FQ_EV_RECORDS 4096 /* power of two */
+
+struct marco_fq_ev_ring
+{
+    void *buf; /* vmalloc_user(), header page then records */
+    struct tc_marco_fq_ev_header *hdr;
+    struct tc_marco_fq_event *ev;
+};
+
+/* Small table of the heaviest flows, see marco_fq_topk_bytes() */
+struct marco_fq_topk
+{
+    struct marco_fq_topk_entry e[TC_MARCO_FQ_TOPK];
+    u32 used;
+    u32 min; /* index of the smallest entry */
+    unsigned long next_decay; /* jiffies */
+};
+
+/* Tunables, set by marco_fq_change().
+ * A change publishes a new copy with RCU : the datapath never waits for
+ * the control path, and finds what it reads for every packet in the
+ * first cache line. The instrumentation fields are only looked at when
+ * flagged in instr.
+ */
+struct marco_fq_config
+{
+    u64 ce_threshold;
+    u64 horizon;                 /* horizon in ns */
+    unsigned long flow_max_rate; /* optional max rate per flow */
+    u32 limit;                   /* max packets in the qdisc */
+    u32 flow_plimit;             /* max packets per flow */
+    u32 quantum;
+    u32 initial_quantum;
+    u32 flow_refill_delay;
+    u32 orphan_mask; /* mask for orphaned skb */
+    u32 low_rate_threshold;
+    u32 timer_slack;    /* hrtimer slack in ns */
+    u32 gso_split_rate; /* segment GSO packets of flows paced below this rate */
+    u8 rate_enable;
+    u8 horizon_drop;
+    u8 retrans_prio; /* queue TCP retransmits ahead of new data */
+    u8 instr;        /* MARCO_FQ_INSTR_* */
+
+    u64 occ_interval;        /* ns between occupancy samples */
+    u64 telemetry_threshold; /* ns */
+    u32 ev_sample;           /* log events of 1 packet out of ev_sample */
+    u32 tx_sample;           /* time 1 packet out of tx_sample until tx completion */
+    u8 telemetry_dscp;
+    u8 telemetry_option;
+    u8 profile; /* time the datapath stages */
+    /* the rings belong to the qdisc, and outlive every config */
+    struct marco_fq_occ_sample *occ_ring;
+    struct marco_fq_ev_ring __percpu *ev_rings;
+
+    u8 dump_throttled;    /* class dumps only report throttled flows */
+    u8 limit_trim;        /* drop the excess when limit is lowered */
+    u32 dump_min_backlog; /* class dumps skip flows with less bytes queued */
+    struct rcu_head rcu;
+};
+
+#define MARCO_FQ_INSTR_PROFILE BIT(0)
+#define MARCO_FQ_INSTR_OCC BIT(1)
+#define MARCO_FQ_INSTR_EVENTS BIT(2)
+#define MARCO_FQ_INSTR_TX BIT(3)
+#define MARCO_FQ_INSTR_TELEMETRY BIT(4)
+
 struct marco_fq_sched_data
 {
     struct marco_fq_flow_head new_flows;
@@ -120,37 +306,61 @@ struct marco_fq_sched_data
     unsigned long unthrottle_latency_ns;
 
     struct marco_fq_flow internal; /* for non classified or high prio packets */
-    u32 quantum;
-    u32 initial_quantum;
-    u32 flow_refill_delay;
-    u32 flow_plimit;             /* max packets per flow */
-    unsigned long flow_max_rate; /* optional max rate per flow */
-    u64 ce_threshold;
-    u64 horizon;     /* horizon in ns */
-    u32 orphan_mask; /* mask for orphaned skb */
-    u32 low_rate_threshold;
+    struct marco_fq_config __rcu *cfg;
     struct rb_root *fq_root;
-    u8 rate_enable;
     u8 fq_trees_log;
-    u8 horizon_drop;
     u32 flows;
     u32 inactive_flows;
     u32 throttled_flows;
 
-    u64 stat_gc_flows;
-    u64 stat_internal_packets;
-    u64 stat_throttled;
-    u64 stat_ce_mark;
-    u64 stat_horizon_drops;
-    u64 stat_horizon_caps;
-    u64 stat_flows_plimit;
-    u64 stat_pkts_too_long;
-    u64 stat_allocation_errors;
-
-    u32 timer_slack; /* hrtimer slack in ns */
+    /* top_seq lets marco_fq_dump_stats() copy the top-K tables and
+     * pacing_worst without the qdisc lock
+     */
+    seqcount_t top_seq;
+    struct marco_fq_topk top_bytes;
+    struct marco_fq_topk top_backlog;
+    struct marco_fq_pacing_worst pacing_worst;
+
+    struct marco_fq_pcpu_stats __percpu *pcpu_stats;
+
     struct qdisc_watchdog watchdog;
+
+    u64 occ_next;     /* time of the next sample */
+    u32 occ_head;     /* samples taken, the ring wraps */
+    u32 occ_penalties;
+    struct marco_fq_occ_sample *occ_ring;
+
+    u32 tx_count;
+    struct marco_fq_tx *tx;
+
+    u32 ev_count;
+    struct marco_fq_ev_ring __percpu *ev_rings;
+
+    struct dentry *debugfs_dir;
+
+    struct rb_root *spare_root;     /* empty, fq_trees_log : for the next reset */
+    struct delayed_work table_work; /* refills spare_root, or fq_root */
+    unsigned long table_backoff;    /* jiffies, after a failed allocation */
+    bool destroying;               /* marco_fq_destroy() : no new table */
+
+    /* tc qdisc replace, see marco_fq_pair() */
+    struct Qdisc *successor;
+    struct Qdisc *predecessor;
+    struct delayed_work kick_work;
+    unsigned long kick_deadline;
+
+    /* Where the last paginated class dump stopped, see marco_fq_walk() */
+    u32 walk_bucket;
+    u32 walk_pos;
+    unsigned long walk_count;
 };
 
+/* The datapath runs with BH disabled, the control path under RTNL */
+static const struct marco_fq_config *marco_fq_cfg(const struct marco_fq_sched_data *q)
+{
+    return rcu_dereference_bh_check(q->cfg, lockdep_rtnl_is_held());
+}
+
 /*
  * f->tail and f->age share the same location.
  * We can use the low order bit to differentiate if this location points
@@ -175,6 +385,179 @@ static bool marco_fq_flow_is_throttled(const struct marco_fq_flow *f)
     return f->next == &throttled;
 }
 
+static int marco_fq_flow_class(const struct marco_fq_sched_data *q,
+                               const struct marco_fq_flow *f)
+{
+    if (f == &q->internal)
+        return TC_MARCO_FQ_CLASS_INTERNAL;
+    /* orphaned flows are keyed by (hash << 1) | 1, see marco_fq_classify() */
+    if ((unsigned long)f->sk & 1UL)
+        return TC_MARCO_FQ_CLASS_ORPHAN;
+    return TC_MARCO_FQ_CLASS_LOCAL;
+}
+
+/* log2 histograms : bucket i counts values in [2^(i-1), 2^i) */
+static u32 marco_fq_hist_bucket(u64 ns)
+{
+    return min_t(u32, fls64(ns), TC_MARCO_FQ_HIST_BUCKETS - 1);
+}
+
+/* Time spent in the qdisc, to about a microsecond */
+static u64 marco_fq_sojourn_ns(struct sk_buff *skb, u64 now)
+{
+    u32 delta = (u32)(now >> MARCO_FQ_SKB_TIME_SHIFT) - marco_fq_skb_cb(skb)->enqueue_time;
+
+    return (u64)delta << MARCO_FQ_SKB_TIME_SHIFT;
+}
+
+static void marco_fq_record_sojourn(struct marco_fq_sched_data *q, struct sk_buff *skb,
+                                    int cls, u64 now)
+{
+    struct marco_fq_pcpu_stats *pcpu = this_cpu_ptr(q->pcpu_stats);
+    u32 bucket = marco_fq_hist_bucket(marco_fq_sojourn_ns(skb, now));
+
+    u64_stats_update_begin(&pcpu->syncp);
+    u64_stats_inc(&pcpu->sojourn[cls][bucket]);
+    u64_stats_update_end(&pcpu->syncp);
+}
+
+static void marco_fq_stat_add(struct marco_fq_sched_data *q, int stat, u64 val)
+{
+    struct marco_fq_pcpu_stats *pcpu = this_cpu_ptr(q->pcpu_stats);
+
+    u64_stats_update_begin(&pcpu->syncp);
+    u64_stats_add(&pcpu->stats[stat], val);
+    u64_stats_update_end(&pcpu->syncp);
+}
+
+static void marco_fq_stat_inc(struct marco_fq_sched_data *q, int stat)
+{
+    marco_fq_stat_add(q, stat, 1);
+}
+
+static u64 marco_fq_pcpu_read(const struct marco_fq_pcpu_stats *pcpu,
+                              const u64_stats_t *counter)
+{
+    unsigned int start;
+    u64 val;
+
+    do
+    {
+        start = u64_stats_fetch_begin(&pcpu->syncp);
+        val = u64_stats_read(counter);
+    } while (u64_stats_fetch_retry(&pcpu->syncp, start));
+    return val;
+}
+
+/* Profiling uses local_clock() : it is cheap, and the result is wanted
+ * in ns anyway. A stage is accounted when profiling was on at its start.
+ */
+static u64 marco_fq_prof_start(const struct marco_fq_config *cfg)
+{
+    return unlikely(cfg->instr & MARCO_FQ_INSTR_PROFILE) ? local_clock() : 0;
+}
+
+static void marco_fq_prof_end(struct marco_fq_sched_data *q, int stage, u64 start)
+{
+    struct marco_fq_pcpu_stats *pcpu;
+
+    if (likely(!start))
+        return;
+    pcpu = this_cpu_ptr(q->pcpu_stats);
+    u64_stats_update_begin(&pcpu->syncp);
+    u64_stats_add(&pcpu->prof_ns[stage], local_clock() - start);
+    u64_stats_inc(&pcpu->prof_calls[stage]);
+    u64_stats_update_end(&pcpu->syncp);
+}
+
+/* Called from the datapath : polling tc can not see millisecond bursts,
+ * so the state of the qdisc is recorded every occ_interval ns, as long
+ * as packets go through it, in a ring read from debugfs.
+ */
+static void marco_fq_occ_sample(struct Qdisc *sch, const struct marco_fq_config *cfg,
+                                u64 now)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct marco_fq_occ_sample *s;
+
+    if (likely(!(cfg->instr & MARCO_FQ_INSTR_OCC)) || now < q->occ_next)
+        return;
+
+    s = &cfg->occ_ring[q->occ_head++ & (MARCO_FQ_OCC_SAMPLES - 1)];
+    s->time = now;
+    s->qlen = sch->q.qlen;
+    s->backlog = sch->qstats.backlog;
+    s->active_flows = q->flows - q->inactive_flows;
+    s->throttled_flows = q->throttled_flows;
+    s->penalties = q->occ_penalties;
+    q->occ_penalties = 0;
+    q->occ_next = now + cfg->occ_interval;
+}
+
+static u32 marco_fq_flow_id(const struct marco_fq_flow *f)
+{
+    /* orphaned flows are keyed by (hash << 1) | 1, see marco_fq_classify() */
+    if ((unsigned long)f->sk & 1UL)
+        return (unsigned long)f->sk >> 1;
+    return f->socket_hash;
+}
+
+static bool marco_fq_ev_sample(struct marco_fq_sched_data *q,
+                               const struct marco_fq_config *cfg)
+{
+    if (likely(!(cfg->instr & MARCO_FQ_INSTR_EVENTS)))
+        return false;
+    if (++q->ev_count < cfg->ev_sample)
+        return false;
+    q->ev_count = 0;
+    return true;
+}
+
+/* Appends a record to the ring of this cpu. Only this cpu, holding the
+ * qdisc lock, writes to it; readers map it, see marco_fq.h
+ * A packet sampled by the qdisc it was handed over from may find no rings.
+ */
+static void marco_fq_event(struct marco_fq_sched_data *q, const struct marco_fq_flow *f,
+                           struct sk_buff *skb, u8 type, u8 reason, u64 arg)
+{
+    struct marco_fq_ev_ring __percpu *rings = marco_fq_cfg(q)->ev_rings;
+    struct tc_marco_fq_event *e;
+    struct marco_fq_ev_ring *r;
+    u64 head;
+
+    if (unlikely(!rings))
+        return;
+    r = this_cpu_ptr(rings);
+    head = r->hdr->head;
+    e = &r->ev[head & (MARCO_FQ_EV_RECORDS - 1)];
+
+    e->time = ktime_get_ns();
+    e->id = f ? marco_fq_flow_id(f) : 0;
+    e->len = qdisc_pkt_len(skb);
+    e->type = type;
+    e->reason = reason;
+    e->class = f ? marco_fq_flow_class(q, f) : 0;
+    e->qlen = f ? f->qlen : 0;
+    e->arg = arg;
+    /* publish the record before head */
+    smp_store_release(&r->hdr->head, head + 1);
+}
+
+static bool marco_fq_skb_is_sampled(struct sk_buff *skb)
+{
+    return marco_fq_skb_cb(skb)->flags & MARCO_FQ_SKB_SAMPLED;
+}
+
+static int marco_fq_drop(struct sk_buff *skb, struct Qdisc *sch, struct sk_buff **to_free,
+                         const struct marco_fq_flow *f, u8 reason)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+
+    if (unlikely(marco_fq_skb_is_sampled(skb)))
+        marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_DROP, reason, 0);
+    return qdisc_drop(skb, sch, to_free);
+}
+
 static void marco_fq_flow_add_tail(struct marco_fq_flow_head *head, struct marco_fq_flow *flow)
 {
     if (head->first)
@@ -210,7 +593,9 @@ static void marco_fq_flow_set_throttled(struct marco_fq_sched_data *q, struct ma
     rb_link_node(&f->rate_node, parent, p);
     rb_insert_color(&f->rate_node, &q->delayed);
     q->throttled_flows++;
-    q->stat_throttled++;
+    marco_fq_stat_inc(q, MARCO_FQ_STAT_THROTTLED);
+    f->stat_throttled++;
+    f->stat_throttled_ns += f->time_next_packet - q->ktime_cache;
 
     f->next = &throttled;
     if (q->time_next_delayed_flow > f->time_next_packet)
@@ -271,12 +656,13 @@ static void marco_fq_gc(struct marco_fq_sched_data *q,
     }
     q->flows -= fcnt;
     q->inactive_flows -= fcnt;
-    q->stat_gc_flows += fcnt;
+    marco_fq_stat_add(q, MARCO_FQ_STAT_GC_FLOWS, fcnt);
 
     kmem_cache_free_bulk(marco_fq_flow_cachep, fcnt, tofree);
 }
 
-static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco_fq_sched_data *q)
+static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco_fq_sched_data *q,
+                                               const struct marco_fq_config *cfg)
 {
     struct rb_node **p, *parent;
     struct sock *sk = skb->sk;
@@ -298,7 +684,7 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
      */
     if (!sk || sk_listener(sk))
     {
-        unsigned long hash = skb_get_hash(skb) & q->orphan_mask;
+        unsigned long hash = skb_get_hash(skb) & cfg->orphan_mask;
 
         /* By forcing low order bit to 1, we make sure to not
          * collide with a local flow (socket pointers are word aligned)
@@ -308,7 +694,7 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
     }
     else if (sk->sk_state == TCP_CLOSE)
     {
-        unsigned long hash = skb_get_hash(skb) & q->orphan_mask;
+        unsigned long hash = skb_get_hash(skb) & cfg->orphan_mask;
         /*
          * Sockets in TCP_CLOSE are non connected.
          * Typical use case is UDP sockets, they can send packets
@@ -320,6 +706,10 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
         sk = (struct sock *)((hash << 1) | 1UL);
     }
 
+    /* marco_fq_reset() found no spare table, marco_fq_table_work() retries */
+    if (unlikely(!q->fq_root))
+        return &q->internal;
+
     root = &q->fq_root[hash_ptr(sk, q->fq_trees_log)];
 
     if (q->flows >= (2U << q->fq_trees_log) &&
@@ -343,9 +733,9 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
             if (unlikely(skb->sk == sk &&
                          f->socket_hash != sk->sk_hash))
             {
-                f->credit = q->initial_quantum;
+                f->credit = cfg->initial_quantum;
                 f->socket_hash = sk->sk_hash;
-                if (q->rate_enable)
+                if (cfg->rate_enable)
                     smp_store_release(&sk->sk_pacing_status,
                                       SK_PACING_FQ);
                 if (marco_fq_flow_is_throttled(f))
@@ -363,7 +753,7 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
     f = kmem_cache_zalloc(marco_fq_flow_cachep, GFP_ATOMIC | __GFP_NOWARN);
     if (unlikely(!f))
     {
-        q->stat_allocation_errors++;
+        marco_fq_stat_inc(q, MARCO_FQ_STAT_ALLOCATION_ERRORS);
         return &q->internal;
     }
     /* f->t_root is already zeroed after kmem_cache_zalloc() */
@@ -373,11 +763,11 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
     if (skb->sk == sk)
     {
         f->socket_hash = sk->sk_hash;
-        if (q->rate_enable)
+        if (cfg->rate_enable)
             smp_store_release(&sk->sk_pacing_status,
                               SK_PACING_FQ);
     }
-    f->credit = q->initial_quantum;
+    f->credit = cfg->initial_quantum;
 
     rb_link_node(&f->fq_node, parent, p);
     rb_insert_color(&f->fq_node, root);
@@ -387,147 +777,801 @@ static struct marco_fq_flow *marco_fq_classify(struct sk_buff *skb, struct marco
     return f;
 }
 
-static struct sk_buff *marco_fq_peek(struct marco_fq_flow *flow)
+/* Heavy hitters.
+ * top_bytes uses space-saving (Metwally et al.) : a flow missing from the
+ * table evicts the smallest entry and inherits its count as error, so every
+ * flow above 1/TC_MARCO_FQ_TOPK of the traffic is listed. Counts are halved
+ * every second, so the table follows the current heavy hitters.
+ * top_backlog holds the flows with the largest backlog, entries being
+ * exactly the backlog of their flow.
+ * Both are updated under the qdisc lock, at O(1) for flows whose slot hint
+ * is right and O(TC_MARCO_FQ_TOPK) otherwise.
+ */
+#define MARCO_FQ_TOPK_DECAY HZ
+
+static struct marco_fq_topk_entry *marco_fq_topk_find(struct marco_fq_topk *t,
+                                                       u8 *hint, u32 id)
 {
-    struct sk_buff *skb = skb_rb_first(&flow->t_root);
-    struct sk_buff *head = flow->head;
+    u32 i;
 
-    if (!skb)
-        return head;
+    if (*hint < t->used && t->e[*hint].id == id)
+        return &t->e[*hint];
+    for (i = 0; i < t->used; i++)
+    {
+        if (t->e[i].id == id)
+        {
+            *hint = i;
+            return &t->e[i];
+        }
+    }
+    return NULL;
+}
 
-    if (!head)
-        return skb;
+static void marco_fq_topk_update_min(struct marco_fq_topk *t)
+{
+    u32 i;
 
-    if (marco_fq_skb_cb(skb)->time_to_send < marco_fq_skb_cb(head)->time_to_send)
-        return skb;
-    return head;
+    t->min = 0;
+    for (i = 1; i < t->used; i++)
+        if (t->e[i].value < t->e[t->min].value)
+            t->min = i;
 }
 
-static void marco_fq_erase_head(struct Qdisc *sch, struct marco_fq_flow *flow,
-                          struct sk_buff *skb)
+/* Evict the smallest entry, or use a free one, for flow id */
+static struct marco_fq_topk_entry *marco_fq_topk_insert(struct marco_fq_topk *t,
+                                                         u8 *hint, u32 id)
 {
-    if (skb == flow->head)
+    struct marco_fq_topk_entry *e;
+
+    if (t->used < TC_MARCO_FQ_TOPK)
     {
-        flow->head = skb->next;
+        *hint = t->used++;
+        e = &t->e[*hint];
+        e->value = 0;
+        e->error = 0;
     }
     else
     {
-        rb_erase(&skb->rbnode, &flow->t_root);
-        skb->dev = qdisc_dev(sch);
+        *hint = t->min;
+        e = &t->e[*hint];
+        e->error = e->value;
     }
+    e->id = id;
+    e->saddr = 0;
+    e->daddr = 0;
+    return e;
 }
 
-/* Remove one skb from flow queue.
- * This skb must be the return value of prior marco_fq_peek().
- */
-static void marco_fq_dequeue_skb(struct Qdisc *sch, struct marco_fq_flow *flow,
-                           struct sk_buff *skb)
+static void marco_fq_topk_set_addr(struct marco_fq_topk_entry *e,
+                                   const struct sk_buff *skb)
 {
-    marco_fq_erase_head(sch, flow, skb);
-    skb_mark_not_on_list(skb);
-    flow->qlen--;
-    qdisc_qstats_backlog_dec(sch, skb);
-    sch->q.qlen--;
+    if (skb->protocol == htons(ETH_P_IP))
+    {
+        e->saddr = ip_hdr(skb)->saddr;
+        e->daddr = ip_hdr(skb)->daddr;
+    }
+    else
+    {
+        e->saddr = 0;
+        e->daddr = 0;
+    }
 }
 
-static void marco_flow_queue_add(struct marco_fq_flow *flow, struct sk_buff *skb)
+static void marco_fq_topk_bytes(struct marco_fq_sched_data *q, struct marco_fq_flow *f,
+                                const struct sk_buff *skb)
 {
-    struct rb_node **p, *parent;
-    struct sk_buff *head, *aux;
+    struct marco_fq_topk *t = &q->top_bytes;
+    u32 id = marco_fq_flow_id(f);
+    struct marco_fq_topk_entry *e;
+    bool inserted = false;
+    u32 i;
 
-    head = flow->head;
-    if (!head ||
-        marco_fq_skb_cb(skb)->time_to_send >= marco_fq_skb_cb(flow->tail)->time_to_send)
+    if (time_after(jiffies, t->next_decay))
     {
-        if (!head)
-            flow->head = skb;
-        else
-            flow->tail->next = skb;
-        flow->tail = skb;
-        skb->next = NULL;
-        return;
+        for (i = 0; i < t->used; i++)
+        {
+            t->e[i].value >>= 1;
+            t->e[i].error >>= 1;
+        }
+        t->next_decay = jiffies + MARCO_FQ_TOPK_DECAY;
     }
 
-    p = &flow->t_root.rb_node;
-    parent = NULL;
-
-    while (*p)
+    e = marco_fq_topk_find(t, &f->topk_bytes_slot, id);
+    if (!e)
     {
-        parent = *p;
-        aux = rb_to_skb(parent);
-        if (marco_fq_skb_cb(skb)->time_to_send >= marco_fq_skb_cb(aux)->time_to_send)
-            p = &parent->rb_right;
-        else
-            p = &parent->rb_left;
+        e = marco_fq_topk_insert(t, &f->topk_bytes_slot, id);
+        inserted = true;
     }
-    rb_link_node(&skb->rbnode, parent, p);
-    rb_insert_color(&skb->rbnode, &flow->t_root);
+    e->value += qdisc_pkt_len(skb);
+    marco_fq_topk_set_addr(e, skb);
+    if (inserted || f->topk_bytes_slot == t->min)
+        marco_fq_topk_update_min(t);
 }
 
-static bool marco_fq_packet_beyond_horizon(const struct sk_buff *skb,
-                                     const struct marco_fq_sched_data *q)
+/* Called after f->backlog changed, skb is NULL on dequeue */
+static void marco_fq_topk_backlog(struct marco_fq_sched_data *q, struct marco_fq_flow *f,
+                                  const struct sk_buff *skb, u32 old_backlog)
 {
-    return unlikely((s64)skb->tstamp > (s64)(q->ktime_cache + q->horizon));
+    struct marco_fq_topk *t = &q->top_backlog;
+    u32 id = marco_fq_flow_id(f);
+    struct marco_fq_topk_entry *e;
+
+    /* Entries track their flow backlog exactly : a full table whose
+     * smallest entry is above the old backlog can not hold this flow.
+     */
+    if (t->used == TC_MARCO_FQ_TOPK && old_backlog < t->e[t->min].value)
+        e = NULL;
+    else
+        e = marco_fq_topk_find(t, &f->topk_backlog_slot, id);
+
+    if (!e)
+    {
+        if (!f->backlog ||
+            (t->used == TC_MARCO_FQ_TOPK && f->backlog <= t->e[t->min].value))
+            return;
+        e = marco_fq_topk_insert(t, &f->topk_backlog_slot, id);
+        e->error = 0;
+    }
+    else if (!f->backlog)
+    {
+        *e = t->e[--t->used];
+        marco_fq_topk_update_min(t);
+        return;
+    }
+    e->value = f->backlog;
+    if (skb)
+        marco_fq_topk_set_addr(e, skb);
+    marco_fq_topk_update_min(t);
 }
 
-static int marco_fq_enqueue(struct sk_buff *skb, struct Qdisc *sch,
-                      struct sk_buff **to_free)
+/* Pacing accuracy : how long after time_next_packet (pacing rate or EDT)
+ * a packet actually left. Packets which were already due when queued
+ * were not paced, their delay is plain queueing, see sojourn.
+ */
+static void marco_fq_record_pacing(struct marco_fq_sched_data *q, struct marco_fq_flow *f,
+                                   struct sk_buff *skb, u64 time_next_packet, u64 now)
 {
-    struct marco_fq_sched_data *q = qdisc_priv(sch);
-    struct marco_fq_flow *f;
+    struct marco_fq_pacing_worst *w = &q->pacing_worst;
+    int cls = marco_fq_flow_class(q, f);
+    struct marco_fq_pcpu_stats *pcpu;
+    u64 late;
+
+    /* enqueue time is only known to 1 << MARCO_FQ_SKB_TIME_SHIFT ns */
+    if (time_next_packet <= now - marco_fq_sojourn_ns(skb, now) +
+                                (1ULL << MARCO_FQ_SKB_TIME_SHIFT))
+        return;
+    late = now - time_next_packet;
 
-    if (unlikely(sch->q.qlen >= sch->limit)){
-        printk("The queue is full\n");
-        return qdisc_drop(skb, sch, to_free);
-    }
+    pcpu = this_cpu_ptr(q->pcpu_stats);
+    u64_stats_update_begin(&pcpu->syncp);
+    u64_stats_inc(&pcpu->pacing_late[cls][marco_fq_hist_bucket(late)]);
+    u64_stats_update_end(&pcpu->syncp);
 
-    if (!skb->tstamp)
+    if (late <= w->late_ns)
+        return;
+    write_seqcount_begin(&q->top_seq);
+    w->id = marco_fq_flow_id(f);
+    if (skb->protocol == htons(ETH_P_IP))
     {
-        marco_fq_skb_cb(skb)->time_to_send = q->ktime_cache = ktime_get_ns();
+        w->saddr = ip_hdr(skb)->saddr;
+        w->daddr = ip_hdr(skb)->daddr;
     }
     else
     {
-        /* Check if packet timestamp is too far in the future.
-         * Try first if our cached value, to avoid ktime_get_ns()
-         * cost in most cases.
-         */
-        if (marco_fq_packet_beyond_horizon(skb, q))
-        {
-            /* Refresh our cache and check another time */
-            q->ktime_cache = ktime_get_ns();
-            if (marco_fq_packet_beyond_horizon(skb, q))
-            {
-                if (q->horizon_drop)
-                {
-                    q->stat_horizon_drops++;
-                    return qdisc_drop(skb, sch, to_free);
-                }
-                q->stat_horizon_caps++;
-                skb->tstamp = q->ktime_cache + q->horizon;
-            }
-        }
-        marco_fq_skb_cb(skb)->time_to_send = skb->tstamp;
+        w->saddr = 0;
+        w->daddr = 0;
     }
+    w->cls = cls;
+    w->late_ns = late;
+    w->stamp = now;
+    write_seqcount_end(&q->top_seq);
+}
+
+/* TX completion latency.
+ * A sampled packet gets marco_fq_tx_destructor() as destructor when it
+ * leaves the qdisc, its own destructor being saved in a slot of the qdisc,
+ * found back by hashing the skb address : marco_fq_tx_owner[] tells which
+ * qdisc holds the slot of a hash, one packet at a time.
+ * The slots outlive the qdisc as long as packets hold a reference on
+ * them. marco_fq_tx_pending counts the destructors yet to run : the module
+ * is pinned while there are some, so that rmmod fails instead of waiting
+ * on a packet stuck in a driver. The last one drops the module reference
+ * under rcu_read_lock(), fq_module_exit() waits for its grace period.
+ */
+#define MARCO_FQ_TX_SLOTS_LOG 8
+
+struct marco_fq_tx_slot
+{
+    struct sk_buff *skb;
+    void (*destructor)(struct sk_buff *skb);
+    u64 dequeued;
+    int cls;
+};
+
+struct marco_fq_tx
+{
+    spinlock_t lock; /* latency */
+    refcount_t refcnt; /* the qdisc, and each sampled packet */
+    u64 latency[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+    struct marco_fq_tx_slot slots[1 << MARCO_FQ_TX_SLOTS_LOG];
+};
 
-    f = marco_fq_classify(skb, q);
-    if (unlikely(f->qlen >= q->flow_plimit && f != &q->internal))
+static struct marco_fq_tx *marco_fq_tx_owner[1 << MARCO_FQ_TX_SLOTS_LOG];
+static atomic_t marco_fq_tx_pending = ATOMIC_INIT(0);
+
+static void marco_fq_tx_put(struct marco_fq_tx *tx)
+{
+    if (tx && refcount_dec_and_test(&tx->refcnt))
+        kfree(tx);
+}
+
+static void marco_fq_tx_destructor(struct sk_buff *skb)
+{
+    u32 h = hash_ptr(skb, MARCO_FQ_TX_SLOTS_LOG);
+    void (*destructor)(struct sk_buff *skb) = NULL;
+    struct marco_fq_tx_slot *slot;
+    struct marco_fq_tx *tx;
+    unsigned long flags;
+
+    rcu_read_lock();
+    tx = READ_ONCE(marco_fq_tx_owner[h]);
+    if (!WARN_ON_ONCE(!tx || tx->slots[h].skb != skb))
     {
-        q->stat_flows_plimit++;
-        return qdisc_drop(skb, sch, to_free);
+        u64 ns;
+
+        slot = &tx->slots[h];
+        ns = ktime_get_ns() - slot->dequeued;
+        spin_lock_irqsave(&tx->lock, flags);
+        tx->latency[slot->cls][marco_fq_hist_bucket(ns)]++;
+        spin_unlock_irqrestore(&tx->lock, flags);
+        destructor = slot->destructor;
+        slot->skb = NULL;
+        smp_store_release(&marco_fq_tx_owner[h], NULL);
+        marco_fq_tx_put(tx);
     }
 
-    f->qlen++;
-    qdisc_qstats_backlog_inc(sch, skb);
+    skb->destructor = destructor;
+    if (destructor)
+        destructor(skb);
+    if (atomic_dec_and_test(&marco_fq_tx_pending))
+        module_put(THIS_MODULE);
+    rcu_read_unlock();
+}
+
+static void marco_fq_tx_sample(struct marco_fq_sched_data *q, const struct marco_fq_config *cfg,
+                               struct sk_buff *skb, int cls, u64 now)
+{
+    u32 h = hash_ptr(skb, MARCO_FQ_TX_SLOTS_LOG);
+    struct marco_fq_tx_slot *slot;
+
+    if (likely(!(cfg->instr & MARCO_FQ_INSTR_TX)) || ++q->tx_count < cfg->tx_sample)
+        return;
+    /* GSO packets may be segmented after the qdisc : the destructor would
+     * run then, and TCP would no longer recognize tcp_wfree() to move it
+     * to the segments.
+     */
+    if (skb_is_gso(skb))
+        return;
+    q->tx_count = 0;
+
+    if (cmpxchg(&marco_fq_tx_owner[h], NULL, q->tx))
+        return;
+    slot = &q->tx->slots[h];
+    slot->skb = skb;
+    slot->destructor = skb->destructor;
+    slot->dequeued = now;
+    slot->cls = cls;
+    refcount_inc(&q->tx->refcnt);
+    /* our qdisc holds the module */
+    if (atomic_inc_return(&marco_fq_tx_pending) == 1)
+        __module_get(THIS_MODULE);
+    skb->destructor = marco_fq_tx_destructor;
+}
+
+/* Makes room for len bytes at offset from skb->data, moving the bytes
+ * before them (link and network headers) toward the head.
+ */
+static int marco_fq_insert_hdr(struct sk_buff *skb, unsigned int offset, unsigned int len)
+{
+    int err;
+
+    if (skb_headlen(skb) < offset)
+        return -EINVAL;
+    err = skb_cow_head(skb, len);
+    if (err)
+        return err;
+    skb_push(skb, len);
+    memmove(skb->data, skb->data + len, offset);
+    if (skb_mac_header_was_set(skb))
+        skb->mac_header -= len;
+    skb->network_header -= len;
+    return 0;
+}
+
+static void marco_fq_stamp_ipv4(struct sk_buff *skb, struct net_device *dev,
+                                struct tc_marco_fq_telemetry *t)
+{
+    unsigned int noff = skb_network_offset(skb);
+    unsigned int ihl = ip_hdr(skb)->ihl * 4;
+    struct iphdr *iph;
+
+    t->type = TC_MARCO_FQ_TELEMETRY_IPV4;
+    t->len = sizeof(*t);
+    if (ihl + sizeof(*t) > 15 * 4 ||
+        skb->len - noff + sizeof(*t) > dev->mtu ||
+        marco_fq_insert_hdr(skb, noff + ihl, sizeof(*t)))
+        return;
+
+    iph = ip_hdr(skb);
+    memcpy((u8 *)iph + ihl, t, sizeof(*t));
+    iph->ihl += sizeof(*t) / 4;
+    be16_add_cpu(&iph->tot_len, sizeof(*t));
+    ip_send_check(iph);
+}
+
+struct marco_fq_telemetry_dstopt
+{
+    u8 nexthdr;
+    u8 hdrlen; /* in 8 bytes units, not counting the first 8 */
+    struct tc_marco_fq_telemetry t;
+    u8 padn[2];
+} __packed;
+
+/* The transport checksum does not cover extension headers */
+static void marco_fq_stamp_ipv6(struct sk_buff *skb, struct net_device *dev,
+                                struct tc_marco_fq_telemetry *t)
+{
+    unsigned int noff = skb_network_offset(skb);
+    struct marco_fq_telemetry_dstopt *d;
+    struct ipv6hdr *ip6;
+
+    BUILD_BUG_ON(sizeof(*d) % 8);
+
+    t->type = TC_MARCO_FQ_TELEMETRY_IPV6;
+    t->len = sizeof(*t) - 2;
+    /* a destination options header can not come before hop-by-hop ones */
+    if (ipv6_hdr(skb)->nexthdr == NEXTHDR_HOP ||
+        skb->len - noff + sizeof(*d) > dev->mtu ||
+        marco_fq_insert_hdr(skb, noff + sizeof(*ip6), sizeof(*d)))
+        return;
+
+    ip6 = ipv6_hdr(skb);
+    d = (struct marco_fq_telemetry_dstopt *)(ip6 + 1);
+    /* CHECKSUM_COMPLETE (ifb on ingress) covers the header : take it out,
+     * add it back with the option
+     */
+    skb_postpull_rcsum(skb, ip6, sizeof(*ip6));
+    d->nexthdr = ip6->nexthdr;
+    d->hdrlen = sizeof(*d) / 8 - 1;
+    d->t = *t;
+    d->padn[0] = IPV6_TLV_PADN;
+    d->padn[1] = 0;
+    ip6->nexthdr = NEXTHDR_DEST;
+    be16_add_cpu(&ip6->payload_len, sizeof(*d));
+    skb_postpush_rcsum(skb, ip6, sizeof(*ip6) + sizeof(*d));
+}
+
+/* In-band telemetry, at dequeue : a DSCP remark when the packet waited
+ * longer than telemetry_threshold, and (lab use) an option carrying the
+ * time spent in the qdisc. See struct tc_marco_fq_telemetry.
+ */
+static void marco_fq_telemetry(struct Qdisc *sch, const struct marco_fq_config *cfg,
+                               struct sk_buff *skb, u64 now)
+{
+    bool penalized = marco_fq_skb_cb(skb)->flags & MARCO_FQ_SKB_PENALIZED;
+    u64 sojourn = marco_fq_sojourn_ns(skb, now);
+    struct tc_marco_fq_telemetry t;
+    unsigned int noff;
+
+    if (likely(!(cfg->instr & MARCO_FQ_INSTR_TELEMETRY)))
+        return;
+
+    noff = skb_network_offset(skb);
+    if (skb->protocol == htons(ETH_P_IP))
+    {
+        if (skb_ensure_writable(skb, noff + sizeof(struct iphdr)))
+            return;
+        if (cfg->telemetry_dscp && sojourn > cfg->telemetry_threshold)
+            ipv4_change_dsfield(ip_hdr(skb), INET_ECN_MASK, cfg->telemetry_dscp << 2);
+    }
+    else if (skb->protocol == htons(ETH_P_IPV6))
+    {
+        if (skb_ensure_writable(skb, noff + sizeof(struct ipv6hdr)))
+            return;
+        if (cfg->telemetry_dscp && sojourn > cfg->telemetry_threshold)
+        {
+            __be32 from = *(__be32 *)ipv6_hdr(skb);
+
+            ipv6_change_dsfield(ipv6_hdr(skb), INET_ECN_MASK, cfg->telemetry_dscp << 2);
+            /* no header checksum to absorb it, unlike IPv4 : as IP6_ECN_set_ce() */
+            if (skb->ip_summed == CHECKSUM_COMPLETE)
+                skb->csum = csum_add(csum_sub(skb->csum, (__force __wsum)from),
+                                     (__force __wsum)*(__be32 *)ipv6_hdr(skb));
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    /* TSO engines and tunnels are not expected to cope with new options */
+    if (!cfg->telemetry_option || skb_is_gso(skb) || skb->encapsulation)
+        return;
+
+    t.flags = htons(penalized ? TC_MARCO_FQ_TELEMETRY_PENALIZED : 0);
+    t.sojourn_us = htonl(min_t(u64, div_u64(sojourn, NSEC_PER_USEC), U32_MAX));
+    t.penalty_us = htonl(penalized ? MARCO_FQ_PAIR_PENALTY_NS / NSEC_PER_USEC : 0);
+    if (skb->protocol == htons(ETH_P_IP))
+        marco_fq_stamp_ipv4(skb, qdisc_dev(sch), &t);
+    else
+        marco_fq_stamp_ipv6(skb, qdisc_dev(sch), &t);
+}
+
+static struct sk_buff *marco_fq_peek(struct marco_fq_flow *flow)
+{
+    struct sk_buff *skb = skb_rb_first(&flow->t_root);
+    struct sk_buff *head = flow->head;
+
+    if (!skb)
+        return head;
+
+    if (!head)
+        return skb;
+
+    if (marco_fq_skb_cb(skb)->time_to_send < marco_fq_skb_cb(head)->time_to_send)
+        return skb;
+    return head;
+}
+
+static void marco_fq_erase_head(struct Qdisc *sch, struct marco_fq_flow *flow,
+                          struct sk_buff *skb)
+{
+    if (skb == flow->head)
+    {
+        flow->head = skb->next;
+    }
+    else
+    {
+        rb_erase(&skb->rbnode, &flow->t_root);
+        skb->dev = qdisc_dev(sch);
+    }
+}
+
+/* Remove one skb from flow queue.
+ * This skb must be the return value of prior marco_fq_peek().
+ */
+static void marco_fq_unlink_skb(struct Qdisc *sch, struct marco_fq_flow *flow,
+                                struct sk_buff *skb)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+
+    marco_fq_erase_head(sch, flow, skb);
+    skb_mark_not_on_list(skb);
+    flow->qlen--;
+    flow->backlog -= qdisc_pkt_len(skb);
+    if (flow != &q->internal)
+    {
+        write_seqcount_begin(&q->top_seq);
+        marco_fq_topk_backlog(q, flow, NULL, flow->backlog + qdisc_pkt_len(skb));
+        write_seqcount_end(&q->top_seq);
+    }
+    qdisc_qstats_backlog_dec(sch, skb);
+    sch->q.qlen--;
+}
+
+static void marco_fq_dequeue_skb(struct Qdisc *sch, struct marco_fq_flow *flow,
+                           struct sk_buff *skb)
+{
+    marco_fq_unlink_skb(sch, flow, skb);
+    flow->stat_bytes += qdisc_pkt_len(skb);
+    flow->stat_packets++;
+}
+
+static void marco_flow_queue_add(struct marco_fq_flow *flow, struct sk_buff *skb)
+{
+    struct rb_node **p, *parent;
+    struct sk_buff *head, *aux;
+
+    head = flow->head;
+    if (!head ||
+        marco_fq_skb_cb(skb)->time_to_send >= marco_fq_skb_cb(flow->tail)->time_to_send)
+    {
+        if (!head)
+            flow->head = skb;
+        else
+            flow->tail->next = skb;
+        flow->tail = skb;
+        skb->next = NULL;
+        return;
+    }
+
+    p = &flow->t_root.rb_node;
+    parent = NULL;
+
+    while (*p)
+    {
+        parent = *p;
+        aux = rb_to_skb(parent);
+        if (marco_fq_skb_cb(skb)->time_to_send >= marco_fq_skb_cb(aux)->time_to_send)
+            p = &parent->rb_right;
+        else
+            p = &parent->rb_left;
+    }
+    rb_link_node(&skb->rbnode, parent, p);
+    rb_insert_color(&skb->rbnode, &flow->t_root);
+}
+
+/* Queue a TCP retransmit ahead of the new data of the flow,
+ * behind the retransmits already queued :
+ * head->  [retrans pkt 1]
+ *         [retrans pkt 2]
+ *         [ normal pkt 1]
+ * tail->  [ normal pkt 2]
+ * The retransmit takes the departure time of the packet it overtakes,
+ * which keeps the linear list sorted by time_to_send.
+ */
+static void marco_flow_queue_add_retrans(struct marco_fq_flow *flow, struct sk_buff *skb)
+{
+    struct sk_buff *prev = NULL, *next = flow->head;
+    u64 *time_to_send = &marco_fq_skb_cb(skb)->time_to_send;
+
+    while (next && marco_fq_skb_is_retrans(next))
+    {
+        prev = next;
+        next = next->next;
+    }
+    if (!next)
+    {
+        if (prev)
+            *time_to_send = max(*time_to_send, marco_fq_skb_cb(prev)->time_to_send);
+        marco_flow_queue_add(flow, skb);
+        return;
+    }
+
+    *time_to_send = min(*time_to_send, marco_fq_skb_cb(next)->time_to_send);
+    if (prev)
+    {
+        *time_to_send = max(*time_to_send, marco_fq_skb_cb(prev)->time_to_send);
+        prev->next = skb;
+    }
+    else
+    {
+        flow->head = skb;
+    }
+    skb->next = next;
+}
+
+/* Extract the sequence range of the TCP payload carried by skb.
+ * Returns false for non TCP packets, fragments and segments without payload.
+ */
+static bool marco_fq_tcp_seq(const struct sk_buff *skb, u32 *seq, u32 *end_seq)
+{
+    unsigned int thoff = skb_network_offset(skb);
+    const struct tcphdr *th;
+    struct tcphdr _th;
+    int len;
+
+    if (skb->protocol == htons(ETH_P_IP))
+    {
+        const struct iphdr *iph;
+        struct iphdr _iph;
+
+        iph = skb_header_pointer(skb, thoff, sizeof(_iph), &_iph);
+        if (!iph || iph->protocol != IPPROTO_TCP || ip_is_fragment(iph))
+            return false;
+        thoff += iph->ihl * 4;
+        len = ntohs(iph->tot_len) - iph->ihl * 4;
+    }
+    else if (skb->protocol == htons(ETH_P_IPV6))
+    {
+        const struct ipv6hdr *ip6h;
+        struct ipv6hdr _ip6h;
+
+        ip6h = skb_header_pointer(skb, thoff, sizeof(_ip6h), &_ip6h);
+        if (!ip6h || ip6h->nexthdr != IPPROTO_TCP)
+            return false;
+        thoff += sizeof(*ip6h);
+        len = ntohs(ip6h->payload_len);
+    }
+    else
+    {
+        return false;
+    }
+
+    th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+    if (!th)
+        return false;
+    len -= th->doff * 4;
+    if (len <= 0)
+        return false;
+
+    *seq = ntohl(th->seq);
+    *end_seq = *seq + len;
+    return true;
+}
+
+/* TCP retransmit detection.
+ * A locally generated segment starting below snd_nxt was already sent :
+ * TCP only advances snd_nxt after new data went through the qdisc.
+ * For forwarded traffic, the flow remembers the highest sequence seen
+ * for the last connection it carried. Flows shared by several orphaned
+ * connections (see orphan_mask) only see retransmits of back to back
+ * segments of the same connection.
+ */
+static bool marco_fq_tcp_retrans(struct sk_buff *skb, struct marco_fq_flow *f,
+                                 const struct marco_fq_sched_data *q)
+{
+    struct sock *sk = skb->sk;
+    u32 seq, end_seq, hash;
+    bool retrans;
+
+    if (!marco_fq_tcp_seq(skb, &seq, &end_seq))
+        return false;
+
+    if (sk && sk_fullsock(sk))
+        return sk->sk_protocol == IPPROTO_TCP &&
+               before(seq, READ_ONCE(tcp_sk(sk)->snd_nxt));
+
+    hash = skb_get_hash(skb);
+    if (!hash || f == &q->internal)
+        return false;
+
+    if (f->rtx_hash != hash)
+    {
+        f->rtx_hash = hash;
+        f->rtx_high_seq = end_seq;
+        return false;
+    }
+    retrans = before(seq, f->rtx_high_seq);
+    if (after(end_seq, f->rtx_high_seq))
+        f->rtx_high_seq = end_seq;
+    return retrans;
+}
+
+static bool marco_fq_packet_beyond_horizon(const struct sk_buff *skb,
+                                     const struct marco_fq_config *cfg,
+                                     u64 now)
+{
+    return unlikely((s64)skb->tstamp > (s64)(now + cfg->horizon));
+}
+
+static unsigned long marco_fq_skb_rate(const struct sk_buff *skb,
+                                       const struct marco_fq_config *cfg)
+{
+    unsigned long rate = cfg->flow_max_rate;
+    struct sock *sk = skb->sk;
+
+    if (sk && sk_fullsock(sk))
+        rate = min(READ_ONCE(sk->sk_pacing_rate), rate);
+    return rate;
+}
+
+static bool marco_fq_should_segment(const struct sk_buff *skb,
+                                    const struct marco_fq_config *cfg)
+{
+    return cfg->gso_split_rate && cfg->rate_enable && skb_is_gso(skb) &&
+           marco_fq_skb_rate(skb, cfg) < cfg->gso_split_rate;
+}
+
+static int marco_fq_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+                      struct sk_buff **to_free);
+
+/* Software segmentation of a GSO packet, as done by sch_tbf.
+ * A 64KB GSO packet of a slow flow would otherwise leave in one burst,
+ * then hold the flow for a long time : pacing its segments one by one
+ * keeps the flow at MTU granularity.
+ */
+static int marco_fq_segment(struct sk_buff *skb, struct Qdisc *sch,
+                            struct sk_buff **to_free)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    netdev_features_t features = netif_skb_features(skb);
+    unsigned int len = 0, prev_len = qdisc_pkt_len(skb);
+    struct sk_buff *segs, *nskb;
+    int nb = 0;
+
+    segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
+    if (IS_ERR_OR_NULL(segs))
+        return qdisc_drop(skb, sch, to_free);
+
+    marco_fq_stat_inc(q, MARCO_FQ_STAT_GSO_SEGMENTED);
+    skb_list_walk_safe(segs, segs, nskb)
+    {
+        unsigned int seg_len = segs->len;
+
+        skb_mark_not_on_list(segs);
+        qdisc_skb_cb(segs)->pkt_len = seg_len;
+        if (marco_fq_enqueue(segs, sch, to_free) == NET_XMIT_SUCCESS)
+        {
+            len += seg_len;
+            nb++;
+        }
+    }
+    /* Our parents accounted one packet of prev_len bytes */
+    if (nb)
+        qdisc_tree_reduce_backlog(sch, 1 - nb, prev_len - len);
+    consume_skb(skb);
+    return nb ? NET_XMIT_SUCCESS : NET_XMIT_DROP;
+}
+
+static int marco_fq_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+                      struct sk_buff **to_free)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    const struct marco_fq_config *cfg = marco_fq_cfg(q);
+    struct marco_fq_flow *f;
+    u64 now, prof;
+
+    if (unlikely(marco_fq_should_segment(skb, cfg)))
+        return marco_fq_segment(skb, sch, to_free);
+
+    marco_fq_skb_cb(skb)->flags = marco_fq_ev_sample(q, cfg) ? MARCO_FQ_SKB_SAMPLED : 0;
+
+    if (unlikely(sch->q.qlen >= cfg->limit)){
+        printk("The queue is full\n");
+        return marco_fq_drop(skb, sch, to_free, NULL, TC_MARCO_FQ_DROP_LIMIT);
+    }
+
+    /* Sojourn time accounting needs a fresh timestamp for every packet */
+    q->ktime_cache = now = ktime_get_ns();
+    marco_fq_skb_cb(skb)->enqueue_time = now >> MARCO_FQ_SKB_TIME_SHIFT;
+    if (!skb->tstamp)
+    {
+        marco_fq_skb_cb(skb)->time_to_send = now;
+    }
+    else
+    {
+        /* Check if packet timestamp is too far in the future. */
+        if (marco_fq_packet_beyond_horizon(skb, cfg, now))
+        {
+            if (cfg->horizon_drop)
+            {
+                marco_fq_stat_inc(q, MARCO_FQ_STAT_HORIZON_DROPS);
+                return marco_fq_drop(skb, sch, to_free, NULL, TC_MARCO_FQ_DROP_HORIZON);
+            }
+            marco_fq_stat_inc(q, MARCO_FQ_STAT_HORIZON_CAPS);
+            skb->tstamp = now + cfg->horizon;
+        }
+        marco_fq_skb_cb(skb)->time_to_send = skb->tstamp;
+    }
+
+    prof = marco_fq_prof_start(cfg);
+    f = marco_fq_classify(skb, q, cfg);
+    marco_fq_prof_end(q, MARCO_FQ_PROF_CLASSIFY, prof);
+    if (unlikely(f->qlen >= cfg->flow_plimit && f != &q->internal))
+    {
+        marco_fq_stat_inc(q, MARCO_FQ_STAT_FLOWS_PLIMIT);
+        f->stat_drops++;
+        return marco_fq_drop(skb, sch, to_free, f, TC_MARCO_FQ_DROP_FLOW_LIMIT);
+    }
+
+    if (marco_fq_tcp_retrans(skb, f, q))
+    {
+        marco_fq_stat_inc(q, MARCO_FQ_STAT_TCP_RETRANS);
+        marco_fq_skb_cb(skb)->flags |= MARCO_FQ_SKB_RETRANS;
+    }
+
+    f->qlen++;
+    f->backlog += qdisc_pkt_len(skb);
+    if (f != &q->internal)
+    {
+        write_seqcount_begin(&q->top_seq);
+        marco_fq_topk_bytes(q, f, skb);
+        marco_fq_topk_backlog(q, f, skb, f->backlog - qdisc_pkt_len(skb));
+        write_seqcount_end(&q->top_seq);
+    }
+    qdisc_qstats_backlog_inc(sch, skb);
     if (marco_fq_flow_is_detached(f))
     {
         marco_fq_flow_add_tail(&q->new_flows, f);
-        if (time_after(jiffies, f->age + q->flow_refill_delay))
-            f->credit = max_t(u32, f->credit, q->quantum);
+        if (time_after(jiffies, f->age + cfg->flow_refill_delay))
+            f->credit = max_t(u32, f->credit, cfg->quantum);
         q->inactive_flows--;
     }
 
     /* Note: this overwrites f->age */
     printk("add to flow queue\n");
+    prof = marco_fq_prof_start(cfg);
     struct iphdr *iph = ip_hdr(skb);
     __be32 des_ip = iph->daddr;
     __be32 src_ip = iph->saddr;
@@ -562,13 +1606,23 @@ static int marco_fq_enqueue(struct sk_buff *skb, struct Qdisc *sch,
         sprintf(buf, "%pI4", &des_ip);
         printk("Des IP: %s\n", buf);
     }
-    marco_flow_queue_add(f, skb);
+    marco_fq_prof_end(q, MARCO_FQ_PROF_PAIR_ENQUEUE, prof);
+
+    prof = marco_fq_prof_start(cfg);
+    if (cfg->retrans_prio && marco_fq_skb_is_retrans(skb))
+        marco_flow_queue_add_retrans(f, skb);
+    else
+        marco_flow_queue_add(f, skb);
+    marco_fq_prof_end(q, MARCO_FQ_PROF_QUEUE_ADD, prof);
 
     if (unlikely(f == &q->internal))
     {
-        q->stat_internal_packets++;
+        marco_fq_stat_inc(q, MARCO_FQ_STAT_INTERNAL_PACKETS);
     }
     sch->q.qlen++;
+    marco_fq_occ_sample(sch, cfg, now);
+    if (unlikely(marco_fq_skb_is_sampled(skb)))
+        marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_ENQUEUE, 0, 0);
 
     return NET_XMIT_SUCCESS;
 }
@@ -605,25 +1659,38 @@ static void marco_fq_check_throttled(struct marco_fq_sched_data *q, u64 now)
 static struct sk_buff *marco_fq_dequeue(struct Qdisc *sch)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
+    const struct marco_fq_config *cfg;
     struct marco_fq_flow_head *head;
     struct sk_buff *skb;
     struct marco_fq_flow *f;
     unsigned long rate;
+    u64 now, start, prof;
     u32 plen;
-    u64 now;
 
     if (!sch->q.qlen)
         return NULL;
 
+    cfg = marco_fq_cfg(q);
+    start = marco_fq_prof_start(cfg);
     skb = marco_fq_peek(&q->internal);
     if (unlikely(skb))
     {
         marco_fq_dequeue_skb(sch, &q->internal, skb);
+        now = ktime_get_ns();
+        marco_fq_record_sojourn(q, skb, TC_MARCO_FQ_CLASS_INTERNAL, now);
+        marco_fq_tx_sample(q, cfg, skb, TC_MARCO_FQ_CLASS_INTERNAL, now);
+        marco_fq_telemetry(sch, cfg, skb, now);
+        if (unlikely(marco_fq_skb_is_sampled(skb)))
+            marco_fq_event(q, &q->internal, skb, TC_MARCO_FQ_EV_DEQUEUE, 0,
+                           marco_fq_sojourn_ns(skb, now));
         goto out;
     }
 
     q->ktime_cache = now = ktime_get_ns();
+    prof = marco_fq_prof_start(cfg);
     marco_fq_check_throttled(q, now);
+    marco_fq_prof_end(q, MARCO_FQ_PROF_CHECK_THROTTLED, prof);
+    marco_fq_occ_sample(sch, cfg, now);
 begin:
     head = &q->new_flows;
     if (!head->first)
@@ -634,7 +1701,8 @@ begin:
             if (q->time_next_delayed_flow != ~0ULL)
                 qdisc_watchdog_schedule_range_ns(&q->watchdog,
                                                  q->time_next_delayed_flow,
-                                                 q->timer_slack);
+                                                 cfg->timer_slack);
+            marco_fq_prof_end(q, MARCO_FQ_PROF_DEQUEUE, start);
             return NULL;
         }
     }
@@ -642,7 +1710,7 @@ begin:
 
     if (f->credit <= 0)
     {
-        f->credit += q->quantum;
+        f->credit += cfg->quantum;
         head->first = f->next;
         marco_fq_flow_add_tail(&q->old_flows, f);
         goto begin;
@@ -661,6 +1729,8 @@ begin:
 
         struct hash_ip_count *ip_count;
         unsigned int key = jhash_1word((__force u32)src_ip, 0); // check for source ip as it should be the output flow
+
+        prof = marco_fq_prof_start(cfg);
         hash_for_each_possible(ip_count_table, ip_count, hnode, key)
         {
             if (ip_count->s_ip == des_ip && ip_count->d_ip == src_ip && ip_count->count > 0)
@@ -673,26 +1743,43 @@ begin:
                 {
                     sprintf(buf, "%pI4", &des_ip);
                     printk("ip_count->count: %d\t source:%s\n", ip_count->count, buf);
-                    time_next_packet += 10000000;
+                    time_next_packet += MARCO_FQ_PAIR_PENALTY_NS;
+                    marco_fq_skb_cb(skb)->flags |= MARCO_FQ_SKB_PENALIZED;
+                    marco_fq_stat_inc(q, MARCO_FQ_STAT_PENALTIES);
+                    q->occ_penalties++;
+                    if (unlikely(marco_fq_skb_is_sampled(skb)))
+                        marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_PENALTY, 0,
+                                       MARCO_FQ_PAIR_PENALTY_NS);
                     printk("added 10 ms");
                 }
             }
         }
+        marco_fq_prof_end(q, MARCO_FQ_PROF_PAIR_DEQUEUE, prof);
 
         if (now < time_next_packet)
         {
             head->first = f->next;
             f->time_next_packet = time_next_packet;
             marco_fq_flow_set_throttled(q, f);
+            if (unlikely(marco_fq_skb_is_sampled(skb)))
+                marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_THROTTLE, 0,
+                               time_next_packet - now);
             goto begin;
         }
         prefetch(&skb->end);
-        if ((s64)(now - time_next_packet - q->ce_threshold) > 0)
+        if ((s64)(now - time_next_packet - cfg->ce_threshold) > 0)
         {
             INET_ECN_set_ce(skb);
-            q->stat_ce_mark++;
+            marco_fq_stat_inc(q, MARCO_FQ_STAT_CE_MARK);
         }
         marco_fq_dequeue_skb(sch, f, skb);
+        marco_fq_record_sojourn(q, skb, marco_fq_flow_class(q, f), now);
+        marco_fq_record_pacing(q, f, skb, time_next_packet, now);
+        marco_fq_tx_sample(q, cfg, skb, marco_fq_flow_class(q, f), now);
+        marco_fq_telemetry(sch, cfg, skb, now);
+        if (unlikely(marco_fq_skb_is_sampled(skb)))
+            marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_DEQUEUE, 0,
+                           marco_fq_sojourn_ns(skb, now));
     }
     else
     {
@@ -712,10 +1799,10 @@ begin:
     plen = qdisc_pkt_len(skb);
     f->credit -= plen;
 
-    if (!q->rate_enable)
+    if (!cfg->rate_enable)
         goto out;
 
-    rate = q->flow_max_rate;
+    rate = cfg->flow_max_rate;
 
     /* If EDT time was provided for this skb, we need to
      * update f->time_next_packet only if this qdisc enforces
@@ -726,13 +1813,13 @@ begin:
         if (skb->sk)
             rate = min(skb->sk->sk_pacing_rate, rate);
 
-        if (rate <= q->low_rate_threshold)
+        if (rate <= cfg->low_rate_threshold)
         {
             f->credit = 0;
         }
         else
         {
-            plen = max(plen, q->quantum);
+            plen = max(plen, cfg->quantum);
             if (f->credit > 0)
                 goto out;
         }
@@ -750,7 +1837,7 @@ begin:
         if (unlikely(len > NSEC_PER_SEC))
         {
             len = NSEC_PER_SEC;
-            q->stat_pkts_too_long++;
+            marco_fq_stat_inc(q, MARCO_FQ_STAT_PKTS_TOO_LONG);
         }
         /* Account for schedule/timers drifts.
          * f->time_next_packet was set when prior packet was sent,
@@ -762,6 +1849,15 @@ begin:
     }
 out:
     qdisc_bstats_update(sch, skb);
+    if (unlikely(start))
+    {
+        struct marco_fq_pcpu_stats *pcpu = this_cpu_ptr(q->pcpu_stats);
+
+        marco_fq_prof_end(q, MARCO_FQ_PROF_DEQUEUE, start);
+        u64_stats_update_begin(&pcpu->syncp);
+        u64_stats_inc(&pcpu->prof_packets);
+        u64_stats_update_end(&pcpu->syncp);
+    }
     return skb;
 }
 
@@ -780,43 +1876,111 @@ static void marco_fq_flow_purge(struct marco_fq_flow *flow)
     rtnl_kfree_skbs(flow->head, flow->tail);
     flow->head = NULL;
     flow->qlen = 0;
+    flow->backlog = 0;
 }
 
-static void marco_fq_reset(struct Qdisc *sch)
+/* Tables given away by marco_fq_reset(), with their flows and packets */
+struct marco_fq_graveyard
 {
-    struct marco_fq_sched_data *q = qdisc_priv(sch);
-    struct rb_root *root;
-    struct rb_node *p;
-    struct marco_fq_flow *f;
-    unsigned int idx;
+    struct llist_node node;
+    struct rb_root *fq_root;
+    u32 log;
+};
 
-    sch->q.qlen = 0;
-    sch->qstats.backlog = 0;
+static LLIST_HEAD(marco_fq_graveyard);
 
-    marco_fq_flow_purge(&q->internal);
+#define MARCO_FQ_FREE_BULK 64
 
-    if (!q->fq_root)
-        return;
+static void marco_fq_graveyard_work(struct work_struct *work)
+{
+    struct marco_fq_graveyard *g, *next;
+    void *batch[MARCO_FQ_FREE_BULK];
+    struct marco_fq_flow *f, *fn;
+    struct sk_buff *skb, *sn;
+    size_t nr = 0;
+    u32 idx;
 
-    for (idx = 0; idx < (1U << q->fq_trees_log); idx++)
+    llist_for_each_entry_safe(g, next, llist_del_all(&marco_fq_graveyard), node)
     {
-        root = &q->fq_root[idx];
-        while ((p = rb_first(root)) != NULL)
+        for (idx = 0; idx < (1U << g->log); idx++)
         {
-            f = rb_entry(p, struct marco_fq_flow, fq_node);
-            rb_erase(p, root);
+            /* nothing is erased : the trees are thrown away */
+            rbtree_postorder_for_each_entry_safe(f, fn, &g->fq_root[idx], fq_node)
+            {
+                rbtree_postorder_for_each_entry_safe(skb, sn, &f->t_root, rbnode)
+                    kfree_skb(skb);
+                kfree_skb_list(f->head);
+                batch[nr++] = f;
+                if (nr == MARCO_FQ_FREE_BULK)
+                {
+                    kmem_cache_free_bulk(marco_fq_flow_cachep, nr, batch);
+                    nr = 0;
+                    cond_resched();
+                }
+            }
+        }
+        kvfree(g->fq_root);
+        kfree(g);
+    }
+    if (nr)
+        kmem_cache_free_bulk(marco_fq_flow_cachep, nr, batch);
+}
 
-            marco_fq_flow_purge(f);
+static DECLARE_WORK(marco_fq_graveyard_free, marco_fq_graveyard_work);
 
-            kmem_cache_free(marco_fq_flow_cachep, f);
-        }
+static struct rb_root *marco_fq_alloc_table(struct Qdisc *sch, u32 log)
+{
+    struct rb_root *array;
+    u32 idx;
+
+    /* If XPS was setup, we can allocate memory on right NUMA node */
+    array = kvmalloc_node(sizeof(struct rb_root) << log, GFP_KERNEL | __GFP_RETRY_MAYFAIL,
+                          netdev_queue_numa_node_read(sch->dev_queue));
+    if (!array)
+        return NULL;
+
+    for (idx = 0; idx < (1U << log); idx++)
+        array[idx] = RB_ROOT;
+    return array;
+}
+
+/* Refills the spare table a reset swapped in, or gives the qdisc a table
+ * when there was no spare : marco_fq_classify() puts packets in the
+ * internal flow until then. Failed allocations are retried, backing off
+ * up to a second.
+ */
+static void marco_fq_table_work(struct work_struct *work)
+{
+    struct marco_fq_sched_data *q = container_of(to_delayed_work(work),
+                                                 struct marco_fq_sched_data, table_work);
+    struct Qdisc *sch = q->watchdog.qdisc;
+    u32 log = READ_ONCE(q->fq_trees_log);
+    struct rb_root *array;
+    bool more;
+
+    array = marco_fq_alloc_table(sch, log);
+    if (!array)
+    {
+        q->table_backoff = clamp(q->table_backoff * 2, 1UL, (unsigned long)HZ);
+        schedule_delayed_work(&q->table_work, q->table_backoff);
+        return;
     }
-    q->new_flows.first = NULL;
-    q->old_flows.first = NULL;
-    q->delayed = RB_ROOT;
-    q->flows = 0;
-    q->inactive_flows = 0;
-    q->throttled_flows = 0;
+    q->table_backoff = 0;
+
+    sch_tree_lock(sch);
+    if (q->fq_trees_log == log)
+    {
+        if (!q->fq_root)
+            swap(q->fq_root, array);
+        else if (!q->spare_root)
+            swap(q->spare_root, array);
+    }
+    more = !q->fq_root || !q->spare_root;
+    sch_tree_unlock(sch);
+    kvfree(array);
+
+    if (more)
+        schedule_delayed_work(&q->table_work, 0);
 }
 
 static void marco_fq_rehash(struct marco_fq_sched_data *q,
@@ -865,7 +2029,7 @@ static void marco_fq_rehash(struct marco_fq_sched_data *q,
     }
     q->flows -= fcnt;
     q->inactive_flows -= fcnt;
-    q->stat_gc_flows += fcnt;
+    marco_fq_stat_add(q, MARCO_FQ_STAT_GC_FLOWS, fcnt);
 }
 
 static void marco_fq_free(void *addr)
@@ -876,21 +2040,18 @@ static void marco_fq_free(void *addr)
 static int marco_fq_resize(struct Qdisc *sch, u32 log)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
-    struct rb_root *array;
+    struct rb_root *array, *spare = NULL;
     void *old_fq_root;
-    u32 idx;
 
     if (q->fq_root && log == q->fq_trees_log)
         return 0;
 
-    /* If XPS was setup, we can allocate memory on right NUMA node */
-    array = kvmalloc_node(sizeof(struct rb_root) << log, GFP_KERNEL | __GFP_RETRY_MAYFAIL,
-                          netdev_queue_numa_node_read(sch->dev_queue));
+    array = marco_fq_alloc_table(sch, log);
     if (!array)
         return -ENOMEM;
-
-    for (idx = 0; idx < (1U << log); idx++)
-        array[idx] = RB_ROOT;
+    /* the spare has to match the new size, marco_fq_table_work() retries */
+    if (!q->spare_root || log != q->fq_trees_log)
+        spare = marco_fq_alloc_table(sch, log);
 
     sch_tree_lock(sch);
 
@@ -898,17 +2059,22 @@ static int marco_fq_resize(struct Qdisc *sch, u32 log)
     if (old_fq_root)
         marco_fq_rehash(q, old_fq_root, q->fq_trees_log, array, log);
 
+    if (spare || log != q->fq_trees_log)
+        swap(q->spare_root, spare);
     q->fq_root = array;
     q->fq_trees_log = log;
 
     sch_tree_unlock(sch);
 
     marco_fq_free(old_fq_root);
+    marco_fq_free(spare);
+    if (!q->spare_root)
+        schedule_delayed_work(&q->table_work, 0);
 
     return 0;
 }
 
-static const struct nla_policy fq_policy[TCA_FQ_MAX + 1] = {
+static const struct nla_policy fq_policy[TCA_MARCO_FQ_MAX + 1] = {
     [TCA_FQ_UNSPEC] = {.strict_start_type = TCA_FQ_TIMER_SLACK},
 
     [TCA_FQ_PLIMIT] = {.type = NLA_U32},
@@ -926,26 +2092,436 @@ static const struct nla_policy fq_policy[TCA_FQ_MAX + 1] = {
     [TCA_FQ_TIMER_SLACK] = {.type = NLA_U32},
     [TCA_FQ_HORIZON] = {.type = NLA_U32},
     [TCA_FQ_HORIZON_DROP] = {.type = NLA_U8},
+
+    [TCA_MARCO_FQ_GSO_SPLIT_RATE] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_RETRANS_PRIO] = {.type = NLA_U8},
+    [TCA_MARCO_FQ_DUMP_MIN_BACKLOG] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_DUMP_THROTTLED] = {.type = NLA_U8},
+    [TCA_MARCO_FQ_OCC_INTERVAL] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_EVENT_SAMPLE] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_PROFILE] = {.type = NLA_U8},
+    [TCA_MARCO_FQ_TX_SAMPLE] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_TELEMETRY_THRESHOLD] = {.type = NLA_U32},
+    [TCA_MARCO_FQ_TELEMETRY_DSCP] = {.type = NLA_U8},
+    [TCA_MARCO_FQ_TELEMETRY_OPTION] = {.type = NLA_U8},
+    [TCA_MARCO_FQ_LIMIT_TRIM] = {.type = NLA_U8},
 };
 
+static void marco_fq_ev_free(struct marco_fq_ev_ring __percpu *rings)
+{
+    int cpu;
+
+    if (!rings)
+        return;
+    for_each_possible_cpu(cpu)
+        vfree(per_cpu_ptr(rings, cpu)->buf);
+    free_percpu(rings);
+}
+
+/* Rings are mapped by userspace : vmalloc_user() zeroes them and
+ * allows remap_vmalloc_range()
+ */
+static struct marco_fq_ev_ring __percpu *marco_fq_ev_alloc(void)
+{
+    struct marco_fq_ev_ring __percpu *rings;
+    int cpu;
+
+    rings = alloc_percpu(struct marco_fq_ev_ring);
+    if (!rings)
+        return NULL;
+    for_each_possible_cpu(cpu)
+    {
+        struct marco_fq_ev_ring *r = per_cpu_ptr(rings, cpu);
+
+        r->buf = vmalloc_user(PAGE_SIZE +
+                              MARCO_FQ_EV_RECORDS * sizeof(struct tc_marco_fq_event));
+        if (!r->buf)
+        {
+            marco_fq_ev_free(rings);
+            return NULL;
+        }
+        r->hdr = r->buf;
+        r->hdr->records = MARCO_FQ_EV_RECORDS;
+        r->hdr->offset = PAGE_SIZE;
+        r->ev = r->buf + PAGE_SIZE;
+    }
+    return rings;
+}
+
+struct marco_fq_trim
+{
+    u32 level;  /* flows are cut down to level packets */
+    u32 budget; /* packets left to drop */
+    u32 need;   /* packets above level, when not dropping */
+    bool drop;
+    u32 count;
+    unsigned int len;
+};
+
+static void marco_fq_trim_flow(struct Qdisc *sch, struct marco_fq_flow *f,
+                               struct marco_fq_trim *t)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+
+    if (f->qlen <= t->level)
+        return;
+    if (!t->drop)
+    {
+        t->need += f->qlen - t->level;
+        return;
+    }
+    while (f->qlen > t->level && t->budget)
+    {
+        struct sk_buff *skb = marco_fq_peek(f);
+
+        marco_fq_unlink_skb(sch, f, skb);
+        f->stat_drops++;
+        if (unlikely(marco_fq_skb_is_sampled(skb)))
+            marco_fq_event(q, f, skb, TC_MARCO_FQ_EV_DROP, TC_MARCO_FQ_DROP_TRIM, 0);
+        t->count++;
+        t->len += qdisc_pkt_len(skb);
+        t->budget--;
+        rtnl_kfree_skbs(skb, skb);
+    }
+}
+
+/* Flows holding packets are on the new or old lists, or throttled.
+ * Emptied flows stay there, dequeue detaches them as usual.
+ */
+static void marco_fq_trim_pass(struct Qdisc *sch, struct marco_fq_trim *t)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct marco_fq_flow *f;
+    struct rb_node *p;
+
+    for (f = q->new_flows.first; f; f = f->next)
+        marco_fq_trim_flow(sch, f, t);
+    for (f = q->old_flows.first; f; f = f->next)
+        marco_fq_trim_flow(sch, f, t);
+    for (p = rb_first(&q->delayed); p; p = rb_next(p))
+        marco_fq_trim_flow(sch, rb_entry(p, struct marco_fq_flow, rate_node), t);
+}
+
+/* Brings qlen back to limit by dropping from the head of the longest
+ * flows : they are all cut to the same level, the shorter ones are left
+ * alone. Unlike a dequeue, this does not look at the pair table, and
+ * the internal flow is left to drain.
+ */
+static void marco_fq_trim(struct Qdisc *sch, u32 limit)
+{
+    struct marco_fq_trim t = {};
+    u32 excess, lo, hi;
+
+    if (sch->q.qlen <= limit)
+        return;
+    excess = sch->q.qlen - limit;
+
+    /* lowest level at which cutting drops no more than the excess */
+    lo = 0;
+    hi = sch->q.qlen;
+    while (lo < hi)
+    {
+        t.level = lo + (hi - lo) / 2;
+        t.need = 0;
+        marco_fq_trim_pass(sch, &t);
+        if (t.need <= excess)
+            hi = t.level;
+        else
+            lo = t.level + 1;
+    }
+
+    t.drop = true;
+    t.level = lo;
+    t.budget = excess;
+    marco_fq_trim_pass(sch, &t);
+    /* the flows left at this level give one more packet each */
+    if (t.budget && lo)
+    {
+        t.level = lo - 1;
+        marco_fq_trim_pass(sch, &t);
+    }
+    qdisc_tree_reduce_backlog(sch, t.count, t.len);
+}
+
+/* On tc qdisc replace, the qdisc being replaced is still attached to our
+ * queue while we are initialized : a root marco_fq, or one under mq.
+ * The same ops guarantee the same layout.
+ */
+static struct Qdisc *marco_fq_predecessor(struct Qdisc *sch)
+{
+    struct Qdisc *old = sch->dev_queue->qdisc_sleeping;
+
+    if (!old || old == sch || old->ops != sch->ops || old->parent != sch->parent)
+        return NULL;
+    return old;
+}
+
+/* Pairs a new qdisc with the one it replaces. The flows, packets and
+ * pacing state move when the graft resets the old qdisc, as it can no
+ * longer fail by then : dev_deactivate(), or destroy if the device is
+ * down. marco_fq_destroy() unpairs them if the new one never gets there.
+ */
+static void marco_fq_pair(struct Qdisc *sch)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct Qdisc *old = marco_fq_predecessor(sch);
+    struct marco_fq_sched_data *oq;
+
+    if (!old)
+        return;
+    oq = qdisc_priv(old);
+    oq->successor = sch;
+    q->predecessor = old;
+}
+
+/* Nothing else dequeues the adopted packets before the next enqueue :
+ * kick the qdisc once the graft attached it to its queue.
+ */
+static void marco_fq_kick_work(struct work_struct *work)
+{
+    struct marco_fq_sched_data *q = container_of(to_delayed_work(work),
+                                                 struct marco_fq_sched_data, kick_work);
+    struct Qdisc *sch = q->watchdog.qdisc;
+    bool attached;
+
+    rcu_read_lock();
+    attached = rcu_dereference(sch->dev_queue->qdisc) == sch;
+    if (attached)
+        __netif_schedule(sch);
+    rcu_read_unlock();
+
+    if (!attached && time_before(jiffies, q->kick_deadline))
+        schedule_delayed_work(&q->kick_work, 1);
+}
+
+/* Called by the reset of the old qdisc, under its lock or from destroy,
+ * while the new one is not attached yet. The old qdisc is left empty,
+ * with the empty table of the new one or its own emptied one. The pair
+ * table is global to the module, it is kept as is.
+ * Trim and rehash expect the qdisc lock with BH off, which a reset from
+ * destroy does not give : the lock of the new qdisc is taken, nested in
+ * the old one's when dev_reset_queue() holds it.
+ */
+static void marco_fq_handover(struct Qdisc *old)
+{
+    struct marco_fq_sched_data *oq = qdisc_priv(old);
+    struct Qdisc *sch = oq->successor;
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    const struct marco_fq_config *cfg = rtnl_dereference(q->cfg);
+
+    oq->successor = NULL;
+    q->predecessor = NULL;
+
+    local_bh_disable();
+    spin_lock_nested(qdisc_lock(sch), SINGLE_DEPTH_NESTING);
+
+    q->internal = oq->internal;
+    oq->internal.head = NULL;
+    oq->internal.t_root = RB_ROOT;
+    oq->internal.qlen = 0;
+    oq->internal.backlog = 0;
+
+    q->new_flows = oq->new_flows;
+    q->old_flows = oq->old_flows;
+    q->delayed = oq->delayed;
+    q->time_next_delayed_flow = oq->time_next_delayed_flow;
+    q->unthrottle_latency_ns = oq->unthrottle_latency_ns;
+    q->flows = oq->flows;
+    q->inactive_flows = oq->inactive_flows;
+    q->throttled_flows = oq->throttled_flows;
+    write_seqcount_begin(&q->top_seq);
+    q->top_bytes = oq->top_bytes;
+    q->top_backlog = oq->top_backlog;
+    write_seqcount_end(&q->top_seq);
+    /* requeued by the driver, or held back by a stopped tx queue */
+    skb_queue_splice_tail_init(&old->gso_skb, &sch->gso_skb);
+    skb_queue_splice_tail_init(&old->skb_bad_txq, &sch->skb_bad_txq);
+    sch->q.qlen = old->q.qlen;
+    sch->qstats.backlog = old->qstats.backlog;
+
+    oq->new_flows.first = NULL;
+    oq->old_flows.first = NULL;
+    oq->delayed = RB_ROOT;
+    oq->time_next_delayed_flow = ~0ULL;
+    oq->flows = 0;
+    oq->inactive_flows = 0;
+    oq->throttled_flows = 0;
+    old->q.qlen = 0;
+    old->qstats.backlog = 0;
+
+    if (oq->fq_root)
+    {
+        if (oq->fq_trees_log == q->fq_trees_log)
+            swap(q->fq_root, oq->fq_root);
+        else
+            marco_fq_rehash(q, oq->fq_root, oq->fq_trees_log, q->fq_root, q->fq_trees_log);
+    }
+
+    if (cfg->limit_trim)
+        marco_fq_trim(sch, cfg->limit);
+
+    spin_unlock(qdisc_lock(sch));
+    local_bh_enable();
+
+    q->kick_deadline = jiffies + HZ;
+    schedule_delayed_work(&q->kick_work, 0);
+}
+
+/* qdisc_destroy() resets once the last reference is gone, a failed
+ * qdisc_create() only calls marco_fq_destroy()
+ */
+static bool marco_fq_dying(struct Qdisc *sch)
+{
+    const struct marco_fq_sched_data *q = qdisc_priv(sch);
+
+    return !refcount_read(&sch->refcnt) || q->destroying;
+}
+
+/* May run under the qdisc lock (dev_deactivate()) : the flow table is
+ * detached and freed by marco_fq_graveyard_work(), a table with millions
+ * of flows would otherwise stall RTNL, and the qdisc, for a long time.
+ * A qdisc being replaced by a marco_fq hands everything over instead.
+ */
+static void marco_fq_reset(struct Qdisc *sch)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct marco_fq_graveyard *g;
+    struct rb_root *root;
+    struct rb_node *p;
+    struct marco_fq_flow *f;
+    unsigned int idx;
+
+    if (q->successor)
+    {
+        marco_fq_handover(sch);
+        return;
+    }
+
+    sch->q.qlen = 0;
+    sch->qstats.backlog = 0;
+
+    marco_fq_flow_purge(&q->internal);
+
+    /* The other top_seq writers hold the qdisc lock with BH off, as do the
+     * resets of a living qdisc (dev_reset_queue(), qdisc_purge_queue()).
+     * Those of destroy are preemptible, and the tables die with the qdisc.
+     */
+    if (!marco_fq_dying(sch))
+    {
+        write_seqcount_begin(&q->top_seq);
+        memset(&q->top_bytes, 0, sizeof(q->top_bytes));
+        memset(&q->top_backlog, 0, sizeof(q->top_backlog));
+        memset(&q->pacing_worst, 0, sizeof(q->pacing_worst));
+        write_seqcount_end(&q->top_seq);
+    }
+
+    if (!q->fq_root)
+        return;
+
+    g = kmalloc(sizeof(*g), GFP_ATOMIC | __GFP_NOWARN);
+    if (likely(g))
+    {
+        g->fq_root = q->fq_root;
+        g->log = q->fq_trees_log;
+        q->fq_root = q->spare_root;
+        q->spare_root = NULL;
+        if (llist_add(&g->node, &marco_fq_graveyard))
+            queue_work(system_unbound_wq, &marco_fq_graveyard_free);
+        if (!marco_fq_dying(sch))
+            schedule_delayed_work(&q->table_work, 0);
+    }
+    else
+    {
+        for (idx = 0; idx < (1U << q->fq_trees_log); idx++)
+        {
+            root = &q->fq_root[idx];
+            while ((p = rb_first(root)) != NULL)
+            {
+                f = rb_entry(p, struct marco_fq_flow, fq_node);
+                rb_erase(p, root);
+
+                marco_fq_flow_purge(f);
+
+                kmem_cache_free(marco_fq_flow_cachep, f);
+            }
+        }
+    }
+    q->new_flows.first = NULL;
+    q->old_flows.first = NULL;
+    q->delayed = RB_ROOT;
+    q->flows = 0;
+    q->inactive_flows = 0;
+    q->throttled_flows = 0;
+}
+
+/* Sampling, profiling and telemetry, as tested once per packet */
+static u8 marco_fq_instr(const struct marco_fq_config *cfg)
+{
+    u8 instr = 0;
+
+    if (cfg->profile)
+        instr |= MARCO_FQ_INSTR_PROFILE;
+    if (cfg->occ_interval && cfg->occ_ring)
+        instr |= MARCO_FQ_INSTR_OCC;
+    if (cfg->ev_sample && cfg->ev_rings)
+        instr |= MARCO_FQ_INSTR_EVENTS;
+    if (cfg->tx_sample)
+        instr |= MARCO_FQ_INSTR_TX;
+    if (cfg->telemetry_dscp || cfg->telemetry_option)
+        instr |= MARCO_FQ_INSTR_TELEMETRY;
+    return instr;
+}
+
 static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
                      struct netlink_ext_ack *extack)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
-    struct nlattr *tb[TCA_FQ_MAX + 1];
-    int err, drop_count = 0;
-    unsigned drop_len = 0;
+    struct nlattr *tb[TCA_MARCO_FQ_MAX + 1];
+    struct marco_fq_occ_sample *occ_ring = NULL;
+    struct marco_fq_ev_ring __percpu *ev_rings = NULL;
+    struct marco_fq_config *cfg, *old;
+    int err;
     u32 fq_log;
 
     if (!opt)
         return -EINVAL;
 
-    err = nla_parse_nested_deprecated(tb, TCA_FQ_MAX, opt, fq_policy,
+    err = nla_parse_nested_deprecated(tb, TCA_MARCO_FQ_MAX, opt, fq_policy,
                                       NULL);
     if (err < 0)
         return err;
 
-    sch_tree_lock(sch);
+    /* The occupancy ring is allocated the first time it is enabled */
+    if (tb[TCA_MARCO_FQ_OCC_INTERVAL] && nla_get_u32(tb[TCA_MARCO_FQ_OCC_INTERVAL]) &&
+        !q->occ_ring)
+    {
+        occ_ring = kvcalloc(MARCO_FQ_OCC_SAMPLES, sizeof(*occ_ring), GFP_KERNEL);
+        if (!occ_ring)
+            return -ENOMEM;
+    }
+
+    /* So are the event rings */
+    if (tb[TCA_MARCO_FQ_EVENT_SAMPLE] && nla_get_u32(tb[TCA_MARCO_FQ_EVENT_SAMPLE]) &&
+        !q->ev_rings)
+    {
+        ev_rings = marco_fq_ev_alloc();
+        if (!ev_rings)
+        {
+            kvfree(occ_ring);
+            return -ENOMEM;
+        }
+    }
+
+    /* Tunables are applied to a copy, the datapath keeps running on the
+     * current config until the new one is complete and valid.
+     */
+    old = rtnl_dereference(q->cfg);
+    cfg = kmemdup(old, sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+    {
+        err = -ENOMEM;
+        goto out_free;
+    }
 
     fq_log = q->fq_trees_log;
 
@@ -959,10 +2535,10 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
             err = -EINVAL;
     }
     if (tb[TCA_FQ_PLIMIT])
-        sch->limit = nla_get_u32(tb[TCA_FQ_PLIMIT]);
+        cfg->limit = nla_get_u32(tb[TCA_FQ_PLIMIT]);
 
     if (tb[TCA_FQ_FLOW_PLIMIT])
-        q->flow_plimit = nla_get_u32(tb[TCA_FQ_FLOW_PLIMIT]);
+        cfg->flow_plimit = nla_get_u32(tb[TCA_FQ_FLOW_PLIMIT]);
 
     if (tb[TCA_FQ_QUANTUM])
     {
@@ -970,7 +2546,7 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
 
         if (quantum > 0 && quantum <= (1 << 20))
         {
-            q->quantum = quantum;
+            cfg->quantum = quantum;
         }
         else
         {
@@ -980,7 +2556,7 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
     }
 
     if (tb[TCA_FQ_INITIAL_QUANTUM])
-        q->initial_quantum = nla_get_u32(tb[TCA_FQ_INITIAL_QUANTUM]);
+        cfg->initial_quantum = nla_get_u32(tb[TCA_FQ_INITIAL_QUANTUM]);
 
     if (tb[TCA_FQ_FLOW_DEFAULT_RATE])
         pr_warn_ratelimited("sch_fq: defrate %u ignored.\n",
@@ -990,10 +2566,10 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
     {
         u32 rate = nla_get_u32(tb[TCA_FQ_FLOW_MAX_RATE]);
 
-        q->flow_max_rate = (rate == ~0U) ? ~0UL : rate;
+        cfg->flow_max_rate = (rate == ~0U) ? ~0UL : rate;
     }
     if (tb[TCA_FQ_LOW_RATE_THRESHOLD])
-        q->low_rate_threshold =
+        cfg->low_rate_threshold =
             nla_get_u32(tb[TCA_FQ_LOW_RATE_THRESHOLD]);
 
     if (tb[TCA_FQ_RATE_ENABLE])
@@ -1001,7 +2577,7 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
         u32 enable = nla_get_u32(tb[TCA_FQ_RATE_ENABLE]);
 
         if (enable <= 1)
-            q->rate_enable = enable;
+            cfg->rate_enable = enable;
         else
             err = -EINVAL;
     }
@@ -1010,103 +2586,370 @@ static int marco_fq_change(struct Qdisc *sch, struct nlattr *opt,
     {
         u32 usecs_delay = nla_get_u32(tb[TCA_FQ_FLOW_REFILL_DELAY]);
 
-        q->flow_refill_delay = usecs_to_jiffies(usecs_delay);
+        cfg->flow_refill_delay = usecs_to_jiffies(usecs_delay);
     }
 
     if (tb[TCA_FQ_ORPHAN_MASK])
-        q->orphan_mask = nla_get_u32(tb[TCA_FQ_ORPHAN_MASK]);
+        cfg->orphan_mask = nla_get_u32(tb[TCA_FQ_ORPHAN_MASK]);
 
     if (tb[TCA_FQ_CE_THRESHOLD])
-        q->ce_threshold = (u64)NSEC_PER_USEC *
+        cfg->ce_threshold = (u64)NSEC_PER_USEC *
                           nla_get_u32(tb[TCA_FQ_CE_THRESHOLD]);
 
     if (tb[TCA_FQ_TIMER_SLACK])
-        q->timer_slack = nla_get_u32(tb[TCA_FQ_TIMER_SLACK]);
+        cfg->timer_slack = nla_get_u32(tb[TCA_FQ_TIMER_SLACK]);
 
     if (tb[TCA_FQ_HORIZON])
-        q->horizon = (u64)NSEC_PER_USEC *
+        cfg->horizon = (u64)NSEC_PER_USEC *
                      nla_get_u32(tb[TCA_FQ_HORIZON]);
 
     if (tb[TCA_FQ_HORIZON_DROP])
-        q->horizon_drop = nla_get_u8(tb[TCA_FQ_HORIZON_DROP]);
+        cfg->horizon_drop = nla_get_u8(tb[TCA_FQ_HORIZON_DROP]);
 
-    if (!err)
+    if (tb[TCA_MARCO_FQ_GSO_SPLIT_RATE])
+        cfg->gso_split_rate = nla_get_u32(tb[TCA_MARCO_FQ_GSO_SPLIT_RATE]);
+
+    if (tb[TCA_MARCO_FQ_RETRANS_PRIO])
+        cfg->retrans_prio = nla_get_u8(tb[TCA_MARCO_FQ_RETRANS_PRIO]);
+
+    if (tb[TCA_MARCO_FQ_DUMP_MIN_BACKLOG])
+        cfg->dump_min_backlog = nla_get_u32(tb[TCA_MARCO_FQ_DUMP_MIN_BACKLOG]);
+
+    if (tb[TCA_MARCO_FQ_DUMP_THROTTLED])
+        cfg->dump_throttled = nla_get_u8(tb[TCA_MARCO_FQ_DUMP_THROTTLED]);
+
+    if (tb[TCA_MARCO_FQ_LIMIT_TRIM])
+        cfg->limit_trim = nla_get_u8(tb[TCA_MARCO_FQ_LIMIT_TRIM]);
+
+    if (tb[TCA_MARCO_FQ_PROFILE])
+        cfg->profile = nla_get_u8(tb[TCA_MARCO_FQ_PROFILE]);
+
+    if (tb[TCA_MARCO_FQ_TELEMETRY_THRESHOLD])
+        cfg->telemetry_threshold = (u64)NSEC_PER_USEC *
+                                 nla_get_u32(tb[TCA_MARCO_FQ_TELEMETRY_THRESHOLD]);
+
+    if (tb[TCA_MARCO_FQ_TELEMETRY_DSCP])
     {
+        u8 dscp = nla_get_u8(tb[TCA_MARCO_FQ_TELEMETRY_DSCP]);
 
-        sch_tree_unlock(sch);
-        err = marco_fq_resize(sch, fq_log);
-        sch_tree_lock(sch);
+        if (dscp <= 63)
+        {
+            cfg->telemetry_dscp = dscp;
+        }
+        else
+        {
+            NL_SET_ERR_MSG_MOD(extack, "invalid telemetry DSCP");
+            err = -EINVAL;
+        }
     }
-    while (sch->q.qlen > sch->limit)
+
+    if (tb[TCA_MARCO_FQ_TELEMETRY_OPTION])
+        cfg->telemetry_option = nla_get_u8(tb[TCA_MARCO_FQ_TELEMETRY_OPTION]);
+
+    if (tb[TCA_MARCO_FQ_TX_SAMPLE])
+        cfg->tx_sample = nla_get_u32(tb[TCA_MARCO_FQ_TX_SAMPLE]);
+
+    if (tb[TCA_MARCO_FQ_OCC_INTERVAL])
+        cfg->occ_interval = (u64)NSEC_PER_USEC *
+                            nla_get_u32(tb[TCA_MARCO_FQ_OCC_INTERVAL]);
+
+    if (tb[TCA_MARCO_FQ_EVENT_SAMPLE])
+        cfg->ev_sample = nla_get_u32(tb[TCA_MARCO_FQ_EVENT_SAMPLE]);
+
+    if (err)
     {
-        struct sk_buff *skb = marco_fq_dequeue(sch);
+        kfree(cfg);
+        goto out_free;
+    }
 
-        if (!skb)
-            break;
-        drop_len += qdisc_pkt_len(skb);
-        rtnl_kfree_skbs(skb, skb);
-        drop_count++;
+    /* The rings are published before a config using them.
+     * marco_fq_occ_show() and marco_fq_events_mmap() look at them
+     * without RTNL.
+     */
+    if (occ_ring)
+    {
+        smp_store_release(&q->occ_ring, occ_ring);
+        cfg->occ_ring = occ_ring;
+    }
+    if (ev_rings)
+    {
+        smp_store_release(&q->ev_rings, ev_rings);
+        cfg->ev_rings = ev_rings;
     }
-    qdisc_tree_reduce_backlog(sch, drop_count, drop_len);
+    cfg->instr = marco_fq_instr(cfg);
 
-    sch_tree_unlock(sch);
+    old = rcu_replace_pointer(q->cfg, cfg, lockdep_rtnl_is_held());
+    kfree_rcu(old, rcu);
+
+    /* Filters changed, a paginated dump can not resume */
+    q->walk_count = 0;
+
+    err = marco_fq_resize(sch, fq_log);
+
+    /* Without limit_trim, packets above a lowered limit are not dropped :
+     * enqueue refuses new ones until dequeue drained the excess.
+     */
+    if (cfg->limit_trim)
+    {
+        sch_tree_lock(sch);
+        marco_fq_trim(sch, cfg->limit);
+        sch_tree_unlock(sch);
+    }
+    return err;
+
+out_free:
+    kvfree(occ_ring);
+    marco_fq_ev_free(ev_rings);
     return err;
 }
 
 static void marco_fq_destroy(struct Qdisc *sch)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct marco_fq_sched_data *oq;
 
+    /* waits for readers of the debugfs files */
+    debugfs_remove_recursive(q->debugfs_dir);
+    q->destroying = true;
+    if (q->predecessor)
+    {
+        /* create or graft failed, the old qdisc stays */
+        oq = qdisc_priv(q->predecessor);
+        oq->successor = NULL;
+    }
     marco_fq_reset(sch);
+    cancel_delayed_work_sync(&q->table_work);
+    cancel_delayed_work_sync(&q->kick_work);
     marco_fq_free(q->fq_root);
+    marco_fq_free(q->spare_root);
     qdisc_watchdog_cancel(&q->watchdog);
+    marco_fq_tx_put(q->tx);
+    free_percpu(q->pcpu_stats);
+    kfree_rcu(rcu_dereference_protected(q->cfg, 1), rcu);
+    kvfree(q->occ_ring);
+    /* pages still mapped by readers are kept until they unmap them */
+    marco_fq_ev_free(q->ev_rings);
+}
+
+static int marco_fq_occ_show(struct seq_file *m, void *v)
+{
+    struct Qdisc *sch = m->private;
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct marco_fq_occ_sample *ring, *src;
+    u32 head, i;
+
+    /* Copy the ring, so that the qdisc lock is held only for a memcpy() */
+    ring = kvmalloc_array(MARCO_FQ_OCC_SAMPLES, sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    sch_tree_lock(sch);
+    head = q->occ_head;
+    src = smp_load_acquire(&q->occ_ring);
+    if (src)
+        memcpy(ring, src, MARCO_FQ_OCC_SAMPLES * sizeof(*ring));
+    else
+        head = 0;
+    sch_tree_unlock(sch);
+
+    seq_puts(m, "# time_ns qlen backlog active_flows throttled_flows penalties\n");
+    for (i = head - min_t(u32, head, MARCO_FQ_OCC_SAMPLES); i != head; i++)
+    {
+        const struct marco_fq_occ_sample *s = &ring[i & (MARCO_FQ_OCC_SAMPLES - 1)];
+
+        seq_printf(m, "%llu %u %u %u %u %u\n", s->time, s->qlen, s->backlog,
+                   s->active_flows, s->throttled_flows, s->penalties);
+    }
+    kvfree(ring);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(marco_fq_occ);
+
+static const char *const marco_fq_prof_names[MARCO_FQ_PROF_MAX] = {
+    [MARCO_FQ_PROF_CLASSIFY] = "classify",
+    [MARCO_FQ_PROF_PAIR_ENQUEUE] = "pair_enqueue",
+    [MARCO_FQ_PROF_QUEUE_ADD] = "queue_add",
+    [MARCO_FQ_PROF_CHECK_THROTTLED] = "check_throttled",
+    [MARCO_FQ_PROF_PAIR_DEQUEUE] = "pair_dequeue",
+    [MARCO_FQ_PROF_DEQUEUE] = "dequeue",
+};
+
+static int marco_fq_profile_show(struct seq_file *m, void *v)
+{
+    struct Qdisc *sch = m->private;
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    u64 ns[MARCO_FQ_PROF_MAX] = {}, calls[MARCO_FQ_PROF_MAX] = {};
+    u64 packets = 0;
+    bool on;
+    int cpu, i;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct marco_fq_pcpu_stats *pcpu = per_cpu_ptr(q->pcpu_stats, cpu);
+
+        for (i = 0; i < MARCO_FQ_PROF_MAX; i++)
+        {
+            ns[i] += marco_fq_pcpu_read(pcpu, &pcpu->prof_ns[i]);
+            calls[i] += marco_fq_pcpu_read(pcpu, &pcpu->prof_calls[i]);
+        }
+        packets += marco_fq_pcpu_read(pcpu, &pcpu->prof_packets);
+    }
+
+    rcu_read_lock();
+    on = rcu_dereference(q->cfg)->profile;
+    rcu_read_unlock();
+
+    seq_printf(m, "# profile %s, %llu packets dequeued\n", on ? "on" : "off", packets);
+    seq_puts(m, "# stage calls ns ns/call ns/packet\n");
+    for (i = 0; i < MARCO_FQ_PROF_MAX; i++)
+        seq_printf(m, "%s %llu %llu %llu %llu\n", marco_fq_prof_names[i],
+                   calls[i], ns[i], calls[i] ? div64_u64(ns[i], calls[i]) : 0,
+                   packets ? div64_u64(ns[i], packets) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(marco_fq_profile);
+
+/* events-<cpu> files : i_private is the qdisc, the file name the cpu */
+static int marco_fq_events_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct dentry *dentry = file->f_path.dentry;
+    struct Qdisc *sch = file->private_data;
+    struct marco_fq_ev_ring __percpu *rings;
+    unsigned int cpu;
+    int err;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    if (kstrtouint(dentry->d_name.name + strlen("events-"), 10, &cpu))
+        return -EINVAL;
+
+    /* the qdisc can not go away before debugfs_file_put() */
+    err = debugfs_file_get(dentry);
+    if (err)
+        return err;
+    rings = smp_load_acquire(&((struct marco_fq_sched_data *)qdisc_priv(sch))->ev_rings);
+    if (rings)
+        err = remap_vmalloc_range(vma, per_cpu_ptr(rings, cpu)->buf, vma->vm_pgoff);
+    else
+        err = -ENODATA; /* event_sample was never set */
+    debugfs_file_put(dentry);
+    return err;
+}
+
+static const struct file_operations marco_fq_events_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .mmap = marco_fq_events_mmap,
+    .llseek = no_llseek,
+};
+
+static struct dentry *marco_fq_debugfs_root;
+
+/* One directory per qdisc, named after its device, handle and parent */
+static void marco_fq_debugfs_init(struct Qdisc *sch)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    char name[IFNAMSIZ + 20];
+    int cpu;
+
+    if (IS_ERR_OR_NULL(marco_fq_debugfs_root))
+        return;
+
+    snprintf(name, sizeof(name), "%s-%x-%x", qdisc_dev(sch)->name,
+             sch->handle, sch->parent);
+    q->debugfs_dir = debugfs_create_dir(name, marco_fq_debugfs_root);
+    if (IS_ERR(q->debugfs_dir))
+    {
+        q->debugfs_dir = NULL;
+        return;
+    }
+    debugfs_create_file("occupancy", 0400, q->debugfs_dir, sch, &marco_fq_occ_fops);
+    debugfs_create_file("profile", 0400, q->debugfs_dir, sch, &marco_fq_profile_fops);
+
+    /* _unsafe as the full proxy can not mmap, see marco_fq_events_mmap() */
+    for_each_possible_cpu(cpu)
+    {
+        snprintf(name, sizeof(name), "events-%d", cpu);
+        debugfs_create_file_unsafe(name, 0400, q->debugfs_dir, sch,
+                                   &marco_fq_events_fops);
+    }
 }
 
 static int marco_fq_init(struct Qdisc *sch, struct nlattr *opt,
                    struct netlink_ext_ack *extack)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
-    int err;
+    struct marco_fq_config *cfg;
+    int err, cpu;
+
+    BUILD_BUG_ON(offsetofend(struct marco_fq_config, instr) > 64);
+
+    INIT_DELAYED_WORK(&q->table_work, marco_fq_table_work);
+    INIT_DELAYED_WORK(&q->kick_work, marco_fq_kick_work);
 
-    sch->limit = 10000;
-    q->flow_plimit = 100;
-    q->quantum = 2 * psched_mtu(qdisc_dev(sch));
-    q->initial_quantum = 10 * psched_mtu(qdisc_dev(sch));
-    q->flow_refill_delay = msecs_to_jiffies(40);
-    q->flow_max_rate = ~0UL;
     q->time_next_delayed_flow = ~0ULL;
-    q->rate_enable = 1;
     q->new_flows.first = NULL;
     q->old_flows.first = NULL;
     q->delayed = RB_ROOT;
     q->fq_root = NULL;
     q->fq_trees_log = ilog2(1024);
-    q->orphan_mask = 1024 - 1;
-    q->low_rate_threshold = 550000 / 8;
 
-    q->timer_slack = 10 * NSEC_PER_USEC; /* 10 usec of hrtimer slack */
+    qdisc_watchdog_init_clockid(&q->watchdog, sch, CLOCK_MONOTONIC);
+
+    cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+    if (!cfg)
+        return -ENOMEM;
+    cfg->limit = 10000;
+    cfg->flow_plimit = 100;
+    cfg->quantum = 2 * psched_mtu(qdisc_dev(sch));
+    cfg->initial_quantum = 10 * psched_mtu(qdisc_dev(sch));
+    cfg->flow_refill_delay = msecs_to_jiffies(40);
+    cfg->flow_max_rate = ~0UL;
+    cfg->rate_enable = 1;
+    cfg->orphan_mask = 1024 - 1;
+    cfg->low_rate_threshold = 550000 / 8;
+
+    cfg->timer_slack = 10 * NSEC_PER_USEC; /* 10 usec of hrtimer slack */
 
-    q->horizon = 10ULL * NSEC_PER_SEC; /* 10 seconds */
-    q->horizon_drop = 1;               /* by default, drop packets beyond horizon */
+    cfg->horizon = 10ULL * NSEC_PER_SEC; /* 10 seconds */
+    cfg->horizon_drop = 1;               /* by default, drop packets beyond horizon */
 
     /* Default ce_threshold of 4294 seconds */
-    q->ce_threshold = (u64)NSEC_PER_USEC * ~0U;
+    cfg->ce_threshold = (u64)NSEC_PER_USEC * ~0U;
+    RCU_INIT_POINTER(q->cfg, cfg);
 
-    qdisc_watchdog_init_clockid(&q->watchdog, sch, CLOCK_MONOTONIC);
+    seqcount_init(&q->top_seq);
+    q->tx = kzalloc(sizeof(*q->tx), GFP_KERNEL);
+    if (!q->tx)
+        return -ENOMEM;
+    spin_lock_init(&q->tx->lock);
+    refcount_set(&q->tx->refcnt, 1);
+    q->pcpu_stats = alloc_percpu(struct marco_fq_pcpu_stats);
+    if (!q->pcpu_stats)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(q->pcpu_stats, cpu)->syncp);
+
+    marco_fq_debugfs_init(sch);
 
     if (opt)
         err = marco_fq_change(sch, opt, extack);
     else
         err = marco_fq_resize(sch, q->fq_trees_log);
 
+    if (!err)
+        marco_fq_pair(sch);
     return err;
 }
 
 static int marco_fq_dump(struct Qdisc *sch, struct sk_buff *skb)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
-    u64 ce_threshold = q->ce_threshold;
-    u64 horizon = q->horizon;
+    const struct marco_fq_config *cfg = rtnl_dereference(q->cfg);
+    u64 ce_threshold = cfg->ce_threshold;
+    u64 horizon = cfg->horizon;
     struct nlattr *opts;
 
     opts = nla_nest_start_noflag(skb, TCA_OPTIONS);
@@ -1118,23 +2961,37 @@ static int marco_fq_dump(struct Qdisc *sch, struct sk_buff *skb)
     do_div(ce_threshold, NSEC_PER_USEC);
     do_div(horizon, NSEC_PER_USEC);
 
-    if (nla_put_u32(skb, TCA_FQ_PLIMIT, sch->limit) ||
-        nla_put_u32(skb, TCA_FQ_FLOW_PLIMIT, q->flow_plimit) ||
-        nla_put_u32(skb, TCA_FQ_QUANTUM, q->quantum) ||
-        nla_put_u32(skb, TCA_FQ_INITIAL_QUANTUM, q->initial_quantum) ||
-        nla_put_u32(skb, TCA_FQ_RATE_ENABLE, q->rate_enable) ||
+    if (nla_put_u32(skb, TCA_FQ_PLIMIT, cfg->limit) ||
+        nla_put_u32(skb, TCA_FQ_FLOW_PLIMIT, cfg->flow_plimit) ||
+        nla_put_u32(skb, TCA_FQ_QUANTUM, cfg->quantum) ||
+        nla_put_u32(skb, TCA_FQ_INITIAL_QUANTUM, cfg->initial_quantum) ||
+        nla_put_u32(skb, TCA_FQ_RATE_ENABLE, cfg->rate_enable) ||
         nla_put_u32(skb, TCA_FQ_FLOW_MAX_RATE,
-                    min_t(unsigned long, q->flow_max_rate, ~0U)) ||
+                    min_t(unsigned long, cfg->flow_max_rate, ~0U)) ||
         nla_put_u32(skb, TCA_FQ_FLOW_REFILL_DELAY,
-                    jiffies_to_usecs(q->flow_refill_delay)) ||
-        nla_put_u32(skb, TCA_FQ_ORPHAN_MASK, q->orphan_mask) ||
+                    jiffies_to_usecs(cfg->flow_refill_delay)) ||
+        nla_put_u32(skb, TCA_FQ_ORPHAN_MASK, cfg->orphan_mask) ||
         nla_put_u32(skb, TCA_FQ_LOW_RATE_THRESHOLD,
-                    q->low_rate_threshold) ||
+                    cfg->low_rate_threshold) ||
         nla_put_u32(skb, TCA_FQ_CE_THRESHOLD, (u32)ce_threshold) ||
         nla_put_u32(skb, TCA_FQ_BUCKETS_LOG, q->fq_trees_log) ||
-        nla_put_u32(skb, TCA_FQ_TIMER_SLACK, q->timer_slack) ||
+        nla_put_u32(skb, TCA_FQ_TIMER_SLACK, cfg->timer_slack) ||
         nla_put_u32(skb, TCA_FQ_HORIZON, (u32)horizon) ||
-        nla_put_u8(skb, TCA_FQ_HORIZON_DROP, q->horizon_drop))
+        nla_put_u8(skb, TCA_FQ_HORIZON_DROP, cfg->horizon_drop) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_GSO_SPLIT_RATE, cfg->gso_split_rate) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_RETRANS_PRIO, cfg->retrans_prio) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_DUMP_MIN_BACKLOG, cfg->dump_min_backlog) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_DUMP_THROTTLED, cfg->dump_throttled) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_OCC_INTERVAL,
+                    div_u64(cfg->occ_interval, NSEC_PER_USEC)) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_EVENT_SAMPLE, cfg->ev_sample) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_PROFILE, cfg->profile) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_TX_SAMPLE, cfg->tx_sample) ||
+        nla_put_u32(skb, TCA_MARCO_FQ_TELEMETRY_THRESHOLD,
+                    div_u64(cfg->telemetry_threshold, NSEC_PER_USEC)) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_TELEMETRY_DSCP, cfg->telemetry_dscp) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_TELEMETRY_OPTION, cfg->telemetry_option) ||
+        nla_put_u8(skb, TCA_MARCO_FQ_LIMIT_TRIM, cfg->limit_trim))
         goto nla_put_failure;
 
     return nla_nest_end(skb, opts);
@@ -1143,36 +3000,325 @@ nla_put_failure:
     return -1;
 }
 
+static int marco_fq_topk_cmp(const void *a, const void *b)
+{
+    const struct tc_marco_fq_topk_entry *ea = a, *eb = b;
+
+    if (ea->value == eb->value)
+        return 0;
+    return ea->value > eb->value ? -1 : 1;
+}
+
+static u32 marco_fq_topk_copy(struct tc_marco_fq_topk_entry *dst,
+                              const struct marco_fq_topk *t)
+{
+    u32 i, used = min_t(u32, READ_ONCE(t->used), TC_MARCO_FQ_TOPK);
+
+    memset(dst, 0, TC_MARCO_FQ_TOPK * sizeof(*dst));
+    for (i = 0; i < used; i++)
+    {
+        dst[i].id = t->e[i].id;
+        dst[i].saddr = t->e[i].saddr;
+        dst[i].daddr = t->e[i].daddr;
+        dst[i].value = t->e[i].value;
+        dst[i].error = t->e[i].error;
+    }
+    return used;
+}
+
+/* Top-K tables and pacing_worst.
+ * The datapath may update the tables while we copy them : retry until
+ * a copy is consistent, then sort it outside of the read section.
+ */
+static void marco_fq_read_topk(const struct marco_fq_sched_data *q,
+                               struct tc_marco_fq_qd_stats *st)
+{
+    struct marco_fq_pacing_worst w;
+    u32 nbytes, nbacklog;
+    unsigned int seq;
+
+    do
+    {
+        seq = read_seqcount_begin(&q->top_seq);
+        nbytes = marco_fq_topk_copy(st->top_bytes, &q->top_bytes);
+        nbacklog = marco_fq_topk_copy(st->top_backlog, &q->top_backlog);
+        w = q->pacing_worst;
+    } while (read_seqcount_retry(&q->top_seq, seq));
+
+    if (w.late_ns)
+    {
+        st->pacing_worst.id = w.id;
+        st->pacing_worst.saddr = (__force u32)w.saddr;
+        st->pacing_worst.daddr = (__force u32)w.daddr;
+        st->pacing_worst.class = w.cls;
+        st->pacing_worst.late_ns = w.late_ns;
+        st->pacing_worst.age_ns = ktime_get_ns() - w.stamp;
+    }
+
+    sort(st->top_bytes, nbytes, sizeof(st->top_bytes[0]), marco_fq_topk_cmp, NULL);
+    sort(st->top_backlog, nbacklog, sizeof(st->top_backlog[0]), marco_fq_topk_cmp, NULL);
+}
+
+static void marco_fq_read_pcpu_stats(const struct marco_fq_sched_data *q,
+                                     struct tc_marco_fq_qd_stats *st)
+{
+    u64 stats[MARCO_FQ_STAT_MAX] = {};
+    int cpu, c, b, i;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct marco_fq_pcpu_stats *pcpu = per_cpu_ptr(q->pcpu_stats, cpu);
+
+        for (i = 0; i < MARCO_FQ_STAT_MAX; i++)
+            stats[i] += marco_fq_pcpu_read(pcpu, &pcpu->stats[i]);
+
+        for (c = 0; c < TC_MARCO_FQ_NR_CLASSES; c++)
+            for (b = 0; b < TC_MARCO_FQ_HIST_BUCKETS; b++)
+            {
+                st->sojourn[c][b] += marco_fq_pcpu_read(pcpu, &pcpu->sojourn[c][b]);
+                st->pacing_late[c][b] += marco_fq_pcpu_read(pcpu, &pcpu->pacing_late[c][b]);
+            }
+    }
+
+    st->gc_flows = stats[MARCO_FQ_STAT_GC_FLOWS];
+    st->highprio_packets = stats[MARCO_FQ_STAT_INTERNAL_PACKETS];
+    st->tcp_retrans = stats[MARCO_FQ_STAT_TCP_RETRANS];
+    st->throttled = stats[MARCO_FQ_STAT_THROTTLED];
+    st->flows_plimit = stats[MARCO_FQ_STAT_FLOWS_PLIMIT];
+    st->pkts_too_long = stats[MARCO_FQ_STAT_PKTS_TOO_LONG];
+    st->allocation_errors = stats[MARCO_FQ_STAT_ALLOCATION_ERRORS];
+    st->ce_mark = stats[MARCO_FQ_STAT_CE_MARK];
+    st->horizon_drops = stats[MARCO_FQ_STAT_HORIZON_DROPS];
+    st->horizon_caps = stats[MARCO_FQ_STAT_HORIZON_CAPS];
+    st->gso_segmented = stats[MARCO_FQ_STAT_GSO_SEGMENTED];
+    st->penalties = stats[MARCO_FQ_STAT_PENALTIES];
+}
+
 static int marco_fq_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 {
     struct marco_fq_sched_data *q = qdisc_priv(sch);
-    struct tc_fq_qd_stats st;
+    struct tc_marco_fq_qd_stats *st;
+    int err;
+
+    /* too big for the stack */
+    st = kzalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+    st->type = TCA_MARCO_FQ_XSTATS_QDISC;
+
+    /* No qdisc lock here, so that monitoring does not stall the datapath :
+     * counters are per cpu, top-K tables are copied under top_seq and the
+     * gauges below are sampled, each of them being consistent on its own.
+     */
+    marco_fq_read_pcpu_stats(q, st);
+    marco_fq_read_topk(q, st);
+
+    spin_lock_irq(&q->tx->lock);
+    memcpy(st->tx_latency, q->tx->latency, sizeof(st->tx_latency));
+    spin_unlock_irq(&q->tx->lock);
+
+    st->time_next_delayed_flow = READ_ONCE(q->time_next_delayed_flow) +
+                                 marco_fq_cfg(q)->timer_slack - ktime_get_ns();
+    st->flows = READ_ONCE(q->flows);
+    st->inactive_flows = READ_ONCE(q->inactive_flows);
+    st->throttled_flows = READ_ONCE(q->throttled_flows);
+    st->unthrottle_latency_ns = min_t(unsigned long,
+                                      READ_ONCE(q->unthrottle_latency_ns), ~0U);
+
+    err = gnet_stats_copy_app(d, st, sizeof(*st));
+    kfree(st);
+    return err;
+}
+
+/* Flows are exposed as classes, for 'tc -s class show'.
+ * They can not be created, changed or have filters attached.
+ */
+static struct Qdisc *marco_fq_leaf(struct Qdisc *sch, unsigned long arg)
+{
+    return NULL;
+}
+
+static unsigned long marco_fq_find(struct Qdisc *sch, u32 classid)
+{
+    return 0;
+}
+
+static bool marco_fq_walk_match(const struct marco_fq_sched_data *q,
+                                const struct marco_fq_flow *f)
+{
+    const struct marco_fq_config *cfg = marco_fq_cfg(q);
+
+    if (f->backlog < cfg->dump_min_backlog)
+        return false;
+    if (cfg->dump_throttled && !marco_fq_flow_is_throttled(f))
+        return false;
+    return true;
+}
+
+static void marco_fq_flow_snapshot(const struct marco_fq_flow *f, u32 bucket,
+                                   u64 now, struct tc_marco_fq_cl_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->type = TCA_MARCO_FQ_XSTATS_CLASS;
+    st->bucket = bucket;
+    st->id = marco_fq_flow_id(f);
+    st->qlen = f->qlen;
+    st->backlog = f->backlog;
+    st->credit = f->credit;
+    st->drops = f->stat_drops;
+    st->throttled = f->stat_throttled;
+    st->bytes = f->stat_bytes;
+    st->packets = f->stat_packets;
+    st->throttled_ns = f->stat_throttled_ns;
+    if (!((unsigned long)f->sk & 1UL))
+        st->flags |= TC_MARCO_FQ_FLOW_LOCAL;
+    if (marco_fq_flow_is_detached(f))
+        st->flags |= TC_MARCO_FQ_FLOW_DETACHED;
+    if (marco_fq_flow_is_throttled(f))
+    {
+        st->flags |= TC_MARCO_FQ_FLOW_THROTTLED;
+        st->time_next_packet = f->time_next_packet - now;
+    }
+}
+
+#define MARCO_FQ_WALK_BATCH 64
+
+/* Copy up to MARCO_FQ_WALK_BATCH flows of one bucket, starting at the
+ * pos-th flow matching the dump filters.
+ * The qdisc lock is only held for one batch at a time.
+ */
+static int marco_fq_walk_bucket(struct Qdisc *sch, u32 bucket, u32 pos,
+                                struct tc_marco_fq_cl_stats *batch, bool *more)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    u64 now = ktime_get_ns();
+    struct rb_node *p;
+    int n = 0;
 
+    *more = false;
     sch_tree_lock(sch);
+    for (p = rb_first(&q->fq_root[bucket]); p; p = rb_next(p))
+    {
+        struct marco_fq_flow *f = rb_entry(p, struct marco_fq_flow, fq_node);
 
-    st.gc_flows = q->stat_gc_flows;
-    st.highprio_packets = q->stat_internal_packets;
-    st.tcp_retrans = 0;
-    st.throttled = q->stat_throttled;
-    st.flows_plimit = q->stat_flows_plimit;
-    st.pkts_too_long = q->stat_pkts_too_long;
-    st.allocation_errors = q->stat_allocation_errors;
-    st.time_next_delayed_flow = q->time_next_delayed_flow + q->timer_slack -
-                                ktime_get_ns();
-    st.flows = q->flows;
-    st.inactive_flows = q->inactive_flows;
-    st.throttled_flows = q->throttled_flows;
-    st.unthrottle_latency_ns = min_t(unsigned long,
-                                     q->unthrottle_latency_ns, ~0U);
-    st.ce_mark = q->stat_ce_mark;
-    st.horizon_drops = q->stat_horizon_drops;
-    st.horizon_caps = q->stat_horizon_caps;
+        if (!marco_fq_walk_match(q, f))
+            continue;
+        if (pos)
+        {
+            pos--;
+            continue;
+        }
+        if (n == MARCO_FQ_WALK_BATCH)
+        {
+            *more = true;
+            break;
+        }
+        marco_fq_flow_snapshot(f, bucket, now, &batch[n++]);
+    }
     sch_tree_unlock(sch);
+    return n;
+}
 
-    return gnet_stats_copy_app(d, &st, sizeof(st));
+/* Class walk, called under RTNL, so q->fq_root can not be resized under us.
+ * Flows are handed to arg->fn as snapshots, since they can be garbage
+ * collected as soon as the qdisc lock is released.
+ */
+static void marco_fq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+    struct marco_fq_sched_data *q = qdisc_priv(sch);
+    struct tc_marco_fq_cl_stats *batch;
+    u32 bucket = 0, pos = 0;
+    bool more;
+    int i, n;
+
+    if (arg->stop || !q->fq_root)
+        return;
+
+    batch = kmalloc_array(MARCO_FQ_WALK_BATCH, sizeof(*batch), GFP_KERNEL);
+    if (!batch)
+    {
+        arg->stop = 1;
+        return;
+    }
+
+    /* A dump spanning several netlink messages walks again from the start
+     * for each message, skipping what was already sent.
+     * Resume where the previous message stopped instead.
+     */
+    if (arg->skip && arg->skip == q->walk_count)
+    {
+        bucket = q->walk_bucket;
+        pos = q->walk_pos;
+        arg->count = q->walk_count;
+    }
+
+    for (; bucket < (1U << q->fq_trees_log); bucket++, pos = 0)
+    {
+        if (!READ_ONCE(q->fq_root[bucket].rb_node))
+            continue;
+        do
+        {
+            n = marco_fq_walk_bucket(sch, bucket, pos, batch, &more);
+            for (i = 0; i < n; i++)
+            {
+                if (arg->count < arg->skip)
+                {
+                    arg->count++;
+                    continue;
+                }
+                if (arg->fn(sch, (unsigned long)&batch[i], arg) < 0)
+                {
+                    arg->stop = 1;
+                    q->walk_bucket = bucket;
+                    q->walk_pos = pos + i;
+                    q->walk_count = arg->count;
+                    goto out;
+                }
+                arg->count++;
+            }
+            pos += n;
+            cond_resched();
+        } while (more);
+    }
+out:
+    kfree(batch);
+}
+
+static int marco_fq_dump_class(struct Qdisc *sch, unsigned long cl,
+                               struct sk_buff *skb, struct tcmsg *tcm)
+{
+    const struct tc_marco_fq_cl_stats *st = (const void *)cl;
+
+    /* minor is the bucket : flows have no stable 16bit identifier */
+    tcm->tcm_handle |= TC_H_MIN(st->bucket % 0xffff + 1);
+    return 0;
 }
 
+static int marco_fq_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+                                     struct gnet_dump *d)
+{
+    const struct tc_marco_fq_cl_stats *st = (const void *)cl;
+    struct gnet_stats_queue qs = {
+        .qlen = st->qlen,
+        .backlog = st->backlog,
+        .drops = st->drops,
+    };
+
+    if (gnet_stats_copy_queue(d, NULL, &qs, st->qlen) < 0)
+        return -1;
+    return gnet_stats_copy_app(d, (void *)st, sizeof(*st));
+}
+
+static const struct Qdisc_class_ops marco_fq_class_ops = {
+    .leaf = marco_fq_leaf,
+    .find = marco_fq_find,
+    .walk = marco_fq_walk,
+    .dump = marco_fq_dump_class,
+    .dump_stats = marco_fq_dump_class_stats,
+};
+
 static struct Qdisc_ops fq_qdisc_ops __read_mostly = {
+    .cl_ops = &marco_fq_class_ops,
     .id = "marco_fq",
     .priv_size = sizeof(struct marco_fq_sched_data),
 
@@ -1188,6 +3334,16 @@ static struct Qdisc_ops fq_qdisc_ops __read_mostly = {
     .owner = THIS_MODULE,
 };
 
+/* marco_fq_kunit.ko includes this file, and registers no qdisc */
+#ifndef MARCO_FQ_KUNIT
+/* For marco_fq_bench.ko, which drives a qdisc without tc */
+const struct Qdisc_ops *marco_fq_get_ops(void)
+{
+    return &fq_qdisc_ops;
+}
+EXPORT_SYMBOL_GPL(marco_fq_get_ops);
+#endif
+
 void clear_ip_count_table(void)
 {
     struct hash_ip_count *ip_count;
@@ -1201,6 +3357,7 @@ void clear_ip_count_table(void)
     }
 }
 
+#ifndef MARCO_FQ_KUNIT
 static int __init fq_module_init(void)
 {
     printk("Load the marco fq_module");
@@ -1212,9 +3369,14 @@ static int __init fq_module_init(void)
     if (!marco_fq_flow_cachep)
         return -ENOMEM;
 
+    marco_fq_debugfs_root = debugfs_create_dir("marco_fq", NULL);
+
     ret = register_qdisc(&fq_qdisc_ops);
     if (ret)
+    {
+        debugfs_remove_recursive(marco_fq_debugfs_root);
         kmem_cache_destroy(marco_fq_flow_cachep);
+    }
 
     hash_init(ip_count_table);
     return ret;
@@ -1223,6 +3385,10 @@ static int __init fq_module_init(void)
 static void __exit fq_module_exit(void)
 {
     unregister_qdisc(&fq_qdisc_ops);
+    debugfs_remove_recursive(marco_fq_debugfs_root);
+    flush_work(&marco_fq_graveyard_free);
+    /* the last sampled packet dropped the module reference under RCU */
+    synchronize_rcu();
     kmem_cache_destroy(marco_fq_flow_cachep);
     clear_ip_count_table();
     printk("The marco_fq module unloaded");
@@ -1233,3 +3399,4 @@ module_init(fq_module_init)
         MODULE_AUTHOR("Eric Dumazet");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Fair Queue Packet Scheduler");
+#endif
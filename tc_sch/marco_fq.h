@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause */
+/*
+ * marco_fq netlink options and statistics.
+ *
+ * Shared by the kernel module (tc_sch/marco_fq.c) and the tc plugin
+ * (tc_q/q_marco_fq.c), see tc_q/setup.sh.
+ */
+#ifndef _MARCO_FQ_H
+#define _MARCO_FQ_H
+
+#include <linux/types.h>
+
+/* marco_fq private options.
+ * They are numbered well above the upstream TCA_FQ_* range, so that newer
+ * kernel or iproute2 headers can never collide with them.
+ */
+enum
+{
+    TCA_MARCO_FQ_UNSPEC = 64,
+
+    TCA_MARCO_FQ_GSO_SPLIT_RATE, /* segment GSO packets of flows paced below this rate */
+
+    TCA_MARCO_FQ_RETRANS_PRIO, /* queue TCP retransmits ahead of new data */
+
+    TCA_MARCO_FQ_DUMP_MIN_BACKLOG, /* class dumps skip flows with less bytes queued */
+
+    TCA_MARCO_FQ_DUMP_THROTTLED, /* class dumps only report throttled flows */
+
+    TCA_MARCO_FQ_OCC_INTERVAL, /* usecs between occupancy samples, 0 to disable */
+
+    TCA_MARCO_FQ_EVENT_SAMPLE, /* log events of 1 packet out of N, 0 to disable */
+
+    TCA_MARCO_FQ_PROFILE, /* time the datapath stages, see debugfs */
+
+    TCA_MARCO_FQ_TX_SAMPLE, /* time 1 dequeued packet out of N until tx completion */
+
+    TCA_MARCO_FQ_TELEMETRY_THRESHOLD, /* usecs, packets queued longer get TELEMETRY_DSCP */
+
+    TCA_MARCO_FQ_TELEMETRY_DSCP, /* DSCP codepoint, 0 to disable */
+
+    TCA_MARCO_FQ_TELEMETRY_OPTION, /* stamp packets with struct tc_marco_fq_telemetry */
+
+    TCA_MARCO_FQ_LIMIT_TRIM, /* drop the excess at once when limit is lowered */
+
+    __TCA_MARCO_FQ_MAX
+};
+
+#define TCA_MARCO_FQ_MAX (__TCA_MARCO_FQ_MAX - 1)
+
+/* Like fq_codel, qdisc and class (flow) xstats start with their type */
+enum
+{
+    TCA_MARCO_FQ_XSTATS_QDISC,
+    TCA_MARCO_FQ_XSTATS_CLASS,
+};
+
+/* Classes of flows histograms are kept for */
+enum
+{
+    TC_MARCO_FQ_CLASS_INTERNAL, /* high priority packets */
+    TC_MARCO_FQ_CLASS_LOCAL,    /* flows of local sockets */
+    TC_MARCO_FQ_CLASS_ORPHAN,   /* forwarded or orphaned traffic */
+    TC_MARCO_FQ_NR_CLASSES
+};
+
+/* log2 histograms of nanoseconds : bucket 0 counts zeros, bucket i counts
+ * values in [2^(i-1), 2^i), the last bucket everything above.
+ */
+#define TC_MARCO_FQ_HIST_BUCKETS 32
+
+#define TC_MARCO_FQ_TOPK 8
+
+struct tc_marco_fq_topk_entry
+{
+    __u32 id;    /* flow id, as in tc_marco_fq_cl_stats */
+    __u32 saddr; /* IPv4 addresses of the last packet, network order */
+    __u32 daddr;
+    __u32 pad;
+    __u64 value; /* bytes (halved every second), or backlog bytes */
+    __u64 error; /* top_bytes : upper bound of the overestimation of value */
+};
+
+/* Paced packet which left the latest after the time it was due */
+struct tc_marco_fq_pacing_worst
+{
+    __u32 id;    /* flow id, as in tc_marco_fq_cl_stats */
+    __u32 saddr; /* IPv4 addresses, network order */
+    __u32 daddr;
+    __u32 class; /* TC_MARCO_FQ_CLASS_* */
+    __u64 late_ns; /* departure time - time_next_packet */
+    __u64 age_ns;  /* how long ago it happened */
+};
+
+struct tc_marco_fq_qd_stats
+{
+    __u32 type; /* TCA_MARCO_FQ_XSTATS_QDISC */
+    __u32 pad;
+
+    /* The fields of struct tc_fq_qd_stats of Linux 5.15, in the same
+     * order, but after type and pad : the layouts differ
+     */
+    __u64 gc_flows;
+    __u64 highprio_packets;
+    __u64 tcp_retrans;
+    __u64 throttled;
+    __u64 flows_plimit;
+    __u64 pkts_too_long;
+    __u64 allocation_errors;
+    __s64 time_next_delayed_flow;
+    __u32 flows;
+    __u32 inactive_flows;
+    __u32 throttled_flows;
+    __u32 unthrottle_latency_ns;
+    __u64 ce_mark; /* packets above ce_threshold */
+    __u64 horizon_drops;
+    __u64 horizon_caps;
+
+    /* marco_fq extensions */
+    __u64 gso_segmented; /* GSO packets split in software */
+    __u64 penalties;     /* packets delayed by the pair table */
+
+    /* Heavy hitters, largest first, empty entries have a zero value */
+    struct tc_marco_fq_topk_entry top_bytes[TC_MARCO_FQ_TOPK];
+    struct tc_marco_fq_topk_entry top_backlog[TC_MARCO_FQ_TOPK];
+
+    /* Time packets spent in the qdisc, per class of flow */
+    __u64 sojourn[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+
+    /* Pacing accuracy : how late paced packets left, per class of flow,
+     * and the worst case since the qdisc was created or reset.
+     */
+    __u64 pacing_late[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+    struct tc_marco_fq_pacing_worst pacing_worst;
+
+    /* Time from dequeue to the release of the packet by the driver,
+     * for the packets sampled by tx_sample
+     */
+    __u64 tx_latency[TC_MARCO_FQ_NR_CLASSES][TC_MARCO_FQ_HIST_BUCKETS];
+};
+
+/* tc_marco_fq_cl_stats.flags */
+#define TC_MARCO_FQ_FLOW_LOCAL (1U << 0)     /* flow of a local socket */
+#define TC_MARCO_FQ_FLOW_DETACHED (1U << 1)  /* empty, not scheduled */
+#define TC_MARCO_FQ_FLOW_THROTTLED (1U << 2) /* waiting for time_next_packet */
+
+struct tc_marco_fq_cl_stats
+{
+    __u32 type;   /* TCA_MARCO_FQ_XSTATS_CLASS */
+    __u32 bucket; /* index in the flow hash table */
+    __u32 id;     /* socket hash, or skb hash for orphaned flows */
+    __u32 flags;  /* TC_MARCO_FQ_FLOW_* */
+    __u32 qlen;
+    __u32 backlog;
+    __s32 credit;
+    __u32 drops;
+    __u32 throttled;    /* times the flow was throttled */
+    __u32 pad;
+    __u64 bytes;        /* bytes dequeued */
+    __u64 packets;      /* packets dequeued */
+    __u64 throttled_ns; /* sum of the delays the flow was throttled for */
+    __s64 time_next_packet; /* ns until a throttled flow can send again */
+};
+
+/* In-band telemetry, written by each hop running marco_fq with
+ * telemetry_option : as an IPv4 option, or an IPv6 destination option
+ * (in its own extension header, right after the fixed header).
+ * Both option types are experimental values (RFC 4727) which routers and
+ * hosts ignore when they do not know them.
+ */
+#define TC_MARCO_FQ_TELEMETRY_IPV4 0x1e
+#define TC_MARCO_FQ_TELEMETRY_IPV6 0x1e
+
+#define TC_MARCO_FQ_TELEMETRY_PENALIZED (1U << 0) /* delayed by the pair table */
+
+struct tc_marco_fq_telemetry
+{
+    __u8 type;          /* TC_MARCO_FQ_TELEMETRY_IPV4 or _IPV6 */
+    __u8 len;           /* IPv4 : whole option, 12. IPv6 : data only, 10 */
+    __be16 flags;       /* TC_MARCO_FQ_TELEMETRY_* */
+    __be32 sojourn_us;  /* time spent in the qdisc */
+    __be32 penalty_us;  /* part of it added by the pair table */
+};
+
+/* Event rings.
+ * Each cpu has its own ring, exported as debugfs file
+ * marco_fq/<dev>-<handle>-<parent>/events-<cpu> which can be mapped read
+ * only. The mapping starts with struct tc_marco_fq_ev_header, records
+ * follow at header.offset. The kernel overwrites the oldest records : a
+ * reader remembers the last head it saw, copies the new records and
+ * reads head again, dropping those which may have been overwritten
+ * meanwhile (index <= head - records). See tc_sch/marco_fq_events.c.
+ */
+struct tc_marco_fq_ev_header
+{
+    __u64 head;    /* records written so far */
+    __u32 records; /* ring size, a power of two */
+    __u32 offset;  /* of the first record in the mapping */
+};
+
+enum
+{
+    TC_MARCO_FQ_EV_ENQUEUE,
+    TC_MARCO_FQ_EV_DEQUEUE,  /* arg : sojourn time in ns */
+    TC_MARCO_FQ_EV_DROP,     /* reason : TC_MARCO_FQ_DROP_* */
+    TC_MARCO_FQ_EV_THROTTLE, /* arg : ns until the flow can send */
+    TC_MARCO_FQ_EV_PENALTY,  /* arg : delay added by the pair table, in ns */
+};
+
+enum
+{
+    TC_MARCO_FQ_DROP_NONE,
+    TC_MARCO_FQ_DROP_LIMIT,      /* qdisc limit */
+    TC_MARCO_FQ_DROP_FLOW_LIMIT, /* flow_limit */
+    TC_MARCO_FQ_DROP_HORIZON,    /* EDT beyond horizon */
+    TC_MARCO_FQ_DROP_TRIM,       /* limit lowered, with limit_trim */
+};
+
+struct tc_marco_fq_event
+{
+    __u64 time; /* ktime_get_ns() */
+    __u32 id;   /* flow id, 0 if the packet was not classified */
+    __u32 len;  /* qdisc_pkt_len() */
+    __u8 type;  /* TC_MARCO_FQ_EV_* */
+    __u8 reason;
+    __u8 class; /* TC_MARCO_FQ_CLASS_* */
+    __u8 pad;
+    __u32 qlen; /* packets queued in the flow */
+    __u64 arg;
+};
+
+#endif /* _MARCO_FQ_H */
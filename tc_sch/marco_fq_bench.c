@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * marco_fq_bench.c  Synthetic load driver for marco_fq.
+ *
+ * A marco_fq qdisc is created on a dummy device that is never opened,
+ * and fed with synthetic skbs by enqueue() and dequeue() calls made
+ * under the qdisc lock, as the xmit path does, with no NIC, no socket
+ * and no tc in the loop. Reading /sys/kernel/debug/marco_fq_bench/run
+ * runs the load with the current parameters and prints the cost of
+ * each operation :
+ *
+ *   insmod marco_fq_bench.ko flows=100000 pairs=1000 reverse=1
+ *   cat /sys/kernel/debug/marco_fq_bench/run
+ *
+ * Parameters can be changed in /sys/module/marco_fq_bench/parameters
+ * between runs. Packets are IPv4 headers only, their length is given
+ * to the qdisc through qdisc_pkt_len(). "make bench" in tc_sch runs
+ * one load with BENCH_ARGS.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/ip.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/timex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <net/ip.h>
+#include <net/netlink.h>
+#include <net/pkt_sched.h>
+#include <net/sch_generic.h>
+
+/* Exported by marco_fq.c */
+const struct Qdisc_ops *marco_fq_get_ops(void);
+
+static unsigned int flows = 1000;
+module_param(flows, uint, 0644);
+MODULE_PARM_DESC(flows, "number of flows");
+
+static unsigned int pairs;
+module_param(pairs, uint, 0644);
+MODULE_PARM_DESC(pairs, "source/destination pairs the flows are spread over, 0 for one per flow (two with reverse)");
+
+static bool reverse;
+module_param(reverse, bool, 0644);
+MODULE_PARM_DESC(reverse, "half of the flows of each pair go the other way, so that the pair table applies penalties");
+
+static unsigned int hot;
+module_param(hot, uint, 0644);
+MODULE_PARM_DESC(hot, "percent of the flows getting 90% of the packets, 0 for a uniform load");
+
+static unsigned int packets = 1000000;
+module_param(packets, uint, 0644);
+MODULE_PARM_DESC(packets, "timed enqueue + dequeue pairs");
+
+static unsigned int backlog = 1000;
+module_param(backlog, uint, 0644);
+MODULE_PARM_DESC(backlog, "packets kept queued while timing");
+
+static unsigned int len = 1000;
+module_param(len, uint, 0644);
+MODULE_PARM_DESC(len, "packet length seen by the qdisc");
+
+static unsigned int buckets_log = 10;
+module_param(buckets_log, uint, 0644);
+MODULE_PARM_DESC(buckets_log, "log2 of the flow table size");
+
+static DEFINE_MUTEX(mfqb_lock);
+static struct net_device *mfqb_dev;
+static struct dentry *mfqb_debugfs;
+
+struct mfqb_result
+{
+    u64 enqueue_cycles;
+    u64 dequeue_cycles;
+    u64 ns;
+    u64 enqueued;
+    u64 dequeued;
+    u32 drops;
+    u32 empty; /* dequeue() found every flow throttled */
+};
+
+static netdev_tx_t mfqb_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+    dev_kfree_skb(skb);
+    return NETDEV_TX_OK;
+}
+
+static const struct net_device_ops mfqb_netdev_ops = {
+    .ndo_start_xmit = mfqb_xmit,
+};
+
+static void mfqb_setup(struct net_device *dev)
+{
+    ether_setup(dev);
+    dev->netdev_ops = &mfqb_netdev_ops;
+    dev->needs_free_netdev = true;
+    dev->flags |= IFF_NOARP;
+    eth_hw_addr_random(dev);
+}
+
+/* The options tc would send, see marco_fq_change() */
+static int mfqb_configure(struct Qdisc *sch)
+{
+    struct
+    {
+        struct nlattr nest;
+        struct
+        {
+            struct nlattr nla;
+            u32 val;
+        } attr[4];
+    } opt = {};
+    static const u16 types[] = {
+        TCA_FQ_PLIMIT, TCA_FQ_FLOW_PLIMIT, TCA_FQ_ORPHAN_MASK, TCA_FQ_BUCKETS_LOG,
+    };
+    u32 vals[] = {2 * backlog + 1, backlog + 1, ~0U, buckets_log};
+    int i, err;
+
+    opt.nest.nla_type = TCA_OPTIONS;
+    opt.nest.nla_len = sizeof(opt);
+    for (i = 0; i < ARRAY_SIZE(types); i++)
+    {
+        opt.attr[i].nla.nla_type = types[i];
+        opt.attr[i].nla.nla_len = NLA_HDRLEN + sizeof(u32);
+        opt.attr[i].val = vals[i];
+    }
+
+    rtnl_lock();
+    err = sch->ops->change(sch, &opt.nest, NULL);
+    rtnl_unlock();
+    return err;
+}
+
+static u32 mfqb_pairs(void)
+{
+    if (pairs)
+        return pairs;
+    return reverse ? max_t(u32, flows / 2, 1) : flows;
+}
+
+static u32 mfqb_flow(void)
+{
+    u32 n = flows;
+
+    if (hot && hot < 100 && prandom_u32_max(10))
+        n = max_t(u32, flows * hot / 100, 1);
+    return prandom_u32_max(n);
+}
+
+static struct sk_buff *mfqb_skb(u32 flow)
+{
+    u32 npairs = mfqb_pairs(), pair = flow % npairs;
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    struct iphdr *iph;
+    __be32 a, b;
+
+    skb = netdev_alloc_skb_ip_align(mfqb_dev, ETH_HLEN + sizeof(*iph));
+    if (!skb)
+        return NULL;
+    skb_reset_mac_header(skb);
+    eth = skb_put_zero(skb, ETH_HLEN);
+    eth->h_proto = htons(ETH_P_IP);
+    skb_set_network_header(skb, ETH_HLEN);
+    iph = skb_put_zero(skb, sizeof(*iph));
+
+    /* Each pair has its own two hosts */
+    a = htonl(0x0a800000 + pair);
+    b = htonl(0x0a400000 + pair);
+    if (reverse && (flow / npairs) & 1)
+        swap(a, b);
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->tot_len = htons(len - ETH_HLEN);
+    iph->saddr = a;
+    iph->daddr = b;
+    ip_send_check(iph);
+
+    skb->protocol = htons(ETH_P_IP);
+    skb->dev = mfqb_dev;
+    skb_set_hash(skb, flow * 2654435761U + 1, PKT_HASH_TYPE_L4);
+    qdisc_skb_cb(skb)->pkt_len = max_t(u32, len, skb->len);
+    return skb;
+}
+
+static int mfqb_enqueue(struct Qdisc *sch, u32 flow, struct mfqb_result *r)
+{
+    struct sk_buff *skb = mfqb_skb(flow), *to_free = NULL;
+    cycles_t start;
+    int ret;
+
+    if (!skb)
+        return -ENOMEM;
+    local_bh_disable();
+    spin_lock(qdisc_lock(sch));
+    start = get_cycles();
+    ret = sch->enqueue(skb, sch, &to_free);
+    if (r)
+        r->enqueue_cycles += get_cycles() - start;
+    spin_unlock(qdisc_lock(sch));
+    local_bh_enable();
+
+    kfree_skb_list(to_free);
+    if (r)
+        r->enqueued++;
+    return ret;
+}
+
+static void mfqb_dequeue(struct Qdisc *sch, struct mfqb_result *r)
+{
+    struct sk_buff *skb;
+    cycles_t start;
+
+    local_bh_disable();
+    spin_lock(qdisc_lock(sch));
+    start = get_cycles();
+    skb = sch->dequeue(sch);
+    if (r)
+        r->dequeue_cycles += get_cycles() - start;
+    spin_unlock(qdisc_lock(sch));
+    local_bh_enable();
+
+    if (skb)
+    {
+        kfree_skb(skb);
+        if (r)
+            r->dequeued++;
+    }
+    else if (r)
+    {
+        r->empty++;
+    }
+}
+
+static int mfqb_run(struct mfqb_result *r)
+{
+    const struct Qdisc_ops *ops = marco_fq_get_ops();
+    struct Qdisc *sch;
+    u64 start;
+    u32 i;
+    int err;
+
+    sch = qdisc_create_dflt(netdev_get_tx_queue(mfqb_dev, 0), ops, TC_H_ROOT, NULL);
+    if (!sch)
+        return -ENOMEM;
+    err = mfqb_configure(sch);
+    if (err)
+        goto out;
+
+    /* Every flow sent once, so that the table holds them all */
+    for (i = 0; i < flows; i++)
+    {
+        mfqb_enqueue(sch, i, NULL);
+        mfqb_dequeue(sch, NULL);
+        if (!(i & 1023))
+            cond_resched();
+    }
+    for (i = 0; i < backlog; i++)
+        mfqb_enqueue(sch, mfqb_flow(), NULL);
+
+    r->drops = sch->qstats.drops;
+    start = ktime_get_ns();
+    for (i = 0; i < packets; i++)
+    {
+        err = mfqb_enqueue(sch, mfqb_flow(), r);
+        if (err < 0)
+            goto out;
+        mfqb_dequeue(sch, r);
+        if (!(i & 1023))
+            cond_resched();
+    }
+    r->ns = ktime_get_ns() - start;
+    r->drops = sch->qstats.drops - r->drops;
+    err = 0;
+out:
+    rtnl_lock();
+    qdisc_put(sch);
+    rtnl_unlock();
+    return err;
+}
+
+static int mfqb_run_show(struct seq_file *m, void *v)
+{
+    struct mfqb_result r = {};
+    u64 n;
+    int err;
+
+    if (!flows || !packets || len < ETH_HLEN + sizeof(struct iphdr))
+        return -EINVAL;
+
+    mutex_lock(&mfqb_lock);
+    err = mfqb_run(&r);
+    mutex_unlock(&mfqb_lock);
+    if (err)
+        return err;
+
+    n = max_t(u64, r.enqueued, 1);
+    seq_printf(m, "flows %u pairs %u reverse %d hot %u packets %u backlog %u len %u buckets_log %u\n",
+               flows, mfqb_pairs(), reverse, hot, packets, backlog, len, buckets_log);
+    seq_printf(m, "enqueue %llu cycles/packet\n", div64_u64(r.enqueue_cycles, n));
+    seq_printf(m, "dequeue %llu cycles/packet\n",
+               div64_u64(r.dequeue_cycles, max_t(u64, r.dequeued, 1)));
+    seq_printf(m, "total %llu cycles/packet %llu ns/packet\n",
+               div64_u64(r.enqueue_cycles + r.dequeue_cycles, n),
+               div64_u64(r.ns, n));
+    seq_printf(m, "drops %u throttled_dequeues %u\n", r.drops, r.empty);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mfqb_run);
+
+static int __init mfqb_init(void)
+{
+    int err;
+
+    if (!marco_fq_get_ops())
+        return -ENODEV;
+
+    mfqb_dev = alloc_netdev(0, "mfqbench%d", NET_NAME_UNKNOWN, mfqb_setup);
+    if (!mfqb_dev)
+        return -ENOMEM;
+    err = register_netdev(mfqb_dev);
+    if (err)
+    {
+        free_netdev(mfqb_dev);
+        return err;
+    }
+
+    mfqb_debugfs = debugfs_create_dir("marco_fq_bench", NULL);
+    debugfs_create_file("run", 0400, mfqb_debugfs, NULL, &mfqb_run_fops);
+    return 0;
+}
+
+static void __exit mfqb_exit(void)
+{
+    debugfs_remove_recursive(mfqb_debugfs);
+    unregister_netdev(mfqb_dev);
+}
+
+module_init(mfqb_init);
+module_exit(mfqb_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Synthetic load driver for marco_fq");
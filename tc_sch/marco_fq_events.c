@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * marco_fq_events.c  Reader of the marco_fq event rings.
+ *
+ * The rings are enabled with "tc qdisc ... marco_fq event_sample N" and
+ * exported per cpu in debugfs, see the comment in marco_fq.h.
+ *
+ * Usage: marco_fq_events [ -f ] [ -i MSECS ] DIR
+ *   DIR is /sys/kernel/debug/marco_fq/<dev>-<handle>-<parent>
+ *   -f keeps reading new events, every MSECS (default 100)
+ *
+ * One line is printed per event, cpu by cpu : lines are ordered by time
+ * within a cpu only.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include "marco_fq.h"
+
+#define MAX_CPUS 1024
+
+struct ring
+{
+    int cpu;
+    const struct tc_marco_fq_ev_header *hdr;
+    const struct tc_marco_fq_event *ev;
+    struct tc_marco_fq_event *copy;
+    __u64 tail; /* next record to read */
+};
+
+static const char *type_names[] = {
+    [TC_MARCO_FQ_EV_ENQUEUE] = "enqueue",
+    [TC_MARCO_FQ_EV_DEQUEUE] = "dequeue",
+    [TC_MARCO_FQ_EV_DROP] = "drop",
+    [TC_MARCO_FQ_EV_THROTTLE] = "throttle",
+    [TC_MARCO_FQ_EV_PENALTY] = "penalty",
+};
+
+static const char *reason_names[] = {
+    [TC_MARCO_FQ_DROP_NONE] = "-",
+    [TC_MARCO_FQ_DROP_LIMIT] = "limit",
+    [TC_MARCO_FQ_DROP_FLOW_LIMIT] = "flow_limit",
+    [TC_MARCO_FQ_DROP_HORIZON] = "horizon",
+    [TC_MARCO_FQ_DROP_TRIM] = "trim",
+};
+
+static const char *class_names[] = {
+    [TC_MARCO_FQ_CLASS_INTERNAL] = "internal",
+    [TC_MARCO_FQ_CLASS_LOCAL] = "local",
+    [TC_MARCO_FQ_CLASS_ORPHAN] = "orphan",
+};
+
+#define NAME(names, i) ((i) < sizeof(names) / sizeof(names[0]) ? names[i] : "?")
+
+static __u64 lost;
+
+static int ring_open(struct ring *r, const char *dir, int cpu)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    const struct tc_marco_fq_ev_header *hdr;
+    char path[4096];
+    size_t len;
+    void *map;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/events-%d", dir, cpu);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    /* the header tells how much to map */
+    hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    len = hdr->offset + (size_t)hdr->records * sizeof(struct tc_marco_fq_event);
+    munmap((void *)hdr, page);
+
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    r->cpu = cpu;
+    r->hdr = map;
+    r->ev = (const void *)((const char *)map + r->hdr->offset);
+    r->copy = calloc(r->hdr->records, sizeof(*r->copy));
+    if (!r->copy)
+        return -1;
+    r->tail = 0;
+    return 0;
+}
+
+static void print_event(int cpu, const struct tc_marco_fq_event *e)
+{
+    printf("%d %" PRIu64 " %s %08x %u %u %s %s %" PRIu64 "\n",
+           cpu, (uint64_t)e->time, NAME(type_names, e->type), e->id, e->len,
+           e->qlen, NAME(class_names, e->class), NAME(reason_names, e->reason),
+           (uint64_t)e->arg);
+}
+
+/* Copy, then check that the kernel did not overwrite what was copied */
+static void ring_read(struct ring *r)
+{
+    __u32 size = r->hdr->records;
+    __u64 head, head2, i, n = 0;
+
+    head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    if (head - r->tail > size)
+    {
+        lost += head - size - r->tail;
+        r->tail = head - size;
+    }
+    for (i = r->tail; i != head; i++)
+        r->copy[n++] = r->ev[i & (size - 1)];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    head2 = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+    i = 0;
+    if (head2 + 1 - r->tail > size)
+    {
+        i = head2 + 1 - size - r->tail;
+        if (i > n)
+            i = n;
+        lost += i;
+    }
+    for (; i < n; i++)
+        print_event(r->cpu, &r->copy[i]);
+    r->tail = head;
+}
+
+int main(int argc, char **argv)
+{
+    static struct ring rings[MAX_CPUS];
+    unsigned int interval = 100;
+    int follow = 0, nr = 0;
+    struct dirent *de;
+    DIR *d;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "fi:")) != -1)
+    {
+        switch (c)
+        {
+        case 'f':
+            follow = 1;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    d = opendir(argv[optind]);
+    if (!d)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    while ((de = readdir(d)) != NULL && nr < MAX_CPUS)
+    {
+        int cpu;
+
+        if (sscanf(de->d_name, "events-%d", &cpu) != 1)
+            continue;
+        if (ring_open(&rings[nr], argv[optind], cpu))
+        {
+            fprintf(stderr, "events-%d: %s\n", cpu, strerror(errno));
+            continue;
+        }
+        nr++;
+    }
+    closedir(d);
+    if (!nr)
+    {
+        fprintf(stderr, "No event ring, is event_sample set ?\n");
+        return 1;
+    }
+
+    printf("# cpu time_ns type id len flow_qlen class reason arg\n");
+    do
+    {
+        for (i = 0; i < nr; i++)
+            ring_read(&rings[i]);
+        fflush(stdout);
+        if (follow)
+            usleep(interval * 1000);
+    } while (follow);
+
+    if (lost)
+        fprintf(stderr, "%" PRIu64 " events overwritten before being read\n",
+                (uint64_t)lost);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: marco_fq_events [ -f ] [ -i MSECS ] DIR\n");
+    return 1;
+}
@@ -0,0 +1,683 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * marco_fq_kunit.c  KUnit tests of the marco_fq scheduling core.
+ *
+ * marco_fq.c is included as is, so that the tests reach its static
+ * functions and the private state of the qdisc. Each test case creates a
+ * qdisc on a device that is never registered, drives it under the qdisc
+ * lock as the xmit path does, and logs the cost of the path it covers :
+ *
+ *   # marco_fq_test_gc: timing: gc 45 ns/op
+ *
+ * so that a refactor of these paths can be checked for speed against the
+ * numbers of the previous build, on the same machine. "make kunit" in
+ * tc_sch loads the module and prints the results, "make kunit" in
+ * tc_sch/user runs the same tests in userspace.
+ */
+#define MARCO_FQ_KUNIT
+#include "marco_fq.c"
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/etherdevice.h>
+#include <net/ip.h>
+
+#define MFQ_KUNIT_LEN 1000 /* qdisc_pkt_len() of every packet */
+#define MFQ_KUNIT_OPS 1024U /* operations timed by each test */
+
+/* Hosts of the pair table tests */
+#define MFQ_KUNIT_A htonl(0x0a000001)
+#define MFQ_KUNIT_B htonl(0x0a000002)
+#define MFQ_KUNIT_C htonl(0x0a000003)
+
+struct mfq_kunit
+{
+    struct net_device *dev;
+    struct Qdisc *sch;
+    struct marco_fq_sched_data *q;
+};
+
+struct mfq_kunit_opt
+{
+    u16 type;
+    u8 len;
+    u32 val;
+};
+
+#define MFQ_KUNIT_U32(t, v) {.type = (t), .len = sizeof(u32), .val = (v)}
+#define MFQ_KUNIT_U8(t, v) {.type = (t), .len = sizeof(u8), .val = (v)}
+
+/* The options tc would send, see marco_fq_change() */
+static int mfq_kunit_change(struct Qdisc *sch, const struct mfq_kunit_opt *opts, int n)
+{
+    struct
+    {
+        struct nlattr nest;
+        struct
+        {
+            struct nlattr nla;
+            u32 val;
+        } attr[8];
+    } buf = {};
+    int i, err;
+
+    if (n > ARRAY_SIZE(buf.attr))
+        return -E2BIG;
+    buf.nest.nla_type = TCA_OPTIONS;
+    buf.nest.nla_len = NLA_HDRLEN + n * sizeof(buf.attr[0]);
+    for (i = 0; i < n; i++)
+    {
+        buf.attr[i].nla.nla_type = opts[i].type;
+        buf.attr[i].nla.nla_len = NLA_HDRLEN + opts[i].len;
+        if (opts[i].len == sizeof(u8))
+            *(u8 *)&buf.attr[i].val = opts[i].val;
+        else
+            buf.attr[i].val = opts[i].val;
+    }
+
+    rtnl_lock();
+    err = sch->ops->change(sch, &buf.nest, NULL);
+    rtnl_unlock();
+    return err;
+}
+
+static int mfq_kunit_init(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        /* one flow per hash, see mfq_kunit_flow() */
+        MFQ_KUNIT_U32(TCA_FQ_ORPHAN_MASK, ~0U),
+    };
+    struct netdev_queue *txq;
+    struct mfq_kunit *t;
+
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+    test->priv = t;
+
+    marco_fq_flow_cachep = kmem_cache_create("marco_fq_kunit", sizeof(struct marco_fq_flow),
+                                             0, 0, NULL);
+    t->dev = alloc_netdev(0, "mfqkunit%d", NET_NAME_UNKNOWN, ether_setup);
+    if (!marco_fq_flow_cachep || !t->dev)
+        goto err;
+    hash_init(ip_count_table);
+
+    /* As dev_init_scheduler() does, for sch_tree_lock() and the watchdog */
+    txq = netdev_get_tx_queue(t->dev, 0);
+    rcu_assign_pointer(txq->qdisc, &noop_qdisc);
+    txq->qdisc_sleeping = &noop_qdisc;
+
+    rtnl_lock();
+    t->sch = qdisc_create_dflt(txq, &fq_qdisc_ops, TC_H_ROOT, NULL);
+    rtnl_unlock();
+    if (!t->sch)
+        goto err;
+    t->q = qdisc_priv(t->sch);
+    if (!mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)))
+        return 0;
+
+    rtnl_lock();
+    qdisc_put(t->sch);
+    rtnl_unlock();
+err:
+    if (t->dev)
+        free_netdev(t->dev);
+    kmem_cache_destroy(marco_fq_flow_cachep);
+    kfree(t);
+    return -ENOMEM;
+}
+
+static void mfq_kunit_exit(struct kunit *test)
+{
+    struct mfq_kunit *t = test->priv;
+
+    rtnl_lock();
+    qdisc_put(t->sch);
+    rtnl_unlock();
+    free_netdev(t->dev);
+    flush_work(&marco_fq_graveyard_free);
+    clear_ip_count_table();
+    kmem_cache_destroy(marco_fq_flow_cachep);
+    kfree(t);
+}
+
+static struct sk_buff *mfq_kunit_skb(struct kunit *test, __be32 saddr, __be32 daddr,
+                                     u32 hash, u64 tstamp)
+{
+    struct mfq_kunit *t = test->priv;
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+    struct iphdr *iph;
+
+    skb = alloc_skb(NET_IP_ALIGN + ETH_HLEN + sizeof(*iph), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+    skb_reserve(skb, NET_IP_ALIGN);
+    skb_reset_mac_header(skb);
+    eth = skb_put_zero(skb, ETH_HLEN);
+    eth->h_proto = htons(ETH_P_IP);
+    skb_set_network_header(skb, ETH_HLEN);
+    iph = skb_put_zero(skb, sizeof(*iph));
+
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->tot_len = htons(MFQ_KUNIT_LEN - ETH_HLEN);
+    iph->saddr = saddr;
+    iph->daddr = daddr;
+    ip_send_check(iph);
+
+    skb->protocol = htons(ETH_P_IP);
+    skb->dev = t->dev;
+    skb->tstamp = tstamp;
+    skb_set_hash(skb, hash, PKT_HASH_TYPE_L4);
+    qdisc_skb_cb(skb)->pkt_len = MFQ_KUNIT_LEN;
+    return skb;
+}
+
+static void mfq_kunit_lock(struct Qdisc *sch)
+{
+    local_bh_disable();
+    spin_lock(qdisc_lock(sch));
+}
+
+static void mfq_kunit_unlock(struct Qdisc *sch)
+{
+    spin_unlock(qdisc_lock(sch));
+    local_bh_enable();
+}
+
+/* ns, when not NULL, accumulates the time spent in enqueue() */
+static int mfq_kunit_enqueue(struct Qdisc *sch, struct sk_buff *skb, u64 *ns)
+{
+    struct sk_buff *to_free = NULL;
+    u64 start;
+    int ret;
+
+    mfq_kunit_lock(sch);
+    start = ktime_get_ns();
+    ret = sch->ops->enqueue(skb, sch, &to_free);
+    if (ns)
+        *ns += ktime_get_ns() - start;
+    mfq_kunit_unlock(sch);
+
+    kfree_skb_list(to_free);
+    return ret;
+}
+
+static struct sk_buff *mfq_kunit_dequeue(struct Qdisc *sch, u64 *ns)
+{
+    struct sk_buff *skb;
+    u64 start;
+
+    mfq_kunit_lock(sch);
+    start = ktime_get_ns();
+    skb = sch->ops->dequeue(sch);
+    if (ns)
+        *ns += ktime_get_ns() - start;
+    mfq_kunit_unlock(sch);
+    return skb;
+}
+
+static int mfq_kunit_send(struct kunit *test, __be32 saddr, __be32 daddr, u32 hash,
+                          u64 tstamp, u64 *ns)
+{
+    struct mfq_kunit *t = test->priv;
+
+    return mfq_kunit_enqueue(t->sch, mfq_kunit_skb(test, saddr, daddr, hash, tstamp), ns);
+}
+
+/* The flow of the packets of hash, with orphan_mask ~0U */
+static struct marco_fq_flow *mfq_kunit_flow(struct marco_fq_sched_data *q, u32 hash)
+{
+    struct sock *sk = (struct sock *)(((unsigned long)hash << 1) | 1UL);
+    struct rb_node *p = q->fq_root[hash_ptr(sk, q->fq_trees_log)].rb_node;
+
+    while (p)
+    {
+        struct marco_fq_flow *f = rb_entry(p, struct marco_fq_flow, fq_node);
+
+        if (f->sk == sk)
+            return f;
+        p = f->sk > sk ? p->rb_right : p->rb_left;
+    }
+    return NULL;
+}
+
+/* Flows are created detached, as marco_fq_classify() does for a new one */
+static void mfq_kunit_classify(struct kunit *test, u32 first, u32 n)
+{
+    struct mfq_kunit *t = test->priv;
+    struct sk_buff *skb = mfq_kunit_skb(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 0, 0);
+    u32 i;
+
+    mfq_kunit_lock(t->sch);
+    for (i = first; i < first + n; i++)
+    {
+        skb_set_hash(skb, i, PKT_HASH_TYPE_L4);
+        marco_fq_classify(skb, t->q, marco_fq_cfg(t->q));
+    }
+    mfq_kunit_unlock(t->sch);
+    kfree_skb(skb);
+}
+
+/* Makes a detached flow old enough for marco_fq_gc_candidate() */
+static void mfq_kunit_age(struct marco_fq_flow *f)
+{
+    f->age = (jiffies - FQ_GC_AGE - 2) | 1UL;
+}
+
+/* Checks every tree of the table, returns the number of flows */
+static u32 mfq_kunit_table(struct kunit *test, struct marco_fq_sched_data *q)
+{
+    struct rb_node *p;
+    u32 idx, n = 0;
+
+    for (idx = 0; idx < (1U << q->fq_trees_log); idx++)
+    {
+        struct sock *prev = NULL;
+
+        for (p = rb_first(&q->fq_root[idx]); p; p = rb_next(p))
+        {
+            struct marco_fq_flow *f = rb_entry(p, struct marco_fq_flow, fq_node);
+
+            KUNIT_EXPECT_EQ(test, hash_ptr(f->sk, q->fq_trees_log), idx);
+            /* larger sockets are on the left */
+            if (prev)
+                KUNIT_EXPECT_TRUE(test, f->sk < prev);
+            prev = f->sk;
+            n++;
+        }
+    }
+    return n;
+}
+
+static u64 mfq_kunit_stat(struct marco_fq_sched_data *q, int stat)
+{
+    u64 val = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct marco_fq_pcpu_stats *pcpu = per_cpu_ptr(q->pcpu_stats, cpu);
+
+        val += marco_fq_pcpu_read(pcpu, &pcpu->stats[stat]);
+    }
+    return val;
+}
+
+/* A stage of the datapath timed by marco_fq_prof_end(), in ns per call */
+static u64 mfq_kunit_prof(struct marco_fq_sched_data *q, int stage)
+{
+    u64 ns = 0, calls = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct marco_fq_pcpu_stats *pcpu = per_cpu_ptr(q->pcpu_stats, cpu);
+
+        ns += marco_fq_pcpu_read(pcpu, &pcpu->prof_ns[stage]);
+        calls += marco_fq_pcpu_read(pcpu, &pcpu->prof_calls[stage]);
+    }
+    return div64_u64(ns, max_t(u64, calls, 1));
+}
+
+static void mfq_kunit_timing(struct kunit *test, const char *path, u64 ns, u64 ops)
+{
+    kunit_info(test, "timing: %s %llu ns/op\n", path, div64_u64(ns, max_t(u64, ops, 1)));
+}
+
+/* Two backlogged flows with a quantum of one packet alternate, a flow
+ * out of credit gets a quantum when it is passed over
+ */
+static void marco_fq_test_drr(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        MFQ_KUNIT_U32(TCA_FQ_QUANTUM, MFQ_KUNIT_LEN),
+        MFQ_KUNIT_U32(TCA_FQ_INITIAL_QUANTUM, MFQ_KUNIT_LEN),
+    };
+    struct mfq_kunit *t = test->priv;
+    struct sk_buff *skb, *list = NULL;
+    struct marco_fq_flow *f;
+    u64 ns = 0;
+    u32 i, n;
+
+    KUNIT_ASSERT_EQ(test, mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)), 0);
+    for (i = 0; i < 8; i++)
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, i < 4 ? MFQ_KUNIT_A : MFQ_KUNIT_C, MFQ_KUNIT_B,
+                                             1 + i / 4, 0, NULL),
+                        NET_XMIT_SUCCESS);
+    f = mfq_kunit_flow(t->q, 1);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, f);
+    KUNIT_EXPECT_EQ(test, f->credit, MFQ_KUNIT_LEN);
+
+    for (i = 0; i < 8; i++)
+    {
+        skb = mfq_kunit_dequeue(t->sch, NULL);
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+        KUNIT_EXPECT_EQ(test, skb_get_hash(skb), 1 + i % 2);
+        kfree_skb(skb);
+        if (i == 0)
+            KUNIT_EXPECT_EQ(test, f->credit, 0);
+        if (i == 1)
+            KUNIT_EXPECT_EQ(test, f->credit, MFQ_KUNIT_LEN);
+    }
+    KUNIT_EXPECT_NULL(test, mfq_kunit_dequeue(t->sch, NULL));
+    KUNIT_EXPECT_EQ(test, t->sch->q.qlen, 0U);
+
+    /* Every dequeue moves a flow to the tail of old_flows */
+    for (i = 0; i < MFQ_KUNIT_OPS; i++)
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 100 + i % 64, 0, NULL),
+                        NET_XMIT_SUCCESS);
+    for (n = 0; (skb = mfq_kunit_dequeue(t->sch, &ns)) != NULL; n++)
+    {
+        skb->next = list;
+        list = skb;
+    }
+    kfree_skb_list(list);
+    KUNIT_EXPECT_EQ(test, n, MFQ_KUNIT_OPS);
+    mfq_kunit_timing(test, "dequeue", ns, n);
+}
+
+/* q->delayed is ordered by time_next_packet, and marco_fq_check_throttled()
+ * moves the flows that are due to old_flows, in that order
+ */
+static void marco_fq_test_throttle(struct kunit *test)
+{
+    struct mfq_kunit *t = test->priv;
+    struct marco_fq_sched_data *q = t->q;
+    u64 base = ktime_get_ns() + NSEC_PER_SEC, now, prev, ns = 0, start;
+    struct marco_fq_flow *f;
+    struct rb_node *p;
+    u32 i, n, due;
+
+    /* EDT times in the future, in no particular order */
+    for (i = 0; i < MFQ_KUNIT_OPS; i++)
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 1 + i,
+                                             base + (i * 97 % MFQ_KUNIT_OPS) * NSEC_PER_USEC, NULL),
+                        NET_XMIT_SUCCESS);
+
+    KUNIT_EXPECT_NULL(test, mfq_kunit_dequeue(t->sch, &ns));
+    KUNIT_EXPECT_EQ(test, q->throttled_flows, MFQ_KUNIT_OPS);
+    KUNIT_EXPECT_EQ(test, q->time_next_delayed_flow, base);
+    mfq_kunit_timing(test, "throttle", ns, MFQ_KUNIT_OPS);
+
+    prev = 0;
+    n = 0;
+    for (p = rb_first(&q->delayed); p; p = rb_next(p))
+    {
+        f = rb_entry(p, struct marco_fq_flow, rate_node);
+        KUNIT_EXPECT_TRUE(test, marco_fq_flow_is_throttled(f));
+        KUNIT_EXPECT_GE(test, f->time_next_packet, prev);
+        prev = f->time_next_packet;
+        n++;
+    }
+    KUNIT_EXPECT_EQ(test, n, MFQ_KUNIT_OPS);
+
+    /* A third of the flows are due */
+    due = MFQ_KUNIT_OPS / 3 + 1;
+    now = base + (due - 1) * NSEC_PER_USEC;
+    mfq_kunit_lock(t->sch);
+    start = ktime_get_ns();
+    marco_fq_check_throttled(q, now);
+    ns = ktime_get_ns() - start;
+    mfq_kunit_unlock(t->sch);
+    mfq_kunit_timing(test, "unthrottle", ns, due);
+
+    KUNIT_EXPECT_EQ(test, q->throttled_flows, MFQ_KUNIT_OPS - due);
+    KUNIT_EXPECT_EQ(test, q->time_next_delayed_flow, now + NSEC_PER_USEC);
+    KUNIT_EXPECT_NULL(test, q->new_flows.first);
+    prev = 0;
+    n = 0;
+    for (f = q->old_flows.first; f; f = f->next)
+    {
+        KUNIT_EXPECT_LE(test, f->time_next_packet, now);
+        KUNIT_EXPECT_GE(test, f->time_next_packet, prev);
+        prev = f->time_next_packet;
+        n++;
+    }
+    KUNIT_EXPECT_EQ(test, n, due);
+}
+
+/* marco_fq_gc() frees at most FQ_GC_MAX flows of the path to a socket,
+ * and only the ones detached for FQ_GC_AGE
+ */
+static void marco_fq_test_gc(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        MFQ_KUNIT_U32(TCA_FQ_BUCKETS_LOG, 1),
+    };
+    struct mfq_kunit *t = test->priv;
+    struct marco_fq_sched_data *q = t->q;
+    struct sock *sk = (struct sock *)((4UL * MFQ_KUNIT_OPS << 1) | 1UL);
+    struct rb_node *p;
+    u32 idx, calls, flows = 4 * MFQ_KUNIT_OPS - 1;
+    u64 start, ns;
+
+    KUNIT_ASSERT_EQ(test, mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)), 0);
+    /* Two trees deep enough for a path of more than FQ_GC_MAX flows */
+    mfq_kunit_classify(test, 1, flows);
+    KUNIT_EXPECT_EQ(test, q->flows, flows);
+    KUNIT_EXPECT_EQ(test, q->inactive_flows, flows);
+
+    mfq_kunit_lock(t->sch);
+    marco_fq_gc(q, &q->fq_root[hash_ptr(sk, q->fq_trees_log)], sk);
+    mfq_kunit_unlock(t->sch);
+    KUNIT_EXPECT_EQ(test, q->flows, flows);
+
+    for (idx = 0; idx < (1U << q->fq_trees_log); idx++)
+        for (p = rb_first(&q->fq_root[idx]); p; p = rb_next(p))
+            mfq_kunit_age(rb_entry(p, struct marco_fq_flow, fq_node));
+
+    mfq_kunit_lock(t->sch);
+    marco_fq_gc(q, &q->fq_root[hash_ptr(sk, q->fq_trees_log)], sk);
+    mfq_kunit_unlock(t->sch);
+    KUNIT_EXPECT_EQ(test, q->flows, flows - FQ_GC_MAX);
+    KUNIT_EXPECT_EQ(test, q->inactive_flows, flows - FQ_GC_MAX);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_GC_FLOWS), (u64)FQ_GC_MAX);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_table(test, q), q->flows);
+
+    /* Each call finds the root of its tree at least */
+    flows = q->flows;
+    mfq_kunit_lock(t->sch);
+    start = ktime_get_ns();
+    for (calls = 0; q->flows && calls < 2 * flows; calls++)
+        marco_fq_gc(q, &q->fq_root[calls & 1], sk);
+    ns = ktime_get_ns() - start;
+    mfq_kunit_unlock(t->sch);
+    KUNIT_EXPECT_EQ(test, q->flows, 0U);
+    KUNIT_EXPECT_EQ(test, q->inactive_flows, 0U);
+    mfq_kunit_timing(test, "gc", ns, flows);
+}
+
+/* marco_fq_resize() moves every flow to its tree in the new table, and
+ * frees the ones marco_fq_gc() would
+ */
+static void marco_fq_test_rehash(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        MFQ_KUNIT_U32(TCA_FQ_BUCKETS_LOG, 4),
+    };
+    struct mfq_kunit *t = test->priv;
+    struct marco_fq_sched_data *q = t->q;
+    u32 i, flows = MFQ_KUNIT_OPS;
+    u64 start, ns;
+    int err;
+
+    KUNIT_ASSERT_EQ(test, mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)), 0);
+    mfq_kunit_classify(test, 1, flows);
+    for (i = 4; i <= flows; i += 4)
+        mfq_kunit_age(mfq_kunit_flow(q, i));
+
+    rtnl_lock();
+    start = ktime_get_ns();
+    err = marco_fq_resize(t->sch, 10);
+    ns = ktime_get_ns() - start;
+    rtnl_unlock();
+    KUNIT_ASSERT_EQ(test, err, 0);
+    mfq_kunit_timing(test, "rehash", ns, flows);
+
+    KUNIT_EXPECT_EQ(test, q->fq_trees_log, (u8)10);
+    KUNIT_EXPECT_EQ(test, q->flows, flows - flows / 4);
+    KUNIT_EXPECT_EQ(test, q->inactive_flows, flows - flows / 4);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_GC_FLOWS), (u64)(flows / 4));
+    KUNIT_EXPECT_EQ(test, mfq_kunit_table(test, q), q->flows);
+    for (i = 1; i <= flows; i++)
+        KUNIT_EXPECT_EQ(test, !mfq_kunit_flow(q, i), !(i % 4));
+
+    /* and back to a smaller table */
+    rtnl_lock();
+    err = marco_fq_resize(t->sch, 2);
+    rtnl_unlock();
+    KUNIT_ASSERT_EQ(test, err, 0);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_table(test, q), q->flows);
+    KUNIT_EXPECT_EQ(test, q->flows, flows - flows / 4);
+}
+
+/* Packets beyond the horizon are dropped, or sent at the horizon with
+ * horizon_drop 0
+ */
+static void marco_fq_test_horizon(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        MFQ_KUNIT_U8(TCA_FQ_HORIZON_DROP, 0),
+    };
+    struct mfq_kunit *t = test->priv;
+    struct marco_fq_sched_data *q = t->q;
+    u64 horizon, before, after, ns = 0;
+    struct sk_buff *skb;
+    u32 i;
+
+    rtnl_lock();
+    horizon = rtnl_dereference(q->cfg)->horizon;
+    rtnl_unlock();
+
+    for (i = 0; i < MFQ_KUNIT_OPS; i++)
+        KUNIT_EXPECT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 1 + i,
+                                             ktime_get_ns() + horizon + NSEC_PER_SEC, &ns),
+                        NET_XMIT_DROP);
+    KUNIT_EXPECT_EQ(test, t->sch->q.qlen, 0U);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_HORIZON_DROPS), (u64)MFQ_KUNIT_OPS);
+    mfq_kunit_timing(test, "horizon drop", ns, MFQ_KUNIT_OPS);
+
+    KUNIT_ASSERT_EQ(test, mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)), 0);
+    ns = 0;
+    for (i = 0; i < MFQ_KUNIT_OPS; i++)
+    {
+        before = ktime_get_ns();
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 1 + i,
+                                             before + horizon + NSEC_PER_SEC, &ns),
+                        NET_XMIT_SUCCESS);
+        after = ktime_get_ns();
+
+        skb = marco_fq_peek(mfq_kunit_flow(q, 1 + i));
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+        KUNIT_EXPECT_GE(test, marco_fq_skb_cb(skb)->time_to_send, before + horizon);
+        KUNIT_EXPECT_LE(test, marco_fq_skb_cb(skb)->time_to_send, after + horizon);
+    }
+    KUNIT_EXPECT_EQ(test, t->sch->q.qlen, MFQ_KUNIT_OPS);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_HORIZON_CAPS), (u64)MFQ_KUNIT_OPS);
+    mfq_kunit_timing(test, "horizon cap", ns, MFQ_KUNIT_OPS);
+}
+
+static int mfq_kunit_pair(__be32 saddr, __be32 daddr)
+{
+    struct hash_ip_count *ip_count;
+
+    hash_for_each_possible(ip_count_table, ip_count, hnode, jhash_1word((__force u32)daddr, 0))
+    {
+        if (ip_count->s_ip == saddr && ip_count->d_ip == daddr)
+            return ip_count->count;
+    }
+    return -1;
+}
+
+/* Enqueue counts the packets from A to B, dequeue of a packet from B to A
+ * takes one off, and delays it by MARCO_FQ_PAIR_PENALTY_NS while more
+ * than 5 are left
+ */
+static void marco_fq_test_pairs(struct kunit *test)
+{
+    static const struct mfq_kunit_opt opts[] = {
+        MFQ_KUNIT_U8(TCA_MARCO_FQ_PROFILE, 1),
+    };
+    struct mfq_kunit *t = test->priv;
+    struct marco_fq_sched_data *q = t->q;
+    struct marco_fq_flow *f;
+    struct sk_buff *skb;
+    u32 i;
+
+    for (i = 0; i < 7; i++)
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_A, MFQ_KUNIT_B, 1, 0, NULL),
+                        NET_XMIT_SUCCESS);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_A, MFQ_KUNIT_B), 7);
+
+    /* Nothing came back from B yet */
+    for (i = 0; i < 7; i++)
+    {
+        skb = mfq_kunit_dequeue(t->sch, NULL);
+        KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+        kfree_skb(skb);
+    }
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_A, MFQ_KUNIT_B), 7);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_B, MFQ_KUNIT_A), -1);
+
+    KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, MFQ_KUNIT_B, MFQ_KUNIT_A, 2, 0, NULL),
+                    NET_XMIT_SUCCESS);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_B, MFQ_KUNIT_A), 1);
+
+    /* 6 are left : penalty */
+    KUNIT_EXPECT_NULL(test, mfq_kunit_dequeue(t->sch, NULL));
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_A, MFQ_KUNIT_B), 6);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_PENALTIES), 1ULL);
+    f = mfq_kunit_flow(q, 2);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, f);
+    KUNIT_EXPECT_TRUE(test, marco_fq_flow_is_throttled(f));
+    skb = marco_fq_peek(f);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+    KUNIT_EXPECT_TRUE(test, marco_fq_skb_cb(skb)->flags & MARCO_FQ_SKB_PENALIZED);
+    KUNIT_EXPECT_EQ(test, f->time_next_packet,
+                    marco_fq_skb_cb(skb)->time_to_send + MARCO_FQ_PAIR_PENALTY_NS);
+
+    /* The packet is looked up again once due : 5 are left, it goes */
+    msleep(MARCO_FQ_PAIR_PENALTY_NS / NSEC_PER_MSEC + 1);
+    skb = mfq_kunit_dequeue(t->sch, NULL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, skb);
+    KUNIT_EXPECT_EQ(test, skb_get_hash(skb), 2U);
+    kfree_skb(skb);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_pair(MFQ_KUNIT_A, MFQ_KUNIT_B), 5);
+    KUNIT_EXPECT_EQ(test, mfq_kunit_stat(q, MARCO_FQ_STAT_PENALTIES), 1ULL);
+
+    /* Both lookups of the table, as timed by the profiler */
+    KUNIT_ASSERT_EQ(test, mfq_kunit_change(t->sch, opts, ARRAY_SIZE(opts)), 0);
+    for (i = 0; i < MFQ_KUNIT_OPS; i++)
+    {
+        KUNIT_ASSERT_EQ(test, mfq_kunit_send(test, i & 1 ? MFQ_KUNIT_B : MFQ_KUNIT_C,
+                                             MFQ_KUNIT_A, 3 + (i & 1), 0, NULL),
+                        NET_XMIT_SUCCESS);
+        kfree_skb(mfq_kunit_dequeue(t->sch, NULL));
+    }
+    mfq_kunit_timing(test, "pair enqueue", mfq_kunit_prof(q, MARCO_FQ_PROF_PAIR_ENQUEUE), 1);
+    mfq_kunit_timing(test, "pair dequeue", mfq_kunit_prof(q, MARCO_FQ_PROF_PAIR_DEQUEUE), 1);
+}
+
+static struct kunit_case marco_fq_test_cases[] = {
+    KUNIT_CASE(marco_fq_test_drr),
+    KUNIT_CASE(marco_fq_test_throttle),
+    KUNIT_CASE(marco_fq_test_gc),
+    KUNIT_CASE(marco_fq_test_rehash),
+    KUNIT_CASE(marco_fq_test_horizon),
+    KUNIT_CASE(marco_fq_test_pairs),
+    {}
+};
+
+static struct kunit_suite marco_fq_test_suite = {
+    .name = "marco_fq",
+    .init = mfq_kunit_init,
+    .exit = mfq_kunit_exit,
+    .test_cases = marco_fq_test_cases,
+};
+kunit_test_suite(marco_fq_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests of marco_fq");
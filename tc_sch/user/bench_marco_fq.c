@@ -0,0 +1,427 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * bench_marco_fq.c  Cost of enqueue + dequeue against libmarco_fq.a
+ *
+ * Usage: bench_marco_fq [ -f FLOWS,... ] [ -n PACKETS ] [ -b BACKLOG ]
+ *                       [ -r REPEAT ] [ -o FILE ]
+ *   -f flow counts to run (default 1,1000,100000,1000000)
+ *   -n timed enqueue + dequeue pairs per run (default 1000000)
+ *   -b packets kept queued while timing (default 10000)
+ *   -r runs per case, the fastest is kept (default 3)
+ *   -o CSV output (default stdout)
+ *
+ * Every flow count is run without and with pacing, and with three
+ * layouts of the pair table, which the module can not turn off :
+ *   single    all flows share one source/destination pair
+ *   distinct  one pair per flow, in one direction : lookups, no penalty
+ *   reverse   flows go both ways between pairs of hosts : penalties
+ *
+ * Packets are 1000 bytes of flows picked at random. The library runs on
+ * its virtual clock, advanced by the wire time of each packet at
+ * 10 Gbit/s, or to the watchdog deadline when every flow is throttled.
+ * With pacing, each flow is a socket paced at 100 Mbit/s.
+ *
+ * ns_per_packet is wall time. Cache misses and instructions are user
+ * space counts from perf_event_open, -1 when not permitted (see
+ * /proc/sys/kernel/perf_event_paranoid).
+ */
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "marco_fq_user.h"
+
+#define PKT_LEN 1000
+#define LINK_RATE (10000000000ULL / 8) /* bytes per second */
+#define FLOW_RATE (100000000UL / 8)
+#define WIRE_NS (PKT_LEN * 1000000000ULL / LINK_RATE)
+
+enum pairs
+{
+    PAIRS_SINGLE,
+    PAIRS_DISTINCT,
+    PAIRS_REVERSE,
+};
+
+static const char *pairs_names[] = {
+    [PAIRS_SINGLE] = "single",
+    [PAIRS_DISTINCT] = "distinct",
+    [PAIRS_REVERSE] = "reverse",
+};
+
+struct bench
+{
+    unsigned int flows;
+    int pacing;
+    enum pairs pairs;
+    unsigned long packets;
+    unsigned int backlog;
+
+    struct Qdisc *sch;
+    struct sock **socks;
+    uint64_t rnd;
+    unsigned long dequeued;
+};
+
+struct result
+{
+    double ns;
+    double misses;
+    double instructions;
+    unsigned long drops;
+    unsigned long long penalties;
+    unsigned long long throttled;
+};
+
+static int perf_open(__u64 config)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long perf_read(int fd)
+{
+    long long val;
+
+    if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+        return -1;
+    return val;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64 : cheap enough not to show in the numbers */
+static unsigned int next_flow(struct bench *b)
+{
+    b->rnd ^= b->rnd << 13;
+    b->rnd ^= b->rnd >> 7;
+    b->rnd ^= b->rnd << 17;
+    return b->rnd % b->flows;
+}
+
+static void flow_addrs(const struct bench *b, unsigned int flow, __be32 *saddr, __be32 *daddr)
+{
+    __u32 a = htonl(0x0a000000 + 1), c;
+
+    switch (b->pairs)
+    {
+    case PAIRS_SINGLE:
+        *saddr = a;
+        *daddr = htonl(0x0a010000 + 1);
+        break;
+    case PAIRS_DISTINCT:
+        *saddr = a;
+        *daddr = htonl(0x0a400000 + flow);
+        break;
+    case PAIRS_REVERSE:
+        /* flows 2k and 2k+1 go both ways between their own two hosts :
+         * a host shared by all pairs would put all of them in one bucket
+         */
+        a = htonl(0x0a800000 + flow / 2);
+        c = htonl(0x0a400000 + flow / 2);
+        *saddr = flow & 1 ? c : a;
+        *daddr = flow & 1 ? a : c;
+        break;
+    }
+}
+
+static int enqueue(struct bench *b, unsigned int flow)
+{
+    struct mfq_pkt p = {
+        .protocol = IPPROTO_UDP,
+        .len = PKT_LEN,
+        .hash = flow * 2654435761U + 1,
+        .sk = b->socks ? b->socks[flow] : NULL,
+    };
+    struct sk_buff *skb;
+
+    flow_addrs(b, flow, &p.saddr, &p.daddr);
+    skb = mfq_skb_alloc(&p);
+    if (!skb)
+        return -ENOMEM;
+    return mfq_enqueue(b->sch, skb);
+}
+
+/* Dequeues one packet, waiting for the watchdog when all are throttled */
+static void dequeue(struct bench *b)
+{
+    struct sk_buff *skb;
+
+    while (mfq_qlen(b->sch))
+    {
+        skb = mfq_dequeue(b->sch);
+        if (skb)
+        {
+            mfq_skb_free(skb);
+            mfq_clock_advance(WIRE_NS);
+            b->dequeued++;
+            return;
+        }
+        if (mfq_watchdog_expires(b->sch) <= mfq_clock_now())
+            mfq_clock_advance(WIRE_NS);
+        else
+            mfq_clock_set(mfq_watchdog_expires(b->sch));
+    }
+}
+
+static int setup(struct bench *b)
+{
+    unsigned int log = 1, i;
+    struct mfq_opts o;
+    int err;
+
+    while (log < 18 && (1U << log) < b->flows)
+        log++;
+
+    mfq_opts_init(&o);
+    mfq_opts_u32(&o, TCA_FQ_PLIMIT, b->backlog * 2);
+    mfq_opts_u32(&o, TCA_FQ_FLOW_PLIMIT, b->backlog + 1);
+    mfq_opts_u32(&o, TCA_FQ_BUCKETS_LOG, log);
+    mfq_opts_u32(&o, TCA_FQ_ORPHAN_MASK, ~0U);
+    mfq_opts_u32(&o, TCA_FQ_RATE_ENABLE, b->pacing);
+    err = mfq_create(&b->sch, 1500, &o);
+    if (err)
+        return err;
+
+    if (b->pacing)
+    {
+        b->socks = calloc(b->flows, sizeof(*b->socks));
+        if (!b->socks)
+            return -ENOMEM;
+        for (i = 0; i < b->flows; i++)
+        {
+            b->socks[i] = mfq_sock_alloc(IPPROTO_UDP, i * 2654435761U + 1, FLOW_RATE);
+            if (!b->socks[i])
+                return -ENOMEM;
+        }
+    }
+
+    /* Every flow sent once, so that the table holds them all, then the
+     * backlog is built
+     */
+    for (i = 0; i < b->flows; i++)
+    {
+        enqueue(b, i);
+        dequeue(b);
+    }
+    for (i = 0; i < b->backlog; i++)
+        enqueue(b, next_flow(b));
+    return 0;
+}
+
+static void teardown(struct bench *b)
+{
+    unsigned int i;
+
+    if (b->sch)
+        mfq_destroy(b->sch);
+    if (b->socks)
+    {
+        for (i = 0; i < b->flows; i++)
+            if (b->socks[i])
+                mfq_sock_free(b->socks[i]);
+        free(b->socks);
+    }
+    mfq_pairs_clear();
+    b->sch = NULL;
+    b->socks = NULL;
+}
+
+static int run(struct bench *b, struct result *r)
+{
+    struct tc_marco_fq_qd_stats *st;
+    int fd_misses, fd_insns, err;
+    unsigned long i, drops;
+    uint64_t start;
+
+    b->rnd = 88172645463325252ULL;
+    b->dequeued = 0;
+    err = setup(b);
+    if (err)
+    {
+        teardown(b);
+        return err;
+    }
+    drops = mfq_drops(b->sch);
+
+    fd_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    fd_insns = perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+    if (fd_misses >= 0)
+        ioctl(fd_misses, PERF_EVENT_IOC_ENABLE, 0);
+    if (fd_insns >= 0)
+        ioctl(fd_insns, PERF_EVENT_IOC_ENABLE, 0);
+
+    start = now_ns();
+    for (i = 0; i < b->packets; i++)
+    {
+        enqueue(b, next_flow(b));
+        dequeue(b);
+    }
+    r->ns = (double)(now_ns() - start) / b->packets;
+
+    if (fd_misses >= 0)
+        ioctl(fd_misses, PERF_EVENT_IOC_DISABLE, 0);
+    if (fd_insns >= 0)
+        ioctl(fd_insns, PERF_EVENT_IOC_DISABLE, 0);
+    r->misses = fd_misses >= 0 ? (double)perf_read(fd_misses) / b->packets : -1;
+    r->instructions = fd_insns >= 0 ? (double)perf_read(fd_insns) / b->packets : -1;
+    if (fd_misses >= 0)
+        close(fd_misses);
+    if (fd_insns >= 0)
+        close(fd_insns);
+
+    r->drops = mfq_drops(b->sch) - drops;
+    r->penalties = 0;
+    r->throttled = 0;
+    st = calloc(1, sizeof(*st));
+    if (st && !mfq_stats(b->sch, st))
+    {
+        r->penalties = st->penalties;
+        r->throttled = st->throttled;
+    }
+    free(st);
+    teardown(b);
+    return 0;
+}
+
+static int parse_flows(char *arg, unsigned int *flows, int max)
+{
+    char *tok;
+    int n = 0;
+
+    for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ","))
+    {
+        flows[n] = strtoul(tok, NULL, 0);
+        if (!flows[n])
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int flows[16] = {1, 1000, 100000, 1000000};
+    unsigned long packets = 1000000;
+    unsigned int backlog = 10000, repeat = 3;
+    int nr_flows = 4, c, i, pacing, pairs;
+    FILE *out = stdout;
+    char *file = NULL;
+
+    while ((c = getopt(argc, argv, "f:n:b:r:o:")) != -1)
+    {
+        switch (c)
+        {
+        case 'f':
+            nr_flows = parse_flows(optarg, flows, 16);
+            if (nr_flows <= 0)
+                goto usage;
+            break;
+        case 'n':
+            packets = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            backlog = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            repeat = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            file = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!packets || !backlog || !repeat || optind != argc)
+        goto usage;
+
+    if (file)
+    {
+        out = fopen(file, "w");
+        if (!out)
+        {
+            perror(file);
+            return 1;
+        }
+    }
+    if (mfq_lib_init())
+    {
+        fprintf(stderr, "mfq_lib_init failed\n");
+        return 1;
+    }
+    mfq_clock_set(1000000000);
+
+    fprintf(out, "flows,pacing,pairs,packets,backlog,ns_per_packet,"
+                 "cache_misses_per_packet,instructions_per_packet,drops,"
+                 "penalties,throttled\n");
+    for (i = 0; i < nr_flows; i++)
+    {
+        for (pacing = 0; pacing <= 1; pacing++)
+        {
+            for (pairs = PAIRS_SINGLE; pairs <= PAIRS_REVERSE; pairs++)
+            {
+                struct bench b = {
+                    .flows = flows[i],
+                    .pacing = pacing,
+                    .pairs = pairs,
+                    .packets = packets,
+                    .backlog = backlog,
+                };
+                struct result best = {}, r;
+                unsigned int n;
+                int err;
+
+                for (n = 0; n < repeat; n++)
+                {
+                    err = run(&b, &r);
+                    if (err)
+                    {
+                        fprintf(stderr, "%u flows: %s\n", flows[i], strerror(-err));
+                        return 1;
+                    }
+                    if (!n || r.ns < best.ns)
+                        best = r;
+                }
+                fprintf(out, "%u,%d,%s,%lu,%u,%.1f,%.*f,%.0f,%lu,%llu,%llu\n",
+                        flows[i], pacing, pairs_names[pairs], packets, backlog,
+                        best.ns, best.misses < 0 ? 0 : 2, best.misses,
+                        best.instructions, best.drops, best.penalties,
+                        best.throttled);
+                fflush(out);
+            }
+        }
+    }
+
+    mfq_lib_exit();
+    if (out != stdout)
+        fclose(out);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: bench_marco_fq [ -f FLOWS,... ] [ -n PACKETS ] "
+                    "[ -b BACKLOG ] [ -r REPEAT ] [ -o FILE ]\n");
+    return 1;
+}
@@ -0,0 +1,982 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * kshim.h  Just enough of the kernel API to build marco_fq.c in userspace.
+ *
+ * Every <linux/...> and <net/...> header included by marco_fq.c that is
+ * not a uapi header is a one line file including this one.
+ *
+ * The library is single threaded : locks, RCU and per cpu data collapse
+ * to plain accesses, and there is one cpu.
+ */
+#ifndef _MARCO_FQ_KSHIM_H
+#define _MARCO_FQ_KSHIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <linux/types.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/gen_stats.h>
+
+/* Types */
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s8 s8;
+typedef __s16 s16;
+typedef __s32 s32;
+typedef __s64 s64;
+typedef u64 netdev_features_t;
+typedef u32 gfp_t;
+
+#define __force
+#define __rcu
+#define __percpu
+#define __iomem
+#define __packed __attribute__((packed))
+#define __read_mostly
+#define __init
+#define __exit
+#define __aligned(x) __attribute__((aligned(x)))
+#define ____cacheline_aligned __aligned(64)
+#define ____cacheline_aligned_in_smp __aligned(64)
+#define L1_CACHE_BYTES 64
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define prefetch(x) __builtin_prefetch(x)
+
+#define READ_ONCE(x) (*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define BUG_ON(cond) do { if (unlikely(cond)) { fprintf(stderr, "BUG_ON(%s) %s:%d\n", #cond, __FILE__, __LINE__); abort(); } } while (0)
+#define WARN_ON_ONCE(cond) ({ bool __c = !!(cond); if (__c) fprintf(stderr, "WARN_ON_ONCE(%s) %s:%d\n", #cond, __FILE__, __LINE__); __c; })
+
+#define BIT(n) (1UL << (n))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr)-offsetof(type, member)))
+#define offsetofend(type, member) (offsetof(type, member) + sizeof(((type *)0)->member))
+
+#define min(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a < __b ? __a : __b; })
+#define max(a, b) ({ typeof(a) __a = (a); typeof(b) __b = (b); __a > __b ? __a : __b; })
+#define min_t(t, a, b) ({ t __a = (a); t __b = (b); __a < __b ? __a : __b; })
+#define clamp(v, lo, hi) min(max(v, lo), hi)
+#define max_t(t, a, b) ({ t __a = (a); t __b = (b); __a > __b ? __a : __b; })
+#define swap(a, b) do { typeof(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+
+#define U32_MAX ((u32)~0U)
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+#define ilog2(n) ((int)(63 - __builtin_clzll((u64)(n))))
+
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline unsigned long div64_ul(u64 a, unsigned long b) { return a / b; }
+#define do_div(n, base) ({ u32 __rem = (n) % (base); (n) /= (base); __rem; })
+
+/* Byte order */
+
+#define htons(x) htobe16(x)
+#define ntohs(x) be16toh(x)
+#define htonl(x) htobe32(x)
+#define ntohl(x) be32toh(x)
+
+static inline void be16_add_cpu(__be16 *var, u16 val)
+{
+    *var = htons(ntohs(*var) + val);
+}
+
+/* Errors */
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+static inline bool IS_ERR_OR_NULL(const void *ptr) { return !ptr || IS_ERR_VALUE(ptr); }
+
+/* Logging. The pair table code prints for every packet : quiet unless
+ * MARCO_FQ_PRINTK is set in the environment.
+ */
+
+int mfq_printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int mfq_sprintf(char *buf, const char *fmt, ...);
+#define printk(...) mfq_printk(__VA_ARGS__)
+#define pr_warn_ratelimited(...) mfq_printk(__VA_ARGS__)
+#define sprintf mfq_sprintf
+
+/* Time : ktime_get_ns() follows CLOCK_MONOTONIC, or a clock set by the
+ * caller, see mfq_clock_set()
+ */
+
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+#define HZ 1000
+
+u64 ktime_get_ns(void);
+#define local_clock() ktime_get_ns()
+#define jiffies ((unsigned long)(ktime_get_ns() / (NSEC_PER_SEC / HZ)))
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+
+static inline unsigned long msecs_to_jiffies(unsigned int m) { return m * HZ / 1000; }
+static inline unsigned long usecs_to_jiffies(unsigned int u) { return (u + (1000000 / HZ) - 1) / (1000000 / HZ); }
+static inline unsigned int jiffies_to_usecs(unsigned long j) { return j * (1000000 / HZ); }
+
+#define cond_resched() do { } while (0)
+void msleep(unsigned int msecs);
+
+/* Memory */
+
+#define GFP_KERNEL 0U
+#define GFP_ATOMIC 1U
+#define __GFP_NOWARN 0U
+#define __GFP_RETRY_MAYFAIL 0U
+#define NUMA_NO_NODE (-1)
+#define PAGE_SIZE 4096UL
+
+static inline void *kmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t flags) { return malloc(n * size); }
+static inline void *kmemdup(const void *src, size_t len, gfp_t flags)
+{
+    void *p = malloc(len);
+
+    if (p)
+        memcpy(p, src, len);
+    return p;
+}
+static inline void kfree(const void *p) { free((void *)p); }
+#define kvmalloc_array kmalloc_array
+#define kvmalloc_node(size, flags, node) kmalloc(size, flags)
+static inline void *kvcalloc(size_t n, size_t size, gfp_t flags) { return calloc(n, size); }
+#define kvfree kfree
+#define vmalloc_user(size) calloc(1, size)
+#define vfree kfree
+
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                     unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *s);
+void *kmem_cache_zalloc(struct kmem_cache *s, gfp_t flags);
+void kmem_cache_free(struct kmem_cache *s, void *p);
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p);
+
+/* Per cpu data, one cpu */
+
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (p)
+#define this_cpu_ptr(p) (p)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+typedef struct { u64 v; } u64_stats_t;
+struct u64_stats_sync { int unused; };
+#define u64_stats_init(s) do { } while (0)
+#define u64_stats_update_begin(s) do { } while (0)
+#define u64_stats_update_end(s) do { } while (0)
+static inline unsigned int u64_stats_fetch_begin(const struct u64_stats_sync *s) { return 0; }
+static inline bool u64_stats_fetch_retry(const struct u64_stats_sync *s, unsigned int start) { return false; }
+#define u64_stats_add(p, val) ((p)->v += (val))
+#define u64_stats_inc(p) ((p)->v++)
+#define u64_stats_read(p) ((p)->v)
+
+/* Locks, sequence counts and RCU */
+
+typedef struct { int unused; } spinlock_t;
+#define DEFINE_SPINLOCK(x) spinlock_t x
+#define spin_lock_init(l) do { } while (0)
+static inline void spin_lock(spinlock_t *l) { }
+static inline void spin_unlock(spinlock_t *l) { }
+#define SINGLE_DEPTH_NESTING 1
+#define spin_lock_nested(l, subclass) spin_lock(l)
+#define spin_lock_irq spin_lock
+#define spin_unlock_irq spin_unlock
+#define spin_lock_irqsave(l, flags) do { spin_lock(l); (flags) = 0; } while (0)
+#define spin_unlock_irqrestore(l, flags) do { spin_unlock(l); (void)(flags); } while (0)
+#define local_bh_disable() do { } while (0)
+#define local_bh_enable() do { } while (0)
+#define rtnl_lock() do { } while (0)
+#define rtnl_unlock() do { } while (0)
+
+typedef struct { unsigned int sequence; } seqcount_t;
+#define seqcount_init(s) ((s)->sequence = 0)
+#define write_seqcount_begin(s) ((s)->sequence++)
+#define write_seqcount_end(s) ((s)->sequence++)
+#define read_seqcount_begin(s) ((s)->sequence)
+#define read_seqcount_retry(s, start) ((s)->sequence != (start))
+
+typedef struct { int refs; } refcount_t;
+#define refcount_set(r, n) ((r)->refs = (n))
+#define refcount_read(r) ((r)->refs)
+#define refcount_inc(r) ((void)__atomic_add_fetch(&(r)->refs, 1, __ATOMIC_RELAXED))
+#define refcount_dec_and_test(r) (__atomic_sub_fetch(&(r)->refs, 1, __ATOMIC_ACQ_REL) == 0)
+
+typedef struct { int counter; } atomic_t;
+#define ATOMIC_INIT(n) {(n)}
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_inc(v) ((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_dec(v) ((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+#define cmpxchg(p, o, n) ({ typeof(*(p)) __o = (o); __atomic_compare_exchange_n(p, &__o, n, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); __o; })
+
+struct rcu_head { void *unused; };
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define rcu_dereference(p) (p)
+#define rcu_dereference_bh_check(p, c) (p)
+#define rcu_dereference_protected(p, c) (p)
+#define rtnl_dereference(p) (p)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+#define rcu_assign_pointer(p, v) ((p) = (v))
+#define rcu_replace_pointer(p, v, c) ({ typeof(p) __old = (p); (p) = (v); __old; })
+#define kfree_rcu(p, field) kfree(p)
+#define synchronize_rcu() do { } while (0)
+#define lockdep_rtnl_is_held() 1
+
+/* Lists */
+
+struct hlist_head { struct hlist_node *first; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+    n->next = h->first;
+    if (h->first)
+        h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del(struct hlist_node *n)
+{
+    *n->pprev = n->next;
+    if (n->next)
+        n->next->pprev = n->pprev;
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+    ({ typeof(ptr) ____ptr = (ptr); ____ptr ? container_of(____ptr, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member)                            \
+    for (pos = hlist_entry_safe((head)->first, typeof(*(pos)), member); pos; \
+         pos = hlist_entry_safe((pos)->member.next, typeof(*(pos)), member))
+#define hlist_for_each_entry_safe(pos, n, head, member)                       \
+    for (pos = hlist_entry_safe((head)->first, typeof(*pos), member);         \
+         pos && ({ n = pos->member.next; 1; });                               \
+         pos = hlist_entry_safe(n, typeof(*pos), member))
+
+#define GOLDEN_RATIO_32 0x61C88647U
+#define GOLDEN_RATIO_64 0x61C8864680B583EBULL
+
+static inline bool before(u32 seq1, u32 seq2) { return (s32)(seq1 - seq2) < 0; }
+#define after(seq2, seq1) before(seq1, seq2)
+
+u32 jhash_1word(u32 a, u32 initval);
+
+static inline u32 hash_32(u32 val, unsigned int bits) { return (val * GOLDEN_RATIO_32) >> (32 - bits); }
+static inline u32 hash_64(u64 val, unsigned int bits) { return (u32)((val * GOLDEN_RATIO_64) >> (64 - bits)); }
+#define hash_ptr(ptr, bits) hash_64((unsigned long)(ptr), bits)
+#define hash_min(val, bits) (sizeof(val) <= 4 ? hash_32(val, bits) : hash_64(val, bits))
+
+#define DEFINE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name) (ARRAY_SIZE(name))
+#define HASH_BITS(name) ilog2(HASH_SIZE(name))
+#define hash_init(table) memset(table, 0, sizeof(table))
+#define hash_add(table, node, key) hlist_add_head(node, &table[hash_min(key, HASH_BITS(table))])
+#define hash_del(node) hlist_del(node)
+#define hash_for_each_possible(name, obj, member, key) \
+    hlist_for_each_entry(obj, &name[hash_min(key, HASH_BITS(name))], member)
+#define hash_for_each_safe(name, bkt, tmp, obj, member)                \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < (int)HASH_SIZE(name); (bkt)++) \
+        hlist_for_each_entry_safe(obj, tmp, &name[bkt], member)
+
+struct llist_node { struct llist_node *next; };
+struct llist_head { struct llist_node *first; };
+#define LLIST_HEAD(name) struct llist_head name = { NULL }
+
+static inline bool llist_add(struct llist_node *n, struct llist_head *h)
+{
+    n->next = h->first;
+    h->first = n;
+    return !n->next;
+}
+
+static inline struct llist_node *llist_del_all(struct llist_head *h)
+{
+    struct llist_node *first = h->first;
+
+    h->first = NULL;
+    return first;
+}
+
+#define llist_entry(ptr, type, member) container_of(ptr, type, member)
+#define member_address_is_nonnull(ptr, member) ((uintptr_t)(ptr) + offsetof(typeof(*(ptr)), member) != 0)
+#define llist_for_each_entry_safe(pos, n, node, member)                     \
+    for (pos = llist_entry((node), typeof(*pos), member);                   \
+         member_address_is_nonnull(pos, member) &&                          \
+         (n = llist_entry(pos->member.next, typeof(*n), member), true);     \
+         pos = n)
+
+/* Red-black trees, see kshim.c */
+
+struct rb_node
+{
+    unsigned long __rb_parent_color;
+    struct rb_node *rb_right;
+    struct rb_node *rb_left;
+} __aligned(sizeof(long));
+
+struct rb_root { struct rb_node *rb_node; };
+
+#define RB_ROOT ((struct rb_root){ NULL })
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_entry_safe(ptr, type, member) \
+    ({ typeof(ptr) ____ptr = (ptr); ____ptr ? rb_entry(____ptr, type, member) : NULL; })
+#define rb_parent(r) ((struct rb_node *)((r)->__rb_parent_color & ~3))
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+    node->__rb_parent_color = (unsigned long)parent;
+    node->rb_left = node->rb_right = NULL;
+    *link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_first_postorder(const struct rb_root *root);
+struct rb_node *rb_next_postorder(const struct rb_node *node);
+
+#define rbtree_postorder_for_each_entry_safe(pos, n, root, field)                        \
+    for (pos = rb_entry_safe(rb_first_postorder(root), typeof(*pos), field);             \
+         pos && ({ n = rb_entry_safe(rb_next_postorder(&pos->field), typeof(*pos), field); 1; }); \
+         pos = n)
+
+void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *),
+          void (*swap_fn)(void *, void *, int));
+
+int kstrtouint(const char *s, unsigned int base, unsigned int *res);
+
+/* Work items run synchronously */
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+struct work_struct { work_func_t func; };
+struct workqueue_struct;
+#define system_unbound_wq ((struct workqueue_struct *)NULL)
+#define INIT_WORK(w, f) ((w)->func = (f))
+#define DECLARE_WORK(n, f) struct work_struct n = { .func = (f) }
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *w)
+{
+    w->func(w);
+    return true;
+}
+#define schedule_work(w) queue_work(NULL, w)
+#define flush_work(w) true
+#define cancel_work_sync(w) false
+
+/* Delayed work runs at once without a delay, and never by itself once
+ * delayed, like the watchdog
+ */
+struct delayed_work { struct work_struct work; };
+#define INIT_DELAYED_WORK(w, f) INIT_WORK(&(w)->work, f)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+static inline bool schedule_delayed_work(struct delayed_work *w, unsigned long delay)
+{
+    return delay ? true : queue_work(NULL, &w->work);
+}
+#define cancel_delayed_work_sync(w) false
+
+/* Modules */
+
+struct module;
+#define THIS_MODULE ((struct module *)NULL)
+#define try_module_get(m) true
+#define module_put(m) do { } while (0)
+#define __module_get(m) do { } while (0)
+#define module_init(fn) int mfq_module_init(void) { return fn(); }
+#define module_exit(fn) void mfq_module_exit(void) { fn(); }
+#define EXPORT_SYMBOL_GPL(sym) extern int mfq_module_dummy
+#define MODULE_AUTHOR(x) extern int mfq_module_dummy
+#define MODULE_LICENSE(x) extern int mfq_module_dummy
+#define MODULE_DESCRIPTION(x) extern int mfq_module_dummy
+
+/* Files : no debugfs in userspace, the files are never created */
+
+struct dentry { struct { const char *name; } d_name; };
+struct inode;
+struct file { void *private_data; struct { struct dentry *dentry; } f_path; };
+struct vm_area_struct { unsigned long vm_flags; unsigned long vm_pgoff; };
+#define VM_WRITE 0x2UL
+#define VM_MAYWRITE 0x20UL
+struct file_operations
+{
+    struct module *owner;
+    int (*open)(struct inode *, struct file *);
+    int (*mmap)(struct file *, struct vm_area_struct *);
+    long long (*llseek)(struct file *, long long, int);
+    ssize_t (*read)(struct file *, char *, size_t, long long *);
+    int (*release)(struct inode *, struct file *);
+};
+#define simple_open NULL
+#define no_llseek NULL
+#define remap_vmalloc_range(vma, addr, pgoff) (-ENODEV)
+
+#define debugfs_create_dir(name, parent) ((struct dentry *)ERR_PTR(-ENODEV))
+#define debugfs_create_file(name, mode, parent, data, fops) ((struct dentry *)ERR_PTR(-ENODEV))
+#define debugfs_create_file_unsafe debugfs_create_file
+#define debugfs_remove_recursive(d) do { } while (0)
+#define debugfs_file_get(d) 0
+#define debugfs_file_put(d) do { } while (0)
+
+struct seq_file { void *private; FILE *f; };
+#define seq_printf(m, ...) fprintf((m)->f, __VA_ARGS__)
+#define seq_puts(m, s) fputs(s, (m)->f)
+#define DEFINE_SHOW_ATTRIBUTE(name) \
+    static const struct file_operations name##_fops __attribute__((unused)) = { .owner = THIS_MODULE }
+
+/* Netlink */
+
+enum
+{
+    NLA_UNSPEC,
+    NLA_U8,
+    NLA_U16,
+    NLA_U32,
+    NLA_U64,
+};
+
+struct nla_policy
+{
+    u8 type;
+    u16 strict_start_type;
+};
+
+struct netlink_ext_ack { const char *msg; };
+#define NL_SET_ERR_MSG_MOD(extack, m) do { if (extack) (extack)->msg = (m); } while (0)
+
+static inline void *nla_data(const struct nlattr *nla) { return (char *)nla + NLA_HDRLEN; }
+static inline int nla_len(const struct nlattr *nla) { return nla->nla_len - NLA_HDRLEN; }
+static inline u32 nla_get_u32(const struct nlattr *nla) { return *(u32 *)nla_data(nla); }
+static inline u8 nla_get_u8(const struct nlattr *nla) { return *(u8 *)nla_data(nla); }
+int nla_parse_nested_deprecated(struct nlattr **tb, int maxtype, const struct nlattr *nla,
+                                const struct nla_policy *policy, struct netlink_ext_ack *extack);
+
+/* Network devices, packets and sockets */
+
+struct net_device;
+struct Qdisc;
+
+struct netdev_queue
+{
+    struct net_device *dev;
+    struct Qdisc *qdisc;
+    struct Qdisc *qdisc_sleeping;
+};
+
+struct net_device
+{
+    char name[16];
+    unsigned int mtu;
+    unsigned short hard_header_len;
+    struct netdev_queue _tx; /* a single tx queue */
+};
+
+#define netdev_queue_numa_node_read(q) NUMA_NO_NODE
+#define IFNAMSIZ 16
+#define NET_NAME_UNKNOWN 0
+
+struct net_device *alloc_netdev(int sizeof_priv, const char *name, unsigned char name_assign_type,
+                                void (*setup)(struct net_device *));
+void ether_setup(struct net_device *dev);
+void free_netdev(struct net_device *dev);
+static inline struct netdev_queue *netdev_get_tx_queue(struct net_device *dev, unsigned int index) { return &dev->_tx; }
+
+enum
+{
+    TCP_ESTABLISHED = 1,
+    TCP_SYN_SENT,
+    TCP_SYN_RECV,
+    TCP_FIN_WAIT1,
+    TCP_FIN_WAIT2,
+    TCP_TIME_WAIT,
+    TCP_CLOSE,
+    TCP_CLOSE_WAIT,
+    TCP_LAST_ACK,
+    TCP_LISTEN,
+    TCP_CLOSING,
+    TCP_NEW_SYN_RECV,
+};
+
+enum sk_pacing
+{
+    SK_PACING_NONE = 0,
+    SK_PACING_NEEDED = 1,
+    SK_PACING_FQ = 2,
+};
+
+struct sock
+{
+    unsigned char sk_state;
+    u16 sk_protocol;
+    u32 sk_hash;
+    unsigned long sk_pacing_rate; /* bytes per second */
+    unsigned long sk_max_pacing_rate;
+    unsigned long sk_pacing_status; /* enum sk_pacing */
+};
+
+struct tcp_sock
+{
+    struct sock sk;
+    u32 snd_nxt;
+};
+
+static inline struct tcp_sock *tcp_sk(const struct sock *sk) { return (struct tcp_sock *)sk; }
+static inline bool sk_fullsock(const struct sock *sk) { return sk->sk_state != TCP_TIME_WAIT && sk->sk_state != TCP_NEW_SYN_RECV; }
+static inline bool sk_listener(const struct sock *sk) { return sk->sk_state == TCP_LISTEN || sk->sk_state == TCP_NEW_SYN_RECV; }
+
+struct sk_buff
+{
+    union
+    {
+        struct
+        {
+            struct sk_buff *next;
+            struct sk_buff *prev;
+        };
+        struct rb_node rbnode;
+    };
+    struct sock *sk;
+    u64 tstamp;
+    struct net_device *dev;
+    char cb[48] __aligned(8);
+    void (*destructor)(struct sk_buff *skb);
+    unsigned int len;
+    unsigned int data_len;
+    u32 hash;
+    u32 priority;
+    u16 gso_size;
+    u8 ip_summed : 2;
+    __wsum csum;
+    u16 mac_header;
+    u16 network_header;
+    __be16 protocol;
+    u8 encapsulation : 1;
+    unsigned char *head;
+    unsigned char *data;
+    unsigned char *tail; /* netlink attributes written by dump callbacks */
+    unsigned char *end;
+};
+
+#define skb_list_walk_safe(first, skb, next_skb)                             \
+    for ((skb) = (first), (next_skb) = (skb) ? (skb)->next : NULL; (skb);    \
+         (skb) = (next_skb), (next_skb) = (skb) ? (skb)->next : NULL)
+
+#define rb_to_skb(rb) rb_entry_safe(rb, struct sk_buff, rbnode)
+#define skb_rb_first(root) rb_to_skb(rb_first(root))
+
+static inline void skb_mark_not_on_list(struct sk_buff *skb) { skb->next = NULL; }
+static inline unsigned int skb_headlen(const struct sk_buff *skb) { return skb->len - skb->data_len; }
+static inline bool skb_is_gso(const struct sk_buff *skb) { return skb->gso_size; }
+static inline unsigned int skb_headroom(const struct sk_buff *skb) { return skb->data - skb->head; }
+static inline unsigned char *skb_network_header(const struct sk_buff *skb) { return skb->head + skb->network_header; }
+static inline int skb_network_offset(const struct sk_buff *skb) { return skb_network_header(skb) - skb->data; }
+static inline bool skb_mac_header_was_set(const struct sk_buff *skb) { return skb->mac_header != (u16)~0U; }
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb) { return (struct iphdr *)skb_network_header(skb); }
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb) { return (struct ipv6hdr *)skb_network_header(skb); }
+
+static inline void *skb_header_pointer(const struct sk_buff *skb, int offset, int len, void *buffer)
+{
+    if (offset < 0 || offset + len > (int)skb_headlen(skb))
+        return NULL;
+    return skb->data + offset;
+}
+
+static inline unsigned char *skb_push(struct sk_buff *skb, unsigned int len)
+{
+    skb->data -= len;
+    skb->len += len;
+    return skb->data;
+}
+
+/* Packets are built CHECKSUM_NONE, only the arithmetic is real */
+#define CHECKSUM_NONE 0
+#define CHECKSUM_COMPLETE 2
+
+static inline __wsum csum_add(__wsum csum, __wsum addend)
+{
+    u32 res = (u32)csum + (u32)addend;
+
+    return (__wsum)(res + (res < (u32)addend));
+}
+
+static inline __wsum csum_sub(__wsum csum, __wsum addend)
+{
+    return csum_add(csum, ~addend);
+}
+
+static inline void skb_postpull_rcsum(struct sk_buff *skb, const void *start, unsigned int len) {}
+static inline void skb_postpush_rcsum(struct sk_buff *skb, const void *start, unsigned int len) {}
+
+static inline int skb_cow_head(struct sk_buff *skb, unsigned int headroom)
+{
+    return skb_headroom(skb) >= headroom ? 0 : -ENOMEM;
+}
+
+static inline int skb_ensure_writable(struct sk_buff *skb, int len)
+{
+    return len <= (int)skb_headlen(skb) ? 0 : -ENOMEM;
+}
+
+/* Packets are shells of MFQ_SKB_ROOM bytes of data, recycled by
+ * mfq_skb_free() and given back to libc by mfq_skb_cache_drain()
+ */
+#define MFQ_SKB_ROOM 256
+#define NET_IP_ALIGN 2
+#define PKT_HASH_TYPE_L4 3
+
+struct sk_buff *alloc_skb(unsigned int size, gfp_t priority);
+void mfq_skb_cache_drain(void);
+
+static inline void skb_reserve(struct sk_buff *skb, int len)
+{
+    skb->data += len;
+    skb->tail += len;
+}
+
+static inline void *skb_put_zero(struct sk_buff *skb, unsigned int len)
+{
+    unsigned char *tmp = skb->tail;
+
+    skb->tail += len;
+    skb->len += len;
+    BUG_ON(skb->tail > skb->end);
+    memset(tmp, 0, len);
+    return tmp;
+}
+
+static inline void skb_reset_mac_header(struct sk_buff *skb) { skb->mac_header = skb->data - skb->head; }
+static inline void skb_set_network_header(struct sk_buff *skb, const int offset) { skb->network_header = skb->data - skb->head + offset; }
+static inline void skb_set_hash(struct sk_buff *skb, u32 hash, int type) { skb->hash = hash; }
+
+u32 skb_get_hash(struct sk_buff *skb);
+void kfree_skb(struct sk_buff *skb);
+#define consume_skb kfree_skb
+void kfree_skb_list(struct sk_buff *segs);
+#define rtnl_kfree_skbs(head, tail) kfree_skb_list(head)
+
+/* NULL terminated, unlike the kernel's : a zeroed head is empty */
+struct sk_buff_head
+{
+    struct sk_buff *next;
+    struct sk_buff *prev;
+    u32 qlen;
+};
+
+static inline struct sk_buff *skb_peek(const struct sk_buff_head *list) { return list->next; }
+
+static inline void __skb_queue_tail(struct sk_buff_head *list, struct sk_buff *skb)
+{
+    skb->next = NULL;
+    if (list->prev)
+        list->prev->next = skb;
+    else
+        list->next = skb;
+    list->prev = skb;
+    list->qlen++;
+}
+
+static inline void __skb_queue_head(struct sk_buff_head *list, struct sk_buff *skb)
+{
+    skb->next = list->next;
+    list->next = skb;
+    if (!list->prev)
+        list->prev = skb;
+    list->qlen++;
+}
+
+static inline struct sk_buff *__skb_dequeue(struct sk_buff_head *list)
+{
+    struct sk_buff *skb = list->next;
+
+    if (skb)
+    {
+        list->next = skb->next;
+        if (!list->next)
+            list->prev = NULL;
+        skb->next = NULL;
+        list->qlen--;
+    }
+    return skb;
+}
+
+static inline void __skb_queue_purge(struct sk_buff_head *list)
+{
+    struct sk_buff *skb;
+
+    while ((skb = __skb_dequeue(list)) != NULL)
+        kfree_skb(skb);
+}
+
+/* Appends list to head, leaving list empty */
+static inline void skb_queue_splice_tail_init(struct sk_buff_head *list, struct sk_buff_head *head)
+{
+    if (!list->next)
+        return;
+    if (head->prev)
+        head->prev->next = list->next;
+    else
+        head->next = list->next;
+    head->prev = list->prev;
+    head->qlen += list->qlen;
+    memset(list, 0, sizeof(*list));
+}
+
+static inline void skb_orphan(struct sk_buff *skb)
+{
+    if (skb->destructor)
+    {
+        skb->destructor(skb);
+        skb->destructor = NULL;
+    }
+    skb->sk = NULL;
+}
+
+/* No GSO : segmentation fails and the packet is dropped */
+#define NETIF_F_GSO_MASK ((netdev_features_t)0)
+static inline netdev_features_t netif_skb_features(struct sk_buff *skb) { return 0; }
+static inline struct sk_buff *skb_gso_segment(struct sk_buff *skb, netdev_features_t features)
+{
+    return ERR_PTR(-EPROTONOSUPPORT);
+}
+
+/* IP helpers */
+
+#define IP_MF 0x2000
+#define IP_OFFSET 0x1FFF
+#define INET_ECN_MASK 3
+#define INET_ECN_CE 3
+#define NEXTHDR_HOP 0
+#define NEXTHDR_DEST 60
+#define IPV6_TLV_PADN 1
+
+static inline bool ip_is_fragment(const struct iphdr *iph)
+{
+    return (iph->frag_off & htons(IP_MF | IP_OFFSET)) != 0;
+}
+
+static inline void ip_send_check(struct iphdr *iph)
+{
+    const u16 *w = (const u16 *)iph;
+    u32 sum = 0;
+    int i;
+
+    iph->check = 0;
+    for (i = 0; i < iph->ihl * 2; i++)
+        sum += w[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    iph->check = (u16)~sum;
+}
+
+static inline void ipv4_change_dsfield(struct iphdr *iph, u8 mask, u8 value)
+{
+    iph->tos = (iph->tos & mask) | value;
+    ip_send_check(iph);
+}
+
+static inline void ipv6_change_dsfield(struct ipv6hdr *ip6h, u8 mask, u8 value)
+{
+    u8 ds = (ip6h->priority << 4) | (ip6h->flow_lbl[0] >> 4);
+
+    ds = (ds & mask) | value;
+    ip6h->priority = ds >> 4;
+    ip6h->flow_lbl[0] = (ip6h->flow_lbl[0] & 0x0f) | (ds << 4);
+}
+
+static inline int INET_ECN_set_ce(struct sk_buff *skb)
+{
+    if (skb->protocol == htons(ETH_P_IP) && (ip_hdr(skb)->tos & INET_ECN_MASK))
+    {
+        ipv4_change_dsfield(ip_hdr(skb), 0xff, INET_ECN_CE);
+        return 1;
+    }
+    return 0;
+}
+
+/* Qdiscs */
+
+#define NET_XMIT_SUCCESS 0x00
+#define NET_XMIT_DROP 0x01
+#define NET_XMIT_CN 0x02
+
+struct qdisc_skb_cb
+{
+    struct
+    {
+        unsigned int pkt_len;
+        u16 slave_dev_queue_mapping;
+        u16 tc_classid;
+    };
+#define QDISC_CB_PRIV_LEN 20
+    unsigned char data[QDISC_CB_PRIV_LEN];
+};
+
+struct gnet_stats_basic_packed { u64 bytes; u64 packets; };
+
+struct gnet_dump
+{
+    void *app;      /* gnet_stats_copy_app() copies there */
+    int app_len;
+    struct gnet_stats_queue qstats;
+};
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len);
+int gnet_stats_copy_queue(struct gnet_dump *d, void *cpu_q, struct gnet_stats_queue *q, u32 qlen);
+
+struct qdisc_watchdog
+{
+    u64 last_expires;
+    struct Qdisc *qdisc;
+};
+
+struct Qdisc_ops;
+
+struct Qdisc
+{
+    const struct Qdisc_ops *ops;
+    u32 handle;
+    u32 parent;
+    u32 limit;
+    struct netdev_queue *dev_queue;
+    refcount_t refcnt;
+    struct sk_buff_head gso_skb; /* qdisc_peek_dequeued() */
+    struct sk_buff_head skb_bad_txq;
+    struct
+    {
+        u32 qlen;
+        spinlock_t lock;
+    } q;
+    struct gnet_stats_basic_packed bstats;
+    struct gnet_stats_queue qstats;
+};
+
+struct qdisc_walker
+{
+    int stop;
+    int skip;
+    int count;
+    int (*fn)(struct Qdisc *, unsigned long cl, struct qdisc_walker *);
+};
+
+struct Qdisc_class_ops
+{
+    struct Qdisc *(*leaf)(struct Qdisc *, unsigned long cl);
+    unsigned long (*find)(struct Qdisc *, u32 classid);
+    void (*walk)(struct Qdisc *, struct qdisc_walker *arg);
+    int (*dump)(struct Qdisc *, unsigned long, struct sk_buff *skb, struct tcmsg *);
+    int (*dump_stats)(struct Qdisc *, unsigned long, struct gnet_dump *);
+};
+
+struct Qdisc_ops
+{
+    const struct Qdisc_class_ops *cl_ops;
+    char id[16];
+    int priv_size;
+    int (*enqueue)(struct sk_buff *skb, struct Qdisc *sch, struct sk_buff **to_free);
+    struct sk_buff *(*dequeue)(struct Qdisc *);
+    struct sk_buff *(*peek)(struct Qdisc *);
+    int (*init)(struct Qdisc *sch, struct nlattr *arg, struct netlink_ext_ack *extack);
+    void (*reset)(struct Qdisc *);
+    void (*destroy)(struct Qdisc *);
+    int (*change)(struct Qdisc *sch, struct nlattr *arg, struct netlink_ext_ack *extack);
+    int (*dump)(struct Qdisc *, struct sk_buff *);
+    int (*dump_stats)(struct Qdisc *, struct gnet_dump *);
+    struct module *owner;
+};
+
+#define QDISC_ALIGNTO 64
+#define QDISC_ALIGN(len) (((len) + QDISC_ALIGNTO - 1) & ~(QDISC_ALIGNTO - 1))
+
+static inline void *qdisc_priv(struct Qdisc *q) { return (char *)q + QDISC_ALIGN(sizeof(struct Qdisc)); }
+static inline struct net_device *qdisc_dev(const struct Qdisc *q) { return q->dev_queue->dev; }
+static inline void __netif_schedule(struct Qdisc *q) { }
+static inline spinlock_t *qdisc_lock(struct Qdisc *qdisc) { return &qdisc->q.lock; }
+static inline struct qdisc_skb_cb *qdisc_skb_cb(const struct sk_buff *skb) { return (struct qdisc_skb_cb *)skb->cb; }
+static inline unsigned int qdisc_pkt_len(const struct sk_buff *skb) { return qdisc_skb_cb(skb)->pkt_len; }
+#define qdisc_cb_private_validate(skb, sz) BUILD_BUG_ON((sz) > QDISC_CB_PRIV_LEN)
+static inline unsigned int psched_mtu(const struct net_device *dev) { return dev->mtu + dev->hard_header_len; }
+
+static inline void qdisc_qstats_backlog_inc(struct Qdisc *sch, const struct sk_buff *skb) { sch->qstats.backlog += qdisc_pkt_len(skb); }
+static inline void qdisc_qstats_backlog_dec(struct Qdisc *sch, const struct sk_buff *skb) { sch->qstats.backlog -= qdisc_pkt_len(skb); }
+static inline void qdisc_bstats_update(struct Qdisc *sch, const struct sk_buff *skb)
+{
+    sch->bstats.bytes += qdisc_pkt_len(skb);
+    sch->bstats.packets++;
+}
+
+static inline int qdisc_drop(struct sk_buff *skb, struct Qdisc *sch, struct sk_buff **to_free)
+{
+    skb->next = *to_free;
+    *to_free = skb;
+    sch->qstats.drops++;
+    return NET_XMIT_DROP;
+}
+
+/* No parent qdisc to tell */
+static inline void qdisc_tree_reduce_backlog(struct Qdisc *sch, int n, int len) { }
+static inline void sch_tree_lock(struct Qdisc *sch) { }
+static inline void sch_tree_unlock(struct Qdisc *sch) { }
+
+struct sk_buff *qdisc_peek_dequeued(struct Qdisc *sch);
+
+#define CLOCK_MONOTONIC 1
+void qdisc_watchdog_init_clockid(struct qdisc_watchdog *wd, struct Qdisc *qdisc, int clockid);
+void qdisc_watchdog_schedule_range_ns(struct qdisc_watchdog *wd, u64 expires, u64 delta_ns);
+#define qdisc_watchdog_schedule_ns(wd, expires) qdisc_watchdog_schedule_range_ns(wd, expires, 0ULL)
+void qdisc_watchdog_cancel(struct qdisc_watchdog *wd);
+
+/* What sch_api.c does for a qdisc without a handle, and for its last reference */
+struct Qdisc *qdisc_create_dflt(struct netdev_queue *dev_queue, const struct Qdisc_ops *ops,
+                                unsigned int parentid, struct netlink_ext_ack *extack);
+/* The qdisc of a device that is not up */
+extern struct Qdisc noop_qdisc;
+void qdisc_reset(struct Qdisc *qdisc);
+void qdisc_put(struct Qdisc *qdisc);
+
+int register_qdisc(struct Qdisc_ops *qops);
+int unregister_qdisc(struct Qdisc_ops *qops);
+
+/* netlink attributes written by the dump callbacks */
+struct nlattr *nla_nest_start_noflag(struct sk_buff *skb, int attrtype);
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start);
+int nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data);
+static inline int nla_put_u32(struct sk_buff *skb, int attrtype, u32 value) { return nla_put(skb, attrtype, sizeof(value), &value); }
+static inline int nla_put_u8(struct sk_buff *skb, int attrtype, u8 value) { return nla_put(skb, attrtype, sizeof(value), &value); }
+
+#endif
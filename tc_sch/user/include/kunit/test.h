@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * kunit/test.h  The part of KUnit used by ../marco_fq_kunit.c, run by
+ * kunit.c. Failed assertions leave the test case with longjmp(), where
+ * KUnit leaves its kthread.
+ */
+#ifndef _MARCO_FQ_KUNIT_TEST_H
+#define _MARCO_FQ_KUNIT_TEST_H
+
+#include <setjmp.h>
+
+#include "../kshim.h"
+
+struct kunit
+{
+    const char *name;
+    bool failed;
+    void *priv;
+    jmp_buf abort;
+};
+
+struct kunit_case
+{
+    void (*run_case)(struct kunit *test);
+    const char *name;
+};
+
+#define KUNIT_CASE(test_name) { .run_case = test_name, .name = #test_name }
+
+struct kunit_suite
+{
+    const char name[256];
+    int (*init)(struct kunit *test);
+    void (*exit)(struct kunit *test);
+    struct kunit_case *test_cases;
+};
+
+/* The suite kunit.c runs */
+extern struct kunit_suite *mfq_kunit_suite;
+#define kunit_test_suite(suite) struct kunit_suite *mfq_kunit_suite = &(suite)
+
+void mfq_kunit_fail(struct kunit *test, const char *file, int line, const char *cond,
+                    bool assert);
+
+#define kunit_info(test, fmt, ...) printf("    # %s: " fmt, (test)->name, ##__VA_ARGS__)
+
+#define MFQ_KUNIT_CHECK(test, cond, assert)                                   \
+    do                                                                        \
+    {                                                                         \
+        if (!(cond))                                                          \
+            mfq_kunit_fail(test, __FILE__, __LINE__, #cond, assert);          \
+    } while (0)
+
+/* Operands must have the same type, as KUnit checks with __typecheck() */
+#define MFQ_KUNIT_BINARY(test, left, op, right, assert)                       \
+    do                                                                        \
+    {                                                                         \
+        typeof(left) __left = (left);                                         \
+        typeof(right) __right = (right);                                      \
+                                                                              \
+        (void)(&__left == &__right);                                          \
+        if (!(__left op __right))                                             \
+            mfq_kunit_fail(test, __FILE__, __LINE__, #left " " #op " " #right, \
+                           assert);                                           \
+    } while (0)
+
+#define KUNIT_EXPECT_TRUE(test, cond) MFQ_KUNIT_CHECK(test, cond, false)
+#define KUNIT_EXPECT_FALSE(test, cond) MFQ_KUNIT_CHECK(test, !(cond), false)
+#define KUNIT_EXPECT_NULL(test, ptr) MFQ_KUNIT_CHECK(test, (ptr) == NULL, false)
+#define KUNIT_EXPECT_NOT_ERR_OR_NULL(test, ptr) MFQ_KUNIT_CHECK(test, !IS_ERR_OR_NULL(ptr), false)
+#define KUNIT_EXPECT_EQ(test, l, r) MFQ_KUNIT_BINARY(test, l, ==, r, false)
+#define KUNIT_EXPECT_NE(test, l, r) MFQ_KUNIT_BINARY(test, l, !=, r, false)
+#define KUNIT_EXPECT_LT(test, l, r) MFQ_KUNIT_BINARY(test, l, <, r, false)
+#define KUNIT_EXPECT_LE(test, l, r) MFQ_KUNIT_BINARY(test, l, <=, r, false)
+#define KUNIT_EXPECT_GT(test, l, r) MFQ_KUNIT_BINARY(test, l, >, r, false)
+#define KUNIT_EXPECT_GE(test, l, r) MFQ_KUNIT_BINARY(test, l, >=, r, false)
+
+#define KUNIT_ASSERT_TRUE(test, cond) MFQ_KUNIT_CHECK(test, cond, true)
+#define KUNIT_ASSERT_NOT_ERR_OR_NULL(test, ptr) MFQ_KUNIT_CHECK(test, !IS_ERR_OR_NULL(ptr), true)
+#define KUNIT_ASSERT_EQ(test, l, r) MFQ_KUNIT_BINARY(test, l, ==, r, true)
+
+#endif
@@ -0,0 +1,822 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * kshim.c  Userspace implementation of the kernel helpers declared in
+ * include/kshim.h
+ */
+#include <stdarg.h>
+#include <time.h>
+
+#include "kshim.h"
+#include "marco_fq_user.h"
+
+#undef sprintf
+
+/* Logging */
+
+int mfq_printk(const char *fmt, ...)
+{
+    static int enabled = -1;
+    va_list ap;
+    int ret;
+
+    if (enabled < 0)
+        enabled = getenv("MARCO_FQ_PRINTK") != NULL;
+    if (!enabled)
+        return 0;
+    va_start(ap, fmt);
+    ret = vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* vsprintf() plus the %pI4 extension used for addresses */
+int mfq_sprintf(char *buf, const char *fmt, ...)
+{
+    char *out = buf;
+    const char *p;
+    va_list ap;
+
+    va_start(ap, fmt);
+    for (p = fmt; *p; p++)
+    {
+        const char *spec = p;
+        char f[32];
+        size_t n;
+
+        if (*p != '%')
+        {
+            *out++ = *p;
+            continue;
+        }
+        if (!strncmp(p, "%pI4", 4))
+        {
+            const u8 *a = va_arg(ap, const u8 *);
+
+            out += snprintf(out, 16, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
+            p += 3;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            *out++ = '%';
+            p++;
+            continue;
+        }
+        /* one conversion at a time : flags, width, length, then type */
+        p++;
+        while (*p && strchr("-+ #0123456789.", *p))
+            p++;
+        while (*p && strchr("hlzjt", *p))
+            p++;
+        n = p - spec + 1;
+        if (n >= sizeof(f))
+            break;
+        memcpy(f, spec, n);
+        f[n] = '\0';
+        switch (*p)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'c':
+            if (strstr(f, "ll") || strchr(f, 'z') || strchr(f, 'l'))
+                out += sprintf(out, f, va_arg(ap, unsigned long long));
+            else
+                out += sprintf(out, f, va_arg(ap, unsigned int));
+            break;
+        case 's':
+            out += sprintf(out, f, va_arg(ap, const char *));
+            break;
+        case 'p':
+            out += sprintf(out, f, va_arg(ap, void *));
+            break;
+        default:
+            goto out;
+        }
+    }
+out:
+    va_end(ap);
+    *out = '\0';
+    return out - buf;
+}
+
+/* Time */
+
+static u64 mfq_clock;
+static bool mfq_clock_virtual;
+
+u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    if (mfq_clock_virtual)
+        return mfq_clock;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void mfq_clock_set(u64 now)
+{
+    mfq_clock_virtual = true;
+    mfq_clock = now;
+}
+
+void mfq_clock_advance(u64 delta)
+{
+    mfq_clock_virtual = true;
+    mfq_clock += delta;
+}
+
+void mfq_clock_real(void)
+{
+    mfq_clock_virtual = false;
+}
+
+/* Sleeping on the virtual clock only moves it */
+void msleep(unsigned int msecs)
+{
+    struct timespec ts = {
+        .tv_sec = msecs / 1000,
+        .tv_nsec = (msecs % 1000) * NSEC_PER_MSEC,
+    };
+
+    if (mfq_clock_virtual)
+        mfq_clock += msecs * NSEC_PER_MSEC;
+    else
+        while (nanosleep(&ts, &ts) && errno == EINTR)
+            ;
+}
+
+/* Slab caches keep a free list, so that the allocator costs about what a
+ * kernel slab costs instead of a malloc() call
+ */
+
+struct kmem_cache
+{
+    unsigned int size;
+    void *free;
+    size_t nr_objs;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+                                     unsigned long flags, void (*ctor)(void *))
+{
+    struct kmem_cache *s = calloc(1, sizeof(*s));
+
+    if (!s)
+        return NULL;
+    s->size = max_t(unsigned int, size, sizeof(void *));
+    s->size = (s->size + 7) & ~7U;
+    return s;
+}
+
+void kmem_cache_destroy(struct kmem_cache *s)
+{
+    void *p;
+
+    if (!s)
+        return;
+    while ((p = s->free) != NULL)
+    {
+        s->free = *(void **)p;
+        free(p);
+    }
+    if (s->nr_objs)
+        fprintf(stderr, "kmem_cache_destroy: %zu objects still allocated\n", s->nr_objs);
+    free(s);
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *s, gfp_t flags)
+{
+    void *p = s->free;
+
+    if (p)
+        s->free = *(void **)p;
+    else
+        p = malloc(s->size);
+    if (!p)
+        return NULL;
+    s->nr_objs++;
+    return memset(p, 0, s->size);
+}
+
+void kmem_cache_free(struct kmem_cache *s, void *p)
+{
+    *(void **)p = s->free;
+    s->free = p;
+    s->nr_objs--;
+}
+
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t nr, void **p)
+{
+    size_t i;
+
+    for (i = 0; i < nr; i++)
+        kmem_cache_free(s, p[i]);
+}
+
+/* Red-black trees : the colour lives in bit 0 of the parent pointer, as in
+ * lib/rbtree.c
+ */
+
+#define RB_RED 0
+#define RB_BLACK 1
+#define rb_color(r) ((r)->__rb_parent_color & 1)
+#define rb_is_red(r) (!rb_color(r))
+#define rb_is_black(r) rb_color(r)
+
+static void rb_set_parent(struct rb_node *rb, struct rb_node *p)
+{
+    rb->__rb_parent_color = rb_color(rb) | (unsigned long)p;
+}
+
+static void rb_set_color(struct rb_node *rb, int color)
+{
+    rb->__rb_parent_color = (rb->__rb_parent_color & ~1UL) | color;
+}
+
+static void rb_change_child(struct rb_node *old, struct rb_node *new,
+                            struct rb_node *parent, struct rb_root *root)
+{
+    if (!parent)
+        root->rb_node = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *right = node->rb_right;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_right = right->rb_left;
+    if (right->rb_left)
+        rb_set_parent(right->rb_left, node);
+    right->rb_left = node;
+    rb_set_parent(right, parent);
+    rb_change_child(node, right, parent, root);
+    rb_set_parent(node, right);
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *left = node->rb_left;
+    struct rb_node *parent = rb_parent(node);
+
+    node->rb_left = left->rb_right;
+    if (left->rb_right)
+        rb_set_parent(left->rb_right, node);
+    left->rb_right = node;
+    rb_set_parent(left, parent);
+    rb_change_child(node, left, parent, root);
+    rb_set_parent(node, left);
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = rb_parent(node)) && rb_is_red(parent))
+    {
+        gparent = rb_parent(parent);
+        if (parent == gparent->rb_left)
+        {
+            uncle = gparent->rb_right;
+            if (uncle && rb_is_red(uncle))
+            {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (parent->rb_right == node)
+            {
+                rb_rotate_left(parent, root);
+                swap(parent, node);
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_right(gparent, root);
+        }
+        else
+        {
+            uncle = gparent->rb_left;
+            if (uncle && rb_is_red(uncle))
+            {
+                rb_set_color(uncle, RB_BLACK);
+                rb_set_color(parent, RB_BLACK);
+                rb_set_color(gparent, RB_RED);
+                node = gparent;
+                continue;
+            }
+            if (parent->rb_left == node)
+            {
+                rb_rotate_right(parent, root);
+                swap(parent, node);
+            }
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(gparent, RB_RED);
+            rb_rotate_left(gparent, root);
+        }
+    }
+    rb_set_color(root->rb_node, RB_BLACK);
+}
+
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+    struct rb_node *other;
+
+    while ((!node || rb_is_black(node)) && node != root->rb_node)
+    {
+        if (parent->rb_left == node)
+        {
+            other = parent->rb_right;
+            if (rb_is_red(other))
+            {
+                rb_set_color(other, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_left(parent, root);
+                other = parent->rb_right;
+            }
+            if ((!other->rb_left || rb_is_black(other->rb_left)) &&
+                (!other->rb_right || rb_is_black(other->rb_right)))
+            {
+                rb_set_color(other, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!other->rb_right || rb_is_black(other->rb_right))
+            {
+                rb_set_color(other->rb_left, RB_BLACK);
+                rb_set_color(other, RB_RED);
+                rb_rotate_right(other, root);
+                other = parent->rb_right;
+            }
+            rb_set_color(other, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(other->rb_right, RB_BLACK);
+            rb_rotate_left(parent, root);
+            node = root->rb_node;
+            break;
+        }
+        else
+        {
+            other = parent->rb_left;
+            if (rb_is_red(other))
+            {
+                rb_set_color(other, RB_BLACK);
+                rb_set_color(parent, RB_RED);
+                rb_rotate_right(parent, root);
+                other = parent->rb_left;
+            }
+            if ((!other->rb_left || rb_is_black(other->rb_left)) &&
+                (!other->rb_right || rb_is_black(other->rb_right)))
+            {
+                rb_set_color(other, RB_RED);
+                node = parent;
+                parent = rb_parent(node);
+                continue;
+            }
+            if (!other->rb_left || rb_is_black(other->rb_left))
+            {
+                rb_set_color(other->rb_right, RB_BLACK);
+                rb_set_color(other, RB_RED);
+                rb_rotate_left(other, root);
+                other = parent->rb_left;
+            }
+            rb_set_color(other, rb_color(parent));
+            rb_set_color(parent, RB_BLACK);
+            rb_set_color(other->rb_left, RB_BLACK);
+            rb_rotate_right(parent, root);
+            node = root->rb_node;
+            break;
+        }
+    }
+    if (node)
+        rb_set_color(node, RB_BLACK);
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent;
+    int color;
+
+    if (!node->rb_left)
+        child = node->rb_right;
+    else if (!node->rb_right)
+        child = node->rb_left;
+    else
+    {
+        struct rb_node *old = node, *left;
+
+        node = node->rb_right;
+        while ((left = node->rb_left) != NULL)
+            node = left;
+
+        rb_change_child(old, node, rb_parent(old), root);
+
+        child = node->rb_right;
+        parent = rb_parent(node);
+        color = rb_color(node);
+
+        if (parent == old)
+            parent = node;
+        else
+        {
+            if (child)
+                rb_set_parent(child, parent);
+            parent->rb_left = child;
+            node->rb_right = old->rb_right;
+            rb_set_parent(old->rb_right, node);
+        }
+
+        node->__rb_parent_color = old->__rb_parent_color;
+        node->rb_left = old->rb_left;
+        rb_set_parent(old->rb_left, node);
+        goto color;
+    }
+
+    parent = rb_parent(node);
+    color = rb_color(node);
+    if (child)
+        rb_set_parent(child, parent);
+    rb_change_child(node, child, parent, root);
+
+color:
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *n = root->rb_node;
+
+    if (!n)
+        return NULL;
+    while (n->rb_left)
+        n = n->rb_left;
+    return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->rb_right)
+    {
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+        return (struct rb_node *)node;
+    }
+    while ((parent = rb_parent(node)) && node == parent->rb_right)
+        node = parent;
+    return parent;
+}
+
+static struct rb_node *rb_left_deepest_node(const struct rb_node *node)
+{
+    for (;;)
+    {
+        if (node->rb_left)
+            node = node->rb_left;
+        else if (node->rb_right)
+            node = node->rb_right;
+        else
+            return (struct rb_node *)node;
+    }
+}
+
+struct rb_node *rb_first_postorder(const struct rb_root *root)
+{
+    if (!root->rb_node)
+        return NULL;
+    return rb_left_deepest_node(root->rb_node);
+}
+
+struct rb_node *rb_next_postorder(const struct rb_node *node)
+{
+    const struct rb_node *parent;
+
+    if (!node)
+        return NULL;
+    parent = rb_parent(node);
+    if (parent && node == parent->rb_left && parent->rb_right)
+        return rb_left_deepest_node(parent->rb_right);
+    return (struct rb_node *)parent;
+}
+
+/* Misc */
+
+void sort(void *base, size_t num, size_t size, int (*cmp)(const void *, const void *),
+          void (*swap_fn)(void *, void *, int))
+{
+    qsort(base, num, size, cmp);
+}
+
+int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(s, &end, base);
+    if (errno || end == s || (*end && *end != '\n') || v > U32_MAX)
+        return -EINVAL;
+    *res = v;
+    return 0;
+}
+
+int nla_parse_nested_deprecated(struct nlattr **tb, int maxtype, const struct nlattr *nla,
+                                const struct nla_policy *policy, struct netlink_ext_ack *extack)
+{
+    const struct nlattr *a = nla_data(nla);
+    int rem = nla_len(nla);
+
+    memset(tb, 0, sizeof(*tb) * (maxtype + 1));
+    while (rem >= (int)sizeof(*a) && a->nla_len >= sizeof(*a) && a->nla_len <= rem)
+    {
+        u16 type = a->nla_type & NLA_TYPE_MASK;
+
+        if (type <= maxtype)
+        {
+            int len = nla_len(a);
+
+            if ((policy[type].type == NLA_U32 && len < 4) ||
+                (policy[type].type == NLA_U8 && len < 1))
+            {
+                NL_SET_ERR_MSG_MOD(extack, "Attribute too short");
+                return -ERANGE;
+            }
+            tb[type] = (struct nlattr *)a;
+        }
+        rem -= NLA_ALIGN(a->nla_len);
+        a = (const void *)((const char *)a + NLA_ALIGN(a->nla_len));
+    }
+    return 0;
+}
+
+/* The dump callbacks write to an sk_buff used as a flat attribute buffer */
+
+int nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data)
+{
+    struct nlattr *nla = (struct nlattr *)skb->tail;
+    unsigned int total = NLA_ALIGN(NLA_HDRLEN + attrlen);
+
+    if (skb->tail + total > skb->end)
+        return -EMSGSIZE;
+    nla->nla_type = attrtype;
+    nla->nla_len = NLA_HDRLEN + attrlen;
+    if (attrlen)
+        memcpy(nla_data(nla), data, attrlen);
+    skb->tail += total;
+    return 0;
+}
+
+struct nlattr *nla_nest_start_noflag(struct sk_buff *skb, int attrtype)
+{
+    struct nlattr *start = (struct nlattr *)skb->tail;
+
+    if (nla_put(skb, attrtype, 0, NULL))
+        return NULL;
+    return start;
+}
+
+int nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+    start->nla_len = skb->tail - (unsigned char *)start;
+    return skb->tail - skb->head;
+}
+
+int gnet_stats_copy_app(struct gnet_dump *d, void *st, int len)
+{
+    if (len > d->app_len)
+        return -EMSGSIZE;
+    memcpy(d->app, st, len);
+    d->app_len = len;
+    return 0;
+}
+
+int gnet_stats_copy_queue(struct gnet_dump *d, void *cpu_q, struct gnet_stats_queue *q, u32 qlen)
+{
+    d->qstats = *q;
+    d->qstats.qlen = qlen;
+    return 0;
+}
+
+/* Packets */
+
+static struct sk_buff *mfq_skb_cache;
+
+struct sk_buff *alloc_skb(unsigned int size, gfp_t priority)
+{
+    struct sk_buff *skb = mfq_skb_cache;
+
+    if (size > MFQ_SKB_ROOM)
+        return NULL;
+    if (skb)
+        mfq_skb_cache = skb->next;
+    else
+        skb = malloc(sizeof(*skb) + MFQ_SKB_ROOM);
+    if (!skb)
+        return NULL;
+    memset(skb, 0, sizeof(*skb) + size);
+
+    skb->head = (unsigned char *)(skb + 1);
+    skb->data = skb->head;
+    skb->tail = skb->head;
+    skb->end = skb->head + size;
+    skb->mac_header = (u16)~0U;
+    return skb;
+}
+
+void mfq_skb_free(struct sk_buff *skb)
+{
+    skb->next = mfq_skb_cache;
+    mfq_skb_cache = skb;
+}
+
+void mfq_skb_cache_drain(void)
+{
+    struct sk_buff *skb;
+
+    while ((skb = mfq_skb_cache) != NULL)
+    {
+        mfq_skb_cache = skb->next;
+        free(skb);
+    }
+}
+
+u32 skb_get_hash(struct sk_buff *skb)
+{
+    return skb->hash;
+}
+
+void kfree_skb(struct sk_buff *skb)
+{
+    if (!skb)
+        return;
+    if (skb->destructor)
+        skb->destructor(skb);
+    mfq_skb_free(skb);
+}
+
+void kfree_skb_list(struct sk_buff *segs)
+{
+    struct sk_buff *next;
+
+    while (segs)
+    {
+        next = segs->next;
+        kfree_skb(segs);
+        segs = next;
+    }
+}
+
+/* Devices : one tx queue, never registered */
+
+struct net_device *alloc_netdev(int sizeof_priv, const char *name, unsigned char name_assign_type,
+                                void (*setup)(struct net_device *))
+{
+    struct net_device *dev = calloc(1, sizeof(*dev) + sizeof_priv);
+
+    if (!dev)
+        return NULL;
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    dev->_tx.dev = dev;
+    setup(dev);
+    return dev;
+}
+
+void ether_setup(struct net_device *dev)
+{
+    dev->mtu = ETH_DATA_LEN;
+    dev->hard_header_len = ETH_HLEN;
+}
+
+void free_netdev(struct net_device *dev)
+{
+    free(dev);
+}
+
+/* Qdisc plumbing */
+
+struct Qdisc noop_qdisc;
+
+struct Qdisc *qdisc_create_dflt(struct netdev_queue *dev_queue, const struct Qdisc_ops *ops,
+                                unsigned int parentid, struct netlink_ext_ack *extack)
+{
+    struct Qdisc *sch = calloc(1, QDISC_ALIGN(sizeof(*sch)) + ops->priv_size);
+
+    if (!sch)
+        return NULL;
+    sch->ops = ops;
+    sch->parent = parentid;
+    sch->dev_queue = dev_queue;
+    refcount_set(&sch->refcnt, 1);
+    if (ops->init && ops->init(sch, NULL, extack))
+    {
+        qdisc_put(sch);
+        return NULL;
+    }
+    return sch;
+}
+
+void qdisc_reset(struct Qdisc *sch)
+{
+    if (sch->ops->reset)
+        sch->ops->reset(sch);
+    __skb_queue_purge(&sch->gso_skb);
+    __skb_queue_purge(&sch->skb_bad_txq);
+    sch->q.qlen = 0;
+    sch->qstats.backlog = 0;
+}
+
+void qdisc_put(struct Qdisc *sch)
+{
+    if (!refcount_dec_and_test(&sch->refcnt))
+        return;
+    qdisc_reset(sch);
+    if (sch->ops->destroy)
+        sch->ops->destroy(sch);
+    free(sch);
+}
+
+struct sk_buff *qdisc_peek_dequeued(struct Qdisc *sch)
+{
+    struct sk_buff *skb = skb_peek(&sch->gso_skb);
+
+    if (!skb)
+    {
+        skb = sch->ops->dequeue(sch);
+        if (skb)
+        {
+            __skb_queue_head(&sch->gso_skb, skb);
+            sch->q.qlen++;
+            sch->qstats.backlog += qdisc_pkt_len(skb);
+        }
+    }
+    return skb;
+}
+
+void qdisc_watchdog_init_clockid(struct qdisc_watchdog *wd, struct Qdisc *qdisc, int clockid)
+{
+    wd->qdisc = qdisc;
+    wd->last_expires = 0;
+}
+
+void qdisc_watchdog_schedule_range_ns(struct qdisc_watchdog *wd, u64 expires, u64 delta_ns)
+{
+    wd->last_expires = expires;
+}
+
+void qdisc_watchdog_cancel(struct qdisc_watchdog *wd)
+{
+    wd->last_expires = 0;
+}
+
+int register_qdisc(struct Qdisc_ops *qops)
+{
+    return 0;
+}
+
+int unregister_qdisc(struct Qdisc_ops *qops)
+{
+    return 0;
+}
+
+/* include/linux/jhash.h */
+
+#define rol32(w, s) (((w) << (s)) | ((w) >> (32 - (s))))
+#define JHASH_INITVAL 0xdeadbeef
+
+u32 jhash_1word(u32 a, u32 initval)
+{
+    u32 b, c;
+
+    initval += JHASH_INITVAL + (1 << 2);
+    a += initval;
+    b = c = initval;
+
+    c ^= b;
+    c -= rol32(b, 14);
+    a ^= c;
+    a -= rol32(c, 11);
+    b ^= a;
+    b -= rol32(a, 25);
+    c ^= b;
+    c -= rol32(b, 16);
+    a ^= c;
+    a -= rol32(c, 4);
+    b ^= a;
+    b -= rol32(a, 14);
+    c ^= b;
+    c -= rol32(b, 24);
+    return c;
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * kunit.c  Runs the suite of ../marco_fq_kunit.c in userspace, and prints
+ * its results in the KTAP format of the kernel.
+ *
+ * Usage: kunit_marco_fq
+ *   Exits with the number of failed test cases.
+ */
+#include <kunit/test.h>
+
+void mfq_kunit_fail(struct kunit *test, const char *file, int line, const char *cond,
+                    bool assert)
+{
+    printf("    # %s: %s at %s:%d\n", test->name, assert ? "ASSERTION FAILED" : "EXPECTATION FAILED",
+           file, line);
+    printf("    Expected %s\n", cond);
+    test->failed = true;
+    if (assert)
+        longjmp(test->abort, 1);
+}
+
+static bool mfq_kunit_run(const struct kunit_suite *suite, const struct kunit_case *c)
+{
+    struct kunit test = {.name = c->name};
+    int err;
+
+    if (suite->init)
+    {
+        err = suite->init(&test);
+        if (err)
+        {
+            printf("    # %s: init failed: %d\n", c->name, err);
+            return false;
+        }
+    }
+    if (!setjmp(test.abort))
+        c->run_case(&test);
+    if (suite->exit)
+        suite->exit(&test);
+    return !test.failed;
+}
+
+int main(void)
+{
+    const struct kunit_suite *suite = mfq_kunit_suite;
+    const struct kunit_case *c;
+    int n = 0, failed = 0;
+
+    for (c = suite->test_cases; c->run_case; c++)
+        n++;
+
+    printf("TAP version 14\n1..1\n");
+    printf("    # Subtest: %s\n    1..%d\n", suite->name, n);
+    for (n = 1, c = suite->test_cases; c->run_case; c++, n++)
+    {
+        bool ok = mfq_kunit_run(suite, c);
+
+        printf("    %s %d - %s\n", ok ? "ok" : "not ok", n, c->name);
+        failed += !ok;
+        fflush(stdout);
+    }
+    printf("%s 1 - %s\n", failed ? "not ok" : "ok", suite->name);
+
+    mfq_skb_cache_drain();
+    return failed;
+}
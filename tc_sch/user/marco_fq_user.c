@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * marco_fq_user.c  The library side of marco_fq_user.h : the module is
+ * included as is, and driven the way net/sched/sch_api.c and
+ * net/sched/sch_generic.c drive a qdisc.
+ */
+#include "../marco_fq.c"
+
+#include "marco_fq_user.h"
+
+/* Options */
+
+void mfq_opts_init(struct mfq_opts *o)
+{
+    struct nlattr *nest = (struct nlattr *)o->buf;
+
+    nest->nla_type = TCA_OPTIONS;
+    nest->nla_len = NLA_HDRLEN;
+    o->len = NLA_HDRLEN;
+}
+
+static void mfq_opts_put(struct mfq_opts *o, int type, const void *data, int len)
+{
+    struct nlattr *nest = (struct nlattr *)o->buf;
+    struct nlattr *nla = (struct nlattr *)(o->buf + o->len);
+    unsigned int total = NLA_ALIGN(NLA_HDRLEN + len);
+
+    if (o->len + total > sizeof(o->buf))
+        abort();
+    memset(nla, 0, total);
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(nla_data(nla), data, len);
+    o->len += total;
+    nest->nla_len = o->len;
+}
+
+void mfq_opts_u32(struct mfq_opts *o, int type, u32 val)
+{
+    mfq_opts_put(o, type, &val, sizeof(val));
+}
+
+void mfq_opts_u8(struct mfq_opts *o, int type, u8 val)
+{
+    mfq_opts_put(o, type, &val, sizeof(val));
+}
+
+/* Module */
+
+int mfq_lib_init(void)
+{
+    return mfq_module_init();
+}
+
+void mfq_lib_exit(void)
+{
+    mfq_module_exit();
+    mfq_skb_cache_drain();
+}
+
+void mfq_pairs_clear(void)
+{
+    clear_ip_count_table();
+}
+
+/* Qdiscs : each one has its own device and tx queue */
+
+int mfq_create(struct Qdisc **schp, unsigned int mtu, const struct mfq_opts *o)
+{
+    const struct Qdisc_ops *ops = &fq_qdisc_ops;
+    struct netlink_ext_ack extack = {};
+    struct net_device *dev;
+    struct Qdisc *sch;
+    int err;
+
+    dev = alloc_netdev(0, "mfq", NET_NAME_UNKNOWN, ether_setup);
+    sch = calloc(1, QDISC_ALIGN(sizeof(*sch)) + ops->priv_size);
+    if (!dev || !sch)
+    {
+        free(dev);
+        free(sch);
+        return -ENOMEM;
+    }
+    dev->mtu = mtu;
+
+    sch->ops = ops;
+    sch->handle = 0x80010000;
+    sch->parent = TC_H_ROOT;
+    sch->dev_queue = netdev_get_tx_queue(dev, 0);
+    refcount_set(&sch->refcnt, 1);
+
+    err = ops->init(sch, o ? (struct nlattr *)o->buf : NULL, &extack);
+    if (err)
+    {
+        if (extack.msg)
+            mfq_printk("marco_fq: %s\n", extack.msg);
+        ops->destroy(sch);
+        free(sch);
+        free_netdev(dev);
+        return err;
+    }
+    sch->dev_queue->qdisc = sch->dev_queue->qdisc_sleeping = sch;
+    *schp = sch;
+    return 0;
+}
+
+int mfq_change(struct Qdisc *sch, const struct mfq_opts *o)
+{
+    struct netlink_ext_ack extack = {};
+    int err;
+
+    err = sch->ops->change(sch, (struct nlattr *)o->buf, &extack);
+    if (err && extack.msg)
+        mfq_printk("marco_fq: %s\n", extack.msg);
+    return err;
+}
+
+void mfq_reset(struct Qdisc *sch)
+{
+    qdisc_reset(sch);
+}
+
+void mfq_destroy(struct Qdisc *sch)
+{
+    struct net_device *dev = qdisc_dev(sch);
+
+    qdisc_put(sch);
+    free_netdev(dev);
+}
+
+int mfq_enqueue(struct Qdisc *sch, struct sk_buff *skb)
+{
+    struct sk_buff *to_free = NULL;
+    int ret;
+
+    qdisc_skb_cb(skb)->pkt_len = skb->len;
+    ret = sch->ops->enqueue(skb, sch, &to_free);
+    kfree_skb_list(to_free);
+    return ret;
+}
+
+struct sk_buff *mfq_dequeue(struct Qdisc *sch)
+{
+    struct sk_buff *skb = __skb_dequeue(&sch->gso_skb);
+
+    if (skb)
+    {
+        sch->q.qlen--;
+        sch->qstats.backlog -= qdisc_pkt_len(skb);
+        return skb;
+    }
+    return sch->ops->dequeue(sch);
+}
+
+u32 mfq_qlen(const struct Qdisc *sch)
+{
+    return sch->q.qlen;
+}
+
+u32 mfq_backlog(const struct Qdisc *sch)
+{
+    return sch->qstats.backlog;
+}
+
+u32 mfq_drops(const struct Qdisc *sch)
+{
+    return sch->qstats.drops;
+}
+
+u64 mfq_watchdog_expires(const struct Qdisc *sch)
+{
+    const struct marco_fq_sched_data *q = qdisc_priv((struct Qdisc *)sch);
+
+    return q->watchdog.last_expires;
+}
+
+int mfq_stats(struct Qdisc *sch, struct tc_marco_fq_qd_stats *st)
+{
+    struct gnet_dump d = {.app = st, .app_len = sizeof(*st)};
+
+    return sch->ops->dump_stats(sch, &d);
+}
+
+/* Packets : headers are built in the skb, the payload is only counted */
+
+#define MFQ_SKB_HEADROOM (128 + NET_IP_ALIGN)
+#define MFQ_SKB_HEADERS (ETH_HLEN + sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+struct sk_buff *mfq_skb_alloc(const struct mfq_pkt *p)
+{
+    struct sk_buff *skb = alloc_skb(MFQ_SKB_HEADROOM + MFQ_SKB_HEADERS, GFP_ATOMIC);
+    struct ethhdr *eth;
+    struct iphdr *iph;
+
+    if (!skb)
+        return NULL;
+    skb_reserve(skb, MFQ_SKB_HEADROOM);
+    skb_reset_mac_header(skb);
+    skb_set_network_header(skb, ETH_HLEN);
+    skb_put_zero(skb, MFQ_SKB_HEADERS);
+    skb->len = max_t(unsigned int, p->len, MFQ_SKB_HEADERS);
+    skb->data_len = skb->len - MFQ_SKB_HEADERS;
+    skb->protocol = htons(ETH_P_IP);
+    skb->hash = p->hash;
+    skb->tstamp = p->tstamp;
+    skb->priority = p->priority;
+    skb->sk = p->sk;
+
+    eth = (struct ethhdr *)skb->data;
+    eth->h_proto = htons(ETH_P_IP);
+
+    iph = ip_hdr(skb);
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->tos = p->tos;
+    iph->tot_len = htons(min_t(unsigned int, skb->len - ETH_HLEN, 0xffff));
+    iph->ttl = 64;
+    iph->protocol = p->protocol;
+    iph->saddr = p->saddr;
+    iph->daddr = p->daddr;
+    ip_send_check(iph);
+    return skb;
+}
+
+u32 mfq_skb_len(const struct sk_buff *skb)
+{
+    return skb->len;
+}
+
+u32 mfq_skb_hash(const struct sk_buff *skb)
+{
+    return skb->hash;
+}
+
+u64 mfq_skb_tstamp(const struct sk_buff *skb)
+{
+    return skb->tstamp;
+}
+
+struct sock *mfq_skb_sk(const struct sk_buff *skb)
+{
+    return skb->sk;
+}
+
+struct sock *mfq_sock_alloc(u8 protocol, u32 hash, unsigned long pacing_rate)
+{
+    struct tcp_sock *tp = calloc(1, sizeof(*tp));
+
+    if (!tp)
+        return NULL;
+    tp->sk.sk_state = protocol == IPPROTO_TCP ? TCP_ESTABLISHED : TCP_CLOSE;
+    tp->sk.sk_protocol = protocol;
+    tp->sk.sk_hash = hash;
+    tp->sk.sk_pacing_rate = pacing_rate;
+    tp->sk.sk_max_pacing_rate = ~0UL;
+    return &tp->sk;
+}
+
+void mfq_sock_free(struct sock *sk)
+{
+    free(tcp_sk(sk));
+}
+
+u64 mfq_clock_now(void)
+{
+    return ktime_get_ns();
+}
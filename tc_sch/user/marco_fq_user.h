@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * marco_fq_user.h  The marco_fq scheduling core as a userspace library.
+ *
+ * libmarco_fq.a is tc_sch/marco_fq.c compiled against the shims of
+ * include/kshim.h. A qdisc is created, fed and drained like the kernel
+ * does, on a single thread : packets are sk_buff shells carrying an
+ * ethernet and an IP header, the rest of the payload is only a length.
+ *
+ * The clock is CLOCK_MONOTONIC, or a virtual clock once mfq_clock_set()
+ * or mfq_clock_advance() is called. The watchdog never fires by itself :
+ * mfq_watchdog_expires() tells when the qdisc wants to be dequeued again.
+ */
+#ifndef _MARCO_FQ_USER_H
+#define _MARCO_FQ_USER_H
+
+#include <linux/types.h>
+#include <linux/pkt_sched.h>
+
+#include "../marco_fq.h"
+
+struct Qdisc;
+struct sk_buff;
+struct sock;
+
+/* Options, in the netlink format of "tc qdisc ... marco_fq" */
+struct mfq_opts
+{
+    unsigned int len;
+    unsigned char buf[1024];
+};
+
+void mfq_opts_init(struct mfq_opts *o);
+void mfq_opts_u32(struct mfq_opts *o, int type, __u32 val);
+void mfq_opts_u8(struct mfq_opts *o, int type, __u8 val);
+
+/* Runs the module init and exit functions */
+int mfq_lib_init(void);
+void mfq_lib_exit(void);
+
+/* o may be NULL for the defaults, errors are negative errnos */
+int mfq_create(struct Qdisc **schp, unsigned int mtu, const struct mfq_opts *o);
+int mfq_change(struct Qdisc *sch, const struct mfq_opts *o);
+void mfq_reset(struct Qdisc *sch);
+void mfq_destroy(struct Qdisc *sch);
+
+/* The skb belongs to the qdisc : dropped packets are freed */
+int mfq_enqueue(struct Qdisc *sch, struct sk_buff *skb);
+struct sk_buff *mfq_dequeue(struct Qdisc *sch);
+__u32 mfq_qlen(const struct Qdisc *sch);
+__u32 mfq_backlog(const struct Qdisc *sch);
+__u32 mfq_drops(const struct Qdisc *sch);
+__u64 mfq_watchdog_expires(const struct Qdisc *sch);
+int mfq_stats(struct Qdisc *sch, struct tc_marco_fq_qd_stats *st);
+
+struct mfq_pkt
+{
+    __be32 saddr;
+    __be32 daddr;
+    __u8 protocol;      /* IPPROTO_*, carried in the IP header */
+    __u8 tos;
+    unsigned int len;   /* bytes on the wire, headers included */
+    __u32 hash;         /* skb_get_hash() */
+    __u64 tstamp;       /* EDT, 0 for none */
+    __u32 priority;
+    struct sock *sk;
+};
+
+struct sk_buff *mfq_skb_alloc(const struct mfq_pkt *p);
+void mfq_skb_free(struct sk_buff *skb);
+__u32 mfq_skb_len(const struct sk_buff *skb);
+__u32 mfq_skb_hash(const struct sk_buff *skb);
+__u64 mfq_skb_tstamp(const struct sk_buff *skb);
+struct sock *mfq_skb_sk(const struct sk_buff *skb);
+
+/* A full TCP or UDP socket, pacing_rate in bytes per second, ~0UL for none */
+struct sock *mfq_sock_alloc(__u8 protocol, __u32 hash, unsigned long pacing_rate);
+void mfq_sock_free(struct sock *sk);
+
+void mfq_clock_set(__u64 now);
+void mfq_clock_advance(__u64 delta);
+void mfq_clock_real(void);
+__u64 mfq_clock_now(void);
+
+/* Empties the source/destination pair table shared by all qdiscs */
+void mfq_pairs_clear(void);
+
+#endif
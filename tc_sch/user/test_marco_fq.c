@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * test_marco_fq.c  Checks of the scheduling core against libmarco_fq.a
+ *
+ * Usage: test_marco_fq
+ *   Runs every test on the virtual clock, prints one line per test and
+ *   exits with the number of failed tests.
+ */
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "marco_fq_user.h"
+
+#define MTU 1500
+#define ADDR(a, b, c, d) htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+static int failed;
+
+#define CHECK(cond)                                                        \
+    do                                                                     \
+    {                                                                      \
+        if (!(cond))                                                       \
+        {                                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            return -1;                                                     \
+        }                                                                  \
+    } while (0)
+
+static struct sk_buff *pkt(__be32 saddr, __u32 hash, unsigned int len,
+                           struct sock *sk, __u64 tstamp)
+{
+    struct mfq_pkt p = {
+        .saddr = saddr,
+        .daddr = ADDR(10, 0, 2, 5),
+        .protocol = IPPROTO_UDP,
+        .len = len,
+        .hash = hash,
+        .tstamp = tstamp,
+        .sk = sk,
+    };
+
+    return mfq_skb_alloc(&p);
+}
+
+static void drain(struct Qdisc *sch)
+{
+    struct sk_buff *skb;
+
+    while ((skb = mfq_dequeue(sch)) != NULL)
+        mfq_skb_free(skb);
+}
+
+/* Two backlogged flows with a quantum of one packet alternate */
+static int test_drr(void)
+{
+    struct mfq_opts o;
+    struct Qdisc *sch;
+    int i;
+
+    mfq_opts_init(&o);
+    mfq_opts_u32(&o, TCA_FQ_QUANTUM, 1000);
+    mfq_opts_u32(&o, TCA_FQ_INITIAL_QUANTUM, 1000);
+    CHECK(mfq_create(&sch, MTU, &o) == 0);
+
+    for (i = 0; i < 4; i++)
+        CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), 1, 1000, NULL, 0)) == 0);
+    for (i = 0; i < 4; i++)
+        CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 2), 2, 1000, NULL, 0)) == 0);
+    CHECK(mfq_qlen(sch) == 8);
+    CHECK(mfq_backlog(sch) == 8000);
+
+    for (i = 0; i < 8; i++)
+    {
+        struct sk_buff *skb = mfq_dequeue(sch);
+
+        CHECK(skb);
+        CHECK(mfq_skb_hash(skb) == (__u32)(i % 2 + 1));
+        mfq_skb_free(skb);
+    }
+    CHECK(!mfq_dequeue(sch));
+    CHECK(mfq_qlen(sch) == 0 && mfq_backlog(sch) == 0);
+    mfq_destroy(sch);
+    return 0;
+}
+
+/* A socket paced at 1 MB/s sends 20 packets of 1000 bytes in ~20 ms */
+static int test_pacing(void)
+{
+    struct sock *sk = mfq_sock_alloc(IPPROTO_UDP, 7, 1000000);
+    __u64 start = mfq_clock_now();
+    struct Qdisc *sch;
+    int i, sent = 0, waits = 0;
+
+    CHECK(sk);
+    CHECK(mfq_create(&sch, MTU, NULL) == 0);
+    for (i = 0; i < 20; i++)
+        CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), 7, 1000, sk, 0)) == 0);
+
+    while (mfq_qlen(sch))
+    {
+        struct sk_buff *skb = mfq_dequeue(sch);
+
+        if (skb)
+        {
+            mfq_skb_free(skb);
+            sent++;
+            continue;
+        }
+        CHECK(mfq_watchdog_expires(sch) > mfq_clock_now());
+        mfq_clock_set(mfq_watchdog_expires(sch));
+        waits++;
+    }
+    CHECK(sent == 20);
+    CHECK(waits > 0);
+    /* the initial quantum leaves at once */
+    CHECK(mfq_clock_now() - start >= 5000000);
+    CHECK(mfq_clock_now() - start <= 21000000);
+    mfq_destroy(sch);
+    mfq_sock_free(sk);
+    return 0;
+}
+
+static int test_flow_limit(void)
+{
+    struct mfq_opts o;
+    struct Qdisc *sch;
+    int i, drops = 0;
+
+    mfq_opts_init(&o);
+    mfq_opts_u32(&o, TCA_FQ_FLOW_PLIMIT, 5);
+    CHECK(mfq_create(&sch, MTU, &o) == 0);
+    for (i = 0; i < 8; i++)
+        drops += mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), 1, 1000, NULL, 0)) != 0;
+    CHECK(drops == 3);
+    CHECK(mfq_qlen(sch) == 5);
+    CHECK(mfq_drops(sch) == 3);
+    mfq_destroy(sch);
+    return 0;
+}
+
+/* Packets beyond the horizon are dropped, or capped with horizon_drop 0 */
+static int test_horizon(void)
+{
+    __u64 far = mfq_clock_now() + 20ULL * 1000000000;
+    struct sk_buff *skb;
+    struct mfq_opts o;
+    struct Qdisc *sch;
+
+    CHECK(mfq_create(&sch, MTU, NULL) == 0);
+    CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), 1, 1000, NULL, far)) != 0);
+    CHECK(mfq_qlen(sch) == 0);
+
+    mfq_opts_init(&o);
+    mfq_opts_u8(&o, TCA_FQ_HORIZON_DROP, 0);
+    CHECK(mfq_change(sch, &o) == 0);
+    CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), 1, 1000, NULL, far)) == 0);
+    CHECK(mfq_qlen(sch) == 1);
+    CHECK(!mfq_dequeue(sch));
+    mfq_clock_set(mfq_watchdog_expires(sch));
+    skb = mfq_dequeue(sch);
+    CHECK(skb);
+    CHECK(mfq_skb_tstamp(skb) < far);
+    mfq_skb_free(skb);
+    mfq_destroy(sch);
+    return 0;
+}
+
+/* Lowering the limit with limit_trim keeps a max-min fair share */
+static int test_limit_trim(void)
+{
+    static const int backlog[] = {50, 30, 20};
+    struct tc_marco_fq_qd_stats st;
+    struct mfq_opts o;
+    struct Qdisc *sch;
+    int f, i;
+
+    mfq_opts_init(&o);
+    mfq_opts_u32(&o, TCA_FQ_PLIMIT, 200);
+    mfq_opts_u32(&o, TCA_FQ_FLOW_PLIMIT, 100);
+    CHECK(mfq_create(&sch, MTU, &o) == 0);
+    for (f = 0; f < 3; f++)
+        for (i = 0; i < backlog[f]; i++)
+            CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1 + f), 1 + f, 100, NULL, 0)) == 0);
+
+    mfq_opts_init(&o);
+    mfq_opts_u32(&o, TCA_FQ_PLIMIT, 60);
+    mfq_opts_u8(&o, TCA_MARCO_FQ_LIMIT_TRIM, 1);
+    CHECK(mfq_change(sch, &o) == 0);
+    CHECK(mfq_qlen(sch) == 60);
+    CHECK(mfq_backlog(sch) == 6000);
+    CHECK(mfq_stats(sch, &st) == 0);
+    CHECK(st.flows == 3);
+
+    drain(sch);
+    CHECK(mfq_qlen(sch) == 0);
+    mfq_destroy(sch);
+    return 0;
+}
+
+/* Reset empties the qdisc, which keeps working with a fresh table */
+static int test_reset(void)
+{
+    struct tc_marco_fq_qd_stats st;
+    struct Qdisc *sch;
+    int i;
+
+    CHECK(mfq_create(&sch, MTU, NULL) == 0);
+    for (i = 0; i < 1000; i++)
+        CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), i, 1000, NULL, 0)) == 0);
+    CHECK(mfq_stats(sch, &st) == 0);
+    CHECK(st.flows == 1000);
+
+    mfq_reset(sch);
+    CHECK(mfq_qlen(sch) == 0 && mfq_backlog(sch) == 0);
+    CHECK(mfq_stats(sch, &st) == 0);
+    CHECK(st.flows == 0);
+
+    for (i = 0; i < 10; i++)
+        CHECK(mfq_enqueue(sch, pkt(ADDR(10, 0, 1, 1), i, 1000, NULL, 0)) == 0);
+    drain(sch);
+    CHECK(mfq_qlen(sch) == 0);
+    mfq_destroy(sch);
+    return 0;
+}
+
+static const struct
+{
+    const char *name;
+    int (*fn)(void);
+} tests[] = {
+    {"drr", test_drr},
+    {"pacing", test_pacing},
+    {"flow_limit", test_flow_limit},
+    {"horizon", test_horizon},
+    {"limit_trim", test_limit_trim},
+    {"reset", test_reset},
+};
+
+int main(void)
+{
+    unsigned int i;
+
+    if (mfq_lib_init())
+    {
+        fprintf(stderr, "mfq_lib_init failed\n");
+        return 1;
+    }
+    mfq_clock_set(1000000000);
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        int err = tests[i].fn();
+
+        printf("%-12s %s\n", tests[i].name, err ? "FAIL" : "ok");
+        failed += !!err;
+        mfq_pairs_clear();
+    }
+
+    mfq_lib_exit();
+    return failed;
+}
@@ -0,0 +1,228 @@
+#!/bin/bash
+# Runs the same request/response workloads through marco_fq and the stock
+# qdiscs on the router of netns.sh, writes a report and checks it against
+# budgets.
+#
+# Usage: compare.sh [WORKLOAD...]    all of them by default
+#
+# Workloads, each DURATION seconds, loadgen in mfq_snd against echo_server
+# in mfq_rcv :
+#   incast         200 clients ask for 1000 bytes at the same time, 100
+#                  times a second : bursts of answers on the bottleneck
+#   rpc            RPC fan-in : 1000 clients from 8 addresses, 20000
+#                  requests a second in a poisson process
+#   elephant_mice  2 bulk clients keep 32 requests of 8000 bytes in flight
+#                  each, mice send 2000 small requests a second; the RTT
+#                  and losses are those of the mice
+#   sender         sender.py : 9999 clients send at once, once a second
+#
+# For each workload and qdisc the report (REPORT) gives throughput, RTT
+# p50/p99/p999, losses, router qdisc drops and host CPU time per packet;
+# CSV has the same rows. Budgets (BUDGETS, see compare/budgets.conf) bound
+# a metric, absolutely or relative to another qdisc of the same run : the
+# script exits with 1 if one is exceeded.
+#
+# Environment :
+#   QDISCS     qdiscs compared               "marco_fq fq fq_codel pfifo_fast"
+#   OPTS_<qdisc>  options of one qdisc, e.g. OPTS_marco_fq="limit 1000"
+#   RATE       bottleneck of each router interface (tbf)          100mbit
+#   DELAY      netem delay at the sender and the receiver, see netns.sh
+#   DURATION   seconds a workload lasts                               10
+#   REPORT     markdown report                                compare.md
+#   CSV        results                                       compare.csv
+#   OUT_DIR    loadgen and echo_server output of each run     compare.out
+#   BUDGETS    budgets                          compare/budgets.conf
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+SND=mfq_snd
+RCV=mfq_rcv
+RTR=mfq_rtr
+
+if [ "$(id -u)" != 0 ]; then
+	exec sudo -E "$0" "$@"
+fi
+
+QDISCS=${QDISCS:-marco_fq fq fq_codel pfifo_fast}
+export RATE=${RATE-100mbit}
+DURATION=${DURATION:-10}
+REPORT=${REPORT:-compare.md}
+CSV=${CSV:-compare.csv}
+OUT_DIR=${OUT_DIR:-compare.out}
+BUDGETS=${BUDGETS:-$DIR/compare/budgets.conf}
+WORKLOADS=${*:-incast rpc elephant_mice sender}
+
+# 9999 sockets for the sender workload
+ulimit -n 20000
+
+loadgen() {
+	ip netns exec $SND "$DIR/loadgen" -w 1 -d "$DURATION" "$@" >>"$out.loadgen"
+}
+
+incast() {
+	loadgen -c 200 -m incast -r 20000 -l 64 -L 1000 -T 200 -O "$out.csv"
+}
+
+rpc() {
+	loadgen -c 1000 -m poisson -r 20000 -l 200 -L 200 -t 2 -O "$out.csv" \
+		-B 10.0.1.2,10.0.1.3,10.0.1.4,10.0.1.5,10.0.1.6,10.0.1.7,10.0.1.8,10.0.1.9
+}
+
+elephant_mice() {
+	local bulk
+	loadgen -c 2 -o 32 -l 64 -L 8000 -O "$out.bulk.csv" &
+	bulk=$!
+	loadgen -c 50 -m poisson -r 2000 -l 64 -L 64 -O "$out.csv"
+	wait $bulk
+}
+
+sender() {
+	loadgen -c 9999 -m incast -r 9999 -l 48 -L 48 -t 4 -O "$out.csv"
+}
+
+# Drops of the qdisc under test (handle 10:) on the router
+drops() {
+	local dev
+	for dev in rtr0 rtr1 ifb0; do
+		ip netns exec $RTR tc -s qdisc show dev $dev
+	done | awk '
+		/^qdisc/ { mine = $3 == "10:" }
+		mine && /^ Sent/ {
+			gsub(/[(),]/, " ")
+			drops += $7
+		}
+		END { print drops + 0 }'
+}
+
+# Busy jiffies of the host, from /proc/stat
+cpu() {
+	awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 }' /proc/stat
+}
+
+# $1 workload, $2 qdisc : one CSV line
+run() {
+	local w=$1 q=$2 server d0 d1 c0 c1
+	out=$OUT_DIR/$w-$q
+	rm -f "$out".*
+
+	ip netns exec $RCV "$DIR/echo_server" >"$out.server" 2>&1 &
+	server=$!
+	sleep 0.5
+	d0=$(drops)
+	c0=$(cpu)
+	$w
+	c1=$(cpu)
+	d1=$(drops)
+	kill $server
+	wait $server || true
+
+	# loadgen CSV : ...,req_len,resp_len,sent,received,lost,achieved_rps,
+	# rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_p999_us,...
+	cat "$out.csv" "$out.bulk.csv" 2>/dev/null | awk -F, -v w="$w" -v q="$q" -v drops=$((d1 - d0)) \
+		-v jiffies=$((c1 - c0)) -v hz="$(getconf CLK_TCK)" -v duration="$DURATION" '
+		$1 == "clients" { next }
+		{
+			bytes += $10 * ($5 + $6)
+			pkts += $7 + $8
+			if (!lat) {
+				lat = 1
+				sent = $7; received = $8; lost = $9; rps = $10
+				p50 = $11; p99 = $13; p999 = $14
+			}
+		}
+		END {
+			printf "%s,%s,%d,%d,%d,%.2f,%.0f,%.1f,%.1f,%.1f,%.1f,%d,%.0f\n", w, q, sent, received,
+				lost, sent ? 100 * lost / sent : 0, rps, bytes * 8 / 1e6, p50, p99, p999, drops,
+				pkts ? jiffies * 1e9 / hz / pkts : 0
+		}' >>"$CSV"
+	tail -n 1 "$CSV"
+}
+
+# Markdown table per workload
+report() {
+	awk -F, '
+		NR == 1 { next }
+		!($1 in seen) { seen[$1] = 1; order[n++] = $1 }
+		{ rows[$1] = rows[$1] sprintf("| %s | %s | %s | %s | %s | %s | %s | %s | %s |\n",
+			$2, $8, $7, $9, $10, $11, $6, $12, $13) }
+		END {
+			printf "# qdisc comparison\n\n"
+			for (i = 0; i < n; i++) {
+				printf "## %s\n\n", order[i]
+				printf "| qdisc | Mbit/s | requests/s | RTT p50 us | p99 us | p999 us | lost %% | drops | CPU ns/pkt |\n"
+				printf "|---|---|---|---|---|---|---|---|---|\n"
+				printf "%s\n", rows[order[i]]
+			}
+		}' "$CSV"
+}
+
+# Budget lines : WORKLOAD|* QDISC METRIC <=|>= LIMIT, LIMIT a number or
+# FACTOR*QDISC, relative to the same metric of that qdisc
+check_budgets() {
+	[ -f "$BUDGETS" ] || return 0
+	awk '
+		FNR == NR {
+			if (FNR == 1)
+				for (i = 1; i <= NF; i++)
+					col[$i] = i
+			else
+				val[$1, $2] = $0
+			next
+		}
+		/^#/ || NF < 5 { next }
+		{
+			for (key in val) {
+				split(key, k, SUBSEP)
+				if (($1 != "*" && $1 != k[1]) || $2 != k[2] || !($3 in col))
+					continue
+				split(val[key], row, ",")
+				v = row[col[$3]]
+				limit = $5
+				if (limit ~ /\*/) {
+					split(limit, rel, "*")
+					if (!((k[1], rel[2]) in val))
+						continue
+					split(val[k[1], rel[2]], base, ",")
+					limit = rel[1] * base[col[$3]]
+				}
+				ok = $4 == "<=" ? v <= limit + 0 : v >= limit + 0
+				printf "%s %s %s %s = %s, budget %s %s\n", ok ? "ok  " : "FAIL",
+					k[1], k[2], $3, v, $4, limit
+				failed += !ok
+			}
+		}
+		END { exit failed > 0 }' FS=, "$CSV" FS=' ' "$BUDGETS"
+}
+
+make -s -C "$DIR"
+mkdir -p "$OUT_DIR"
+echo "workload,qdisc,sent,received,lost,loss_pct,rps,throughput_mbit,rtt_p50_us,rtt_p99_us,rtt_p999_us,drops,cpu_ns_pkt" >"$CSV"
+
+trap '"$DIR/netns.sh" down' EXIT
+for q in $QDISCS; do
+	opts=OPTS_$q
+	if [ "$q" = "${QDISCS%% *}" ]; then
+		"$DIR/netns.sh" up "$q" ${!opts} >/dev/null
+		for i in 3 4 5 6 7 8 9; do
+			ip netns exec $SND ip addr add 10.0.1.$i/24 dev snd0
+		done
+	else
+		"$DIR/netns.sh" qdisc "$q" ${!opts}
+	fi
+	for w in $WORKLOADS; do
+		run "$w" "$q"
+	done
+done
+
+status=0
+check_budgets >"$OUT_DIR/budgets.txt" || status=1
+{
+	report
+	if [ -s "$OUT_DIR/budgets.txt" ]; then
+		printf "## Budgets\n\n"
+		sed 's/^/    /' "$OUT_DIR/budgets.txt"
+	fi
+} >"$REPORT"
+cat "$REPORT"
+exit $status
@@ -0,0 +1,464 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * echo_server.c  UDP echo server with kernel timestamps, the C version of
+ *                receiver.py
+ *
+ * Usage: echo_server [options]
+ *   -a ADDR      address to bind                                  0.0.0.0
+ *   -p PORT      port                                               12345
+ *   -l FILE      binary log : a struct wire_log (wire.h) per answer
+ *   -d SECONDS   stop after, 0 for SIGINT / SIGTERM                     0
+ *
+ * Requests of loadgen (struct wire) are answered with resp_len bytes, the
+ * header filled in with the receive and send times. Anything else is sent
+ * back as is.
+ *
+ * The request is timestamped on receive (SOF_TIMESTAMPING_RX_SOFTWARE),
+ * the answer when it enters the qdisc (TX_SCHED) and when it is handed to
+ * the driver (TX_SOFTWARE); the tx timestamps come back on the error
+ * queue, matched to the answer by SOF_TIMESTAMPING_OPT_ID. The marco_fq
+ * telemetry option of the request (telemetry_option), when there, gives
+ * the time it spent in each marco_fq and its pair table penalty.
+ *
+ * On exit, percentiles of :
+ *   one-way      client send to receive here, same clock at both ends
+ *   turnaround   receive to the answer entering the qdisc
+ *   qdisc        the answer in the local qdisc
+ *   sojourn      marco_fq sojourn of the request, summed over the hops
+ *   penalty      pair table part of it
+ * and one-way and sojourn for each client address, one line per pair.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tc_sch/marco_fq.h"
+#include "hist.h"
+#include "wire.h"
+
+#define BATCH 64
+#define PENDING 65536 /* answers waiting for their tx timestamps */
+#define PAIRS 64      /* client addresses with a summary of their own */
+#define NS 1000000000ULL
+#define TSTAMP_WAIT NS /* tx timestamps not back by then are missing */
+
+#define NO_TELEMETRY UINT32_MAX
+
+struct pair
+{
+    uint32_t saddr;
+    uint64_t penalized;
+    struct hist oneway;
+    struct hist sojourn;
+};
+
+static struct
+{
+    struct hist oneway;
+    struct hist turnaround;
+    struct hist qdisc;
+    struct hist sojourn;
+    struct hist penalty;
+    uint64_t received;
+    uint64_t answered;
+    uint64_t penalized;
+    uint64_t missing; /* answers without their tx timestamps */
+} sum;
+
+static struct pair *pairs[PAIRS];
+static unsigned int nr_pairs;
+
+/* Answers in OPT_ID order : pending[id % PENDING] for logged <= id < sent */
+static struct wire_log pending[PENDING];
+static uint64_t sent, logged;
+static FILE *log_file;
+
+static volatile sig_atomic_t stop;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a addr] [-p port] [-l log] [-d seconds]\n", prog);
+    exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+static uint64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NS + ts->tv_nsec;
+}
+
+static struct pair *pair_get(uint32_t saddr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_pairs; i++)
+        if (pairs[i]->saddr == saddr)
+            return pairs[i];
+    if (nr_pairs == PAIRS)
+        return NULL;
+    pairs[nr_pairs] = calloc(1, sizeof(struct pair));
+    if (!pairs[nr_pairs])
+        return NULL;
+    pairs[nr_pairs]->saddr = saddr;
+    hist_init(&pairs[nr_pairs]->oneway);
+    hist_init(&pairs[nr_pairs]->sojourn);
+    return pairs[nr_pairs++];
+}
+
+/* Sums the marco_fq telemetry options of the IPv4 options of a request */
+static void parse_telemetry(const uint8_t *opts, size_t len, struct wire_log *rec)
+{
+    size_t i = 0;
+
+    while (i < len)
+    {
+        const struct tc_marco_fq_telemetry *t = (const void *)&opts[i];
+
+        if (opts[i] == 0) /* end of options */
+            break;
+        if (opts[i] == 1) /* no operation */
+        {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+            break;
+        if (opts[i] == TC_MARCO_FQ_TELEMETRY_IPV4 && opts[i + 1] == sizeof(*t))
+        {
+            if (rec->sojourn_us == NO_TELEMETRY)
+                rec->sojourn_us = rec->penalty_us = 0;
+            rec->sojourn_us += ntohl(t->sojourn_us);
+            rec->penalty_us += ntohl(t->penalty_us);
+        }
+        i += opts[i + 1];
+    }
+}
+
+/* Accounts and logs the oldest pending answer */
+static void finish_one(void)
+{
+    struct wire_log *rec = &pending[logged++ % PENDING];
+    struct pair *p = pair_get(rec->saddr);
+
+    if (rec->tx && rec->rx >= rec->tx)
+    {
+        hist_record(&sum.oneway, rec->rx - rec->tx);
+        if (p)
+            hist_record(&p->oneway, rec->rx - rec->tx);
+    }
+    if (rec->sched && rec->sched >= rec->rx)
+        hist_record(&sum.turnaround, rec->sched - rec->rx);
+    if (rec->sched && rec->snd >= rec->sched)
+        hist_record(&sum.qdisc, rec->snd - rec->sched);
+    if (!rec->sched || !rec->snd)
+        sum.missing++;
+    if (rec->sojourn_us != NO_TELEMETRY)
+    {
+        hist_record(&sum.sojourn, rec->sojourn_us * 1000ULL);
+        hist_record(&sum.penalty, rec->penalty_us * 1000ULL);
+        if (p)
+            hist_record(&p->sojourn, rec->sojourn_us * 1000ULL);
+        if (rec->penalty_us)
+        {
+            sum.penalized++;
+            if (p)
+                p->penalized++;
+        }
+    }
+    if (log_file)
+        fwrite(rec, sizeof(*rec), 1, log_file);
+}
+
+/* Logs the answers which have both tx timestamps, or waited too long */
+static void finish(uint64_t now)
+{
+    while (logged < sent)
+    {
+        const struct wire_log *rec = &pending[logged % PENDING];
+
+        if ((!rec->sched || !rec->snd) && now - rec->rx < TSTAMP_WAIT)
+            break;
+        finish_one();
+    }
+}
+
+static void read_errqueue(int fd)
+{
+    char control[BATCH][256];
+    struct mmsghdr msgs[BATCH];
+    int i, n;
+
+    for (;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < BATCH; i++)
+        {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        n = recvmmsg(fd, msgs, BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            return;
+
+        for (i = 0; i < n; i++)
+        {
+            const struct scm_timestamping *tss = NULL;
+            const struct sock_extended_err *err = NULL;
+            struct cmsghdr *cm;
+            struct wire_log *rec;
+
+            for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm))
+            {
+                if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+                    tss = (const void *)CMSG_DATA(cm);
+                else if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    err = (const void *)CMSG_DATA(cm);
+            }
+            if (!tss || !err || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+                continue;
+            /* ee_data is the OPT_ID of the answer, which may be logged already */
+            if ((uint32_t)(err->ee_data - logged) >= sent - logged)
+                continue;
+            rec = &pending[err->ee_data % PENDING];
+            if (err->ee_info == SCM_TSTAMP_SCHED)
+                rec->sched = ts_ns(&tss->ts[0]);
+            else if (err->ee_info == SCM_TSTAMP_SND)
+                rec->snd = ts_ns(&tss->ts[0]);
+        }
+    }
+}
+
+/* Keeps an answer which left until its tx timestamps are back */
+static void pending_add(const struct wire_log *rec)
+{
+    /* logs the oldest one, even without its timestamps, to make room */
+    if (sent - logged >= PENDING)
+        finish_one();
+    pending[sent++ % PENDING] = *rec;
+    sum.answered++;
+}
+
+static void serve(int fd)
+{
+    static char buf[BATCH][WIRE_MAX];
+    static const char zero[WIRE_MAX];
+    char control[BATCH][256];
+    struct sockaddr_in addr[BATCH];
+    struct mmsghdr msgs[BATCH], answers[BATCH];
+    struct iovec iov[BATCH], answer_iov[BATCH][2];
+    struct wire_log rec[BATCH];
+    uint64_t srv_tx;
+    int i, k, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < BATCH; i++)
+    {
+        iov[i] = (struct iovec){.iov_base = buf[i], .iov_len = sizeof(buf[i])};
+        msgs[i].msg_hdr.msg_name = &addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+    n = recvmmsg(fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0)
+        return;
+    sum.received += n;
+
+    memset(answers, 0, n * sizeof(answers[0]));
+    srv_tx = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        struct wire *h = (struct wire *)buf[i];
+        struct cmsghdr *cm;
+
+        rec[i] = (struct wire_log){
+            .saddr = addr[i].sin_addr.s_addr,
+            .sport = addr[i].sin_port,
+            .len = msgs[i].msg_len,
+            .sojourn_us = NO_TELEMETRY,
+            .penalty_us = NO_TELEMETRY,
+        };
+        for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+                rec[i].rx = ts_ns(&((const struct scm_timestamping *)CMSG_DATA(cm))->ts[0]);
+            else if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVOPTS)
+                parse_telemetry(CMSG_DATA(cm), cm->cmsg_len - CMSG_LEN(0), &rec[i]);
+        }
+        if (!rec[i].rx)
+            rec[i].rx = now_ns();
+
+        answers[i].msg_hdr.msg_name = &addr[i];
+        answers[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+        answers[i].msg_hdr.msg_iov = answer_iov[i];
+        if (msgs[i].msg_len >= sizeof(*h) && h->magic == WIRE_MAGIC)
+        {
+            unsigned int len = h->resp_len;
+
+            if (len < sizeof(*h))
+                len = sizeof(*h);
+            if (len > WIRE_MAX)
+                len = WIRE_MAX;
+            rec[i].client = h->client;
+            rec[i].seq = h->seq;
+            rec[i].tx = h->tx;
+            h->srv_rx = rec[i].rx;
+            h->srv_tx = srv_tx;
+            answer_iov[i][0] = (struct iovec){.iov_base = h, .iov_len = sizeof(*h)};
+            answer_iov[i][1] = (struct iovec){.iov_base = (void *)zero, .iov_len = len - sizeof(*h)};
+            answers[i].msg_hdr.msg_iovlen = 2;
+        }
+        else
+        {
+            answer_iov[i][0] = (struct iovec){.iov_base = buf[i], .iov_len = msgs[i].msg_len};
+            answers[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    /* each answer which leaves takes the next OPT_ID */
+    for (i = 0; i < n;)
+    {
+        int ret = sendmmsg(fd, &answers[i], n - i, 0);
+
+        if (ret < 0)
+        {
+            if (errno == ENOBUFS)
+                break;
+            i++; /* this answer is lost, e.g. no route */
+            continue;
+        }
+        for (k = i; k < i + ret; k++)
+            pending_add(&rec[k]);
+        i += ret;
+    }
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(12345)};
+    unsigned int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+                         SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_SOFTWARE |
+                         SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    double duration = 0;
+    uint64_t end = 0;
+    struct pollfd pfd;
+    unsigned int i;
+    int c, fd, one = 1;
+
+    while ((c = getopt(argc, argv, "a:p:l:d:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'a':
+            if (inet_pton(AF_INET, optarg, &sin.sin_addr) != 1)
+                usage(argv[0]);
+            break;
+        case 'p':
+            sin.sin_port = htons(strtoul(optarg, NULL, 0));
+            break;
+        case 'l':
+            log_file = fopen(optarg, "w");
+            if (!log_file)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            duration = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) ||
+        setsockopt(fd, SOL_IP, IP_RECVOPTS, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+    {
+        perror("socket");
+        return 1;
+    }
+    hist_init(&sum.oneway);
+    hist_init(&sum.turnaround);
+    hist_init(&sum.qdisc);
+    hist_init(&sum.sojourn);
+    hist_init(&sum.penalty);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (duration > 0)
+        end = now_ns() + duration * NS;
+    fprintf(stderr, "listening on %s:%u\n", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+
+    pfd = (struct pollfd){.fd = fd, .events = POLLIN};
+    while (!stop && (!end || now_ns() < end))
+    {
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            break;
+        if (pfd.revents & POLLERR)
+            read_errqueue(fd);
+        if (pfd.revents & POLLIN)
+            serve(fd);
+        finish(now_ns());
+    }
+
+    /* the last tx timestamps */
+    usleep(10000);
+    read_errqueue(fd);
+    while (logged < sent)
+        finish_one();
+    if (log_file)
+        fclose(log_file);
+
+    printf("received %llu answered %llu without tx timestamps %llu penalized %llu\n",
+           (unsigned long long)sum.received, (unsigned long long)sum.answered,
+           (unsigned long long)sum.missing, (unsigned long long)sum.penalized);
+    hist_print(stdout, "one-way", &sum.oneway);
+    hist_print(stdout, "turnaround", &sum.turnaround);
+    hist_print(stdout, "qdisc", &sum.qdisc);
+    if (sum.sojourn.count)
+    {
+        hist_print(stdout, "sojourn", &sum.sojourn);
+        hist_print(stdout, "penalty", &sum.penalty);
+    }
+    if (nr_pairs > 1)
+    {
+        for (i = 0; i < nr_pairs; i++)
+        {
+            struct in_addr a = {.s_addr = pairs[i]->saddr};
+
+            printf("== %s penalized %llu\n", inet_ntoa(a), (unsigned long long)pairs[i]->penalized);
+            hist_print(stdout, "one-way", &pairs[i]->oneway);
+            if (pairs[i]->sojourn.count)
+                hist_print(stdout, "sojourn", &pairs[i]->sojourn);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * hist.h  Log-linear latency histogram, in the manner of HdrHistogram.
+ *
+ * Values are ns. Below 2^HIST_SUB_BITS they are exact, above each power
+ * of two is cut in 2^HIST_SUB_BITS buckets : the error is under 1% at
+ * any scale, and recording is a few instructions. Histograms of several
+ * threads are merged with hist_add().
+ */
+#ifndef _MFQ_TEST_HIST_H
+#define _MFQ_TEST_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v < HIST_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (unsigned int)(v >> shift) - HIST_SUB;
+}
+
+/* Highest value of a bucket */
+static inline uint64_t hist_value(unsigned int idx)
+{
+    unsigned int shift;
+
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    shift = idx / HIST_SUB - 1;
+    return (((uint64_t)(idx % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+    h->bucket[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static inline void hist_add(struct hist *h, const struct hist *o)
+{
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        h->bucket[i] += o->bucket[i];
+    h->count += o->count;
+    h->sum += o->sum;
+    if (o->min < h->min)
+        h->min = o->min;
+    if (o->max > h->max)
+        h->max = o->max;
+}
+
+/* p in [0, 100] */
+static inline uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5), seen = 0;
+    unsigned int i;
+
+    if (!h->count)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->bucket[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static const double hist_pcts[] = {50, 90, 99, 99.9, 99.99};
+#define HIST_NR_PCTS (sizeof(hist_pcts) / sizeof(hist_pcts[0]))
+
+/* One line : name, count, min, mean, percentiles and max, in us */
+static inline void hist_print(FILE *f, const char *name, const struct hist *h)
+{
+    unsigned int i;
+
+    fprintf(f, "%-10s n %-9llu", name, (unsigned long long)h->count);
+    if (!h->count)
+    {
+        fprintf(f, "\n");
+        return;
+    }
+    fprintf(f, " min %.1f mean %.1f", h->min / 1e3, (double)h->sum / h->count / 1e3);
+    for (i = 0; i < HIST_NR_PCTS; i++)
+        fprintf(f, " p%g %.1f", hist_pcts[i], hist_percentile(h, hist_pcts[i]) / 1e3);
+    fprintf(f, " max %.1f us\n", h->max / 1e3);
+}
+
+#endif
@@ -0,0 +1,645 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * loadgen.c  UDP request/response load, the C version of sender.py
+ *
+ * Usage: loadgen [options]
+ *   -s ADDR      server address                                  10.0.2.5
+ *   -p PORT      server port                                        12345
+ *   -c N         clients, each a UDP socket with its own port         100
+ *   -o N         requests in flight per client, at most                 1
+ *   -m MODE      closed : a client sends again as soon as it has a free
+ *                         slot (the default)
+ *                uniform, poisson : -r requests a second over all clients
+ *                incast : every client sends at once, -r / -c times a
+ *                         second, the fan-in of a partition/aggregate RPC
+ *   -r RATE      requests a second, for uniform, poisson and incast
+ *   -l SIZE      request size in bytes, N or MIN-MAX                   64
+ *   -L SIZE      response size in bytes, N or MIN-MAX                  64
+ *   -B ADDRS     comma separated source addresses, taken by the clients
+ *                in turn : each one is a pair in the pair table
+ *   -t N         threads, sharing the clients                           1
+ *   -d SECONDS   measured run                                          10
+ *   -w SECONDS   warm-up, not measured                                  1
+ *   -T MS        a request not answered within MS is lost            1000
+ *   -O FILE      append a CSV line of the results, with a header when the
+ *                file is new
+ *
+ * Requests carry a struct wire header (wire.h), which the server sends
+ * back : any UDP echo server gives RTTs, echo_server also fills in its
+ * receive and send times for one-way delays. Sending is batched with
+ * sendmmsg() for the slots a client fills at once, receiving with
+ * recvmmsg() and SO_TIMESTAMPNS. RTT and one-way delays are printed as
+ * percentiles from a log-linear histogram (hist.h).
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "wire.h"
+
+#define BATCH 64
+#define NS 1000000000ULL
+
+enum mode
+{
+    MODE_CLOSED,
+    MODE_UNIFORM,
+    MODE_POISSON,
+    MODE_INCAST,
+};
+
+static const char *const mode_names[] = {"closed", "uniform", "poisson", "incast"};
+
+struct range
+{
+    unsigned int min;
+    unsigned int max;
+};
+
+static struct
+{
+    struct sockaddr_in server;
+    struct in_addr *src;
+    unsigned int nr_src;
+    unsigned int clients;
+    unsigned int outstanding;
+    enum mode mode;
+    double rate;
+    struct range req;
+    struct range resp;
+    unsigned int threads;
+    double duration;
+    double warmup;
+    uint64_t timeout;
+    const char *csv;
+} opt = {
+    .clients = 100,
+    .outstanding = 1,
+    .req = {64, 64},
+    .resp = {64, 64},
+    .threads = 1,
+    .duration = 10,
+    .warmup = 1,
+    .timeout = 1000 * 1000000ULL,
+};
+
+struct client
+{
+    int fd;
+    uint32_t id;
+    uint32_t seq;
+    unsigned int free; /* slots not in flight */
+    uint64_t *tx;      /* send time of each slot, 0 when free */
+    uint32_t *slot_seq;
+};
+
+struct worker
+{
+    pthread_t thread;
+    unsigned int id;
+    struct client *clients;
+    unsigned int nr_clients;
+    unsigned int next; /* round robin of the open loop modes */
+    uint64_t rnd;
+
+    uint64_t sent;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t late;    /* answers of requests already counted as lost */
+    uint64_t stalled; /* open loop requests with every slot in flight */
+    struct hist rtt;
+    struct hist fwd;
+    struct hist back;
+};
+
+static volatile sig_atomic_t stop;
+static uint64_t t_start, t_measure, t_end;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s addr] [-p port] [-c clients] [-o outstanding] "
+                    "[-m closed|uniform|poisson|incast] [-r rate] [-l size] [-L size] "
+                    "[-B addrs] [-t threads] [-d seconds] [-w seconds] [-T ms] [-O csv]\n",
+            prog);
+    exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rnd(struct worker *w)
+{
+    w->rnd ^= w->rnd >> 12;
+    w->rnd ^= w->rnd << 25;
+    w->rnd ^= w->rnd >> 27;
+    return w->rnd * 2685821657736338717ULL;
+}
+
+static unsigned int rnd_range(struct worker *w, const struct range *r)
+{
+    if (r->min == r->max)
+        return r->min;
+    return r->min + rnd(w) % (r->max - r->min + 1);
+}
+
+static void parse_range(const char *s, struct range *r)
+{
+    char *end;
+
+    r->min = strtoul(s, &end, 0);
+    r->max = *end == '-' ? strtoul(end + 1, &end, 0) : r->min;
+    if (*end || r->max < r->min || r->max > WIRE_MAX)
+    {
+        fprintf(stderr, "bad size %s\n", s);
+        exit(2);
+    }
+    if (r->min < sizeof(struct wire))
+        r->min = sizeof(struct wire);
+    if (r->max < r->min)
+        r->max = r->min;
+}
+
+static void parse_src(char *s)
+{
+    char *tok;
+
+    for (tok = strtok(s, ","); tok; tok = strtok(NULL, ","))
+    {
+        opt.src = realloc(opt.src, (opt.nr_src + 1) * sizeof(*opt.src));
+        if (!opt.src || inet_pton(AF_INET, tok, &opt.src[opt.nr_src]) != 1)
+        {
+            fprintf(stderr, "bad source address %s\n", tok);
+            exit(2);
+        }
+        opt.nr_src++;
+    }
+}
+
+static int client_open(struct client *c, uint32_t id)
+{
+    struct sockaddr_in sin = {.sin_family = AF_INET};
+    int one = 1;
+
+    c->id = id;
+    c->free = opt.outstanding;
+    c->tx = calloc(opt.outstanding, sizeof(*c->tx));
+    c->slot_seq = calloc(opt.outstanding, sizeof(*c->slot_seq));
+    c->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (!c->tx || !c->slot_seq || c->fd < 0)
+        return -1;
+    setsockopt(c->fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    if (opt.nr_src)
+    {
+        sin.sin_addr = opt.src[id % opt.nr_src];
+        if (bind(c->fd, (struct sockaddr *)&sin, sizeof(sin)))
+            return -1;
+    }
+    return connect(c->fd, (struct sockaddr *)&opt.server, sizeof(opt.server));
+}
+
+/* Sends n requests on the free slots of c */
+static void client_send(struct worker *w, struct client *c, unsigned int n)
+{
+    static const char zero[WIRE_MAX];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH][2];
+    struct wire hdr[BATCH];
+    unsigned int i, slot = 0;
+    uint64_t now;
+    int sent;
+
+    if (n > c->free)
+        n = c->free;
+    if (n > BATCH)
+        n = BATCH;
+    if (!n)
+        return;
+
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    now = now_ns();
+    for (i = 0; i < n; i++)
+    {
+        unsigned int len = rnd_range(w, &opt.req);
+
+        while (c->tx[slot])
+            slot++;
+        hdr[i] = (struct wire){
+            .magic = WIRE_MAGIC,
+            .client = c->id,
+            .slot = slot,
+            .seq = c->seq++,
+            .resp_len = rnd_range(w, &opt.resp),
+            .tx = now,
+        };
+        c->tx[slot] = now;
+        c->slot_seq[slot] = hdr[i].seq;
+        slot++;
+
+        iov[i][0] = (struct iovec){.iov_base = &hdr[i], .iov_len = sizeof(hdr[i])};
+        iov[i][1] = (struct iovec){.iov_base = (void *)zero, .iov_len = len - sizeof(hdr[i])};
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    sent = sendmmsg(c->fd, msgs, n, 0);
+    if (sent < 0)
+        sent = 0;
+    /* what did not leave is not in flight */
+    for (i = sent; i < n; i++)
+        c->tx[hdr[i].slot] = 0;
+    c->free -= sent;
+    if (now >= t_measure)
+        w->sent += sent;
+}
+
+static void client_recv(struct worker *w, struct client *c)
+{
+    char control[BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct wire hdr[BATCH];
+    int i, n;
+
+    for (;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < BATCH; i++)
+        {
+            iov[i] = (struct iovec){.iov_base = &hdr[i], .iov_len = sizeof(hdr[i])};
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        n = recvmmsg(c->fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            return;
+
+        for (i = 0; i < n; i++)
+        {
+            const struct wire *h = &hdr[i];
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            uint64_t rx = 0;
+
+            if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPNS)
+            {
+                struct timespec ts;
+
+                memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                rx = ts.tv_sec * NS + ts.tv_nsec;
+            }
+            if (!rx)
+                rx = now_ns();
+
+            if (msgs[i].msg_len < sizeof(*h) || h->magic != WIRE_MAGIC ||
+                h->client != c->id || h->slot >= opt.outstanding)
+                continue;
+            if (!c->tx[h->slot] || c->slot_seq[h->slot] != h->seq)
+            {
+                w->late++;
+                continue;
+            }
+            c->tx[h->slot] = 0;
+            c->free++;
+            if (h->tx < t_measure || h->tx >= t_end)
+                continue;
+
+            w->received++;
+            hist_record(&w->rtt, rx - h->tx);
+            /* one-way delays, when the server tells its times */
+            if (h->srv_rx && h->srv_tx)
+            {
+                hist_record(&w->fwd, h->srv_rx > h->tx ? h->srv_rx - h->tx : 0);
+                hist_record(&w->back, rx > h->srv_tx ? rx - h->srv_tx : 0);
+            }
+        }
+    }
+}
+
+static void expire(struct worker *w, uint64_t now)
+{
+    unsigned int i, s;
+
+    for (i = 0; i < w->nr_clients; i++)
+    {
+        struct client *c = &w->clients[i];
+
+        if (c->free == opt.outstanding)
+            continue;
+        for (s = 0; s < opt.outstanding; s++)
+        {
+            if (!c->tx[s] || (int64_t)(now - c->tx[s]) < (int64_t)opt.timeout)
+                continue;
+            if (c->tx[s] >= t_measure && c->tx[s] < t_end)
+                w->lost++;
+            c->tx[s] = 0;
+            c->free++;
+        }
+    }
+}
+
+/* One request of the open loop, on the next client with a free slot */
+static void send_one(struct worker *w)
+{
+    unsigned int i;
+
+    for (i = 0; i < w->nr_clients; i++)
+    {
+        struct client *c = &w->clients[w->next++ % w->nr_clients];
+
+        if (c->free)
+        {
+            client_send(w, c, 1);
+            return;
+        }
+    }
+    if (now_ns() >= t_measure)
+        w->stalled++;
+}
+
+static uint64_t gap(struct worker *w)
+{
+    double rate = opt.rate / opt.threads;
+
+    switch (opt.mode)
+    {
+    case MODE_POISSON:
+        return -log((rnd(w) >> 11) * 0x1.0p-53 + 0x1.0p-54) / rate * NS;
+    case MODE_INCAST:
+        return opt.clients / opt.rate * NS;
+    default:
+        return NS / rate;
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event ev[BATCH];
+    uint64_t now, next_send = t_start, next_expire = t_start;
+    unsigned int i;
+    int ep, n;
+
+    ep = epoll_create1(0);
+    if (ep < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (i = 0; i < w->nr_clients; i++)
+    {
+        struct epoll_event e = {.events = EPOLLIN, .data.ptr = &w->clients[i]};
+
+        epoll_ctl(ep, EPOLL_CTL_ADD, w->clients[i].fd, &e);
+        if (opt.mode == MODE_CLOSED)
+            client_send(w, &w->clients[i], opt.outstanding);
+    }
+
+    while (!stop && (now = now_ns()) < t_end)
+    {
+        int timeout = 10;
+
+        if (opt.mode != MODE_CLOSED)
+        {
+            while (next_send <= now)
+            {
+                if (opt.mode == MODE_INCAST)
+                    for (i = 0; i < w->nr_clients; i++)
+                        client_send(w, &w->clients[i], 1);
+                else
+                    send_one(w);
+                next_send += gap(w);
+            }
+            /* no sleep shorter than a ms : spin */
+            timeout = (next_send - now) / 1000000;
+        }
+        if (now >= next_expire)
+        {
+            expire(w, now);
+            if (opt.mode == MODE_CLOSED)
+                for (i = 0; i < w->nr_clients; i++)
+                    client_send(w, &w->clients[i], w->clients[i].free);
+            next_expire = now + 10 * 1000000ULL;
+        }
+
+        n = epoll_wait(ep, ev, BATCH, timeout);
+        for (i = 0; i < (unsigned int)n; i++)
+        {
+            struct client *c = ev[i].data.ptr;
+
+            client_recv(w, c);
+            if (opt.mode == MODE_CLOSED)
+                client_send(w, c, c->free);
+        }
+    }
+    close(ep);
+    return NULL;
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void print_csv(const struct worker *tot, double secs)
+{
+    struct stat st;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(opt.csv, "a");
+    if (!f)
+    {
+        perror(opt.csv);
+        return;
+    }
+    if (fstat(fileno(f), &st) == 0 && st.st_size == 0)
+        fprintf(f, "clients,outstanding,mode,rate,req_len,resp_len,sent,received,lost,achieved_rps,"
+                   "rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_p999_us,rtt_p9999_us,rtt_max_us,"
+                   "fwd_p50_us,fwd_p99_us,back_p50_us,back_p99_us\n");
+    fprintf(f, "%u,%u,%s,%.0f,%u,%u,%llu,%llu,%llu,%.1f", opt.clients, opt.outstanding,
+            mode_names[opt.mode], opt.rate, opt.req.max, opt.resp.max,
+            (unsigned long long)tot->sent, (unsigned long long)tot->received,
+            (unsigned long long)tot->lost, tot->received / secs);
+    for (i = 0; i < HIST_NR_PCTS; i++)
+        fprintf(f, ",%.1f", hist_percentile(&tot->rtt, hist_pcts[i]) / 1e3);
+    fprintf(f, ",%.1f,%.1f,%.1f,%.1f,%.1f\n", tot->rtt.max / 1e3,
+            hist_percentile(&tot->fwd, 50) / 1e3, hist_percentile(&tot->fwd, 99) / 1e3,
+            hist_percentile(&tot->back, 50) / 1e3, hist_percentile(&tot->back, 99) / 1e3);
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    const char *server = "10.0.2.5";
+    struct worker *workers, *tot;
+    struct client *clients;
+    unsigned int i, port = 12345;
+    double secs;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:p:c:o:m:r:l:L:B:t:d:w:T:O:h")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            server = optarg;
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            opt.clients = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            opt.outstanding = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            for (opt.mode = 0; opt.mode <= MODE_INCAST; opt.mode++)
+                if (!strcmp(optarg, mode_names[opt.mode]))
+                    break;
+            if (opt.mode > MODE_INCAST)
+                usage(argv[0]);
+            break;
+        case 'r':
+            opt.rate = strtod(optarg, NULL);
+            break;
+        case 'l':
+            parse_range(optarg, &opt.req);
+            break;
+        case 'L':
+            parse_range(optarg, &opt.resp);
+            break;
+        case 'B':
+            parse_src(optarg);
+            break;
+        case 't':
+            opt.threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            opt.duration = strtod(optarg, NULL);
+            break;
+        case 'w':
+            opt.warmup = strtod(optarg, NULL);
+            break;
+        case 'T':
+            opt.timeout = strtoull(optarg, NULL, 0) * 1000000ULL;
+            break;
+        case 'O':
+            opt.csv = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!opt.clients || !opt.outstanding || !opt.threads || opt.threads > opt.clients ||
+        opt.duration <= 0 || (opt.mode != MODE_CLOSED && opt.rate <= 0))
+        usage(argv[0]);
+
+    opt.server.sin_family = AF_INET;
+    opt.server.sin_port = htons(port);
+    if (inet_pton(AF_INET, server, &opt.server.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad server address %s\n", server);
+        return 2;
+    }
+
+    clients = calloc(opt.clients, sizeof(*clients));
+    workers = calloc(opt.threads + 1, sizeof(*workers));
+    if (!clients || !workers)
+        return 1;
+    for (i = 0; i < opt.clients; i++)
+    {
+        if (client_open(&clients[i], i))
+        {
+            perror("client socket");
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    t_start = now_ns();
+    t_measure = t_start + opt.warmup * NS;
+    t_end = t_measure + opt.duration * NS;
+
+    /* clients are spread evenly, in consecutive blocks */
+    for (i = 0; i < opt.threads; i++)
+    {
+        struct worker *w = &workers[i];
+        unsigned int first = (uint64_t)opt.clients * i / opt.threads;
+
+        w->id = i;
+        w->clients = &clients[first];
+        w->nr_clients = (uint64_t)opt.clients * (i + 1) / opt.threads - first;
+        w->rnd = t_start ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+        hist_init(&w->rtt);
+        hist_init(&w->fwd);
+        hist_init(&w->back);
+        if (pthread_create(&w->thread, NULL, worker_run, w))
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    tot = &workers[opt.threads];
+    hist_init(&tot->rtt);
+    hist_init(&tot->fwd);
+    hist_init(&tot->back);
+    for (i = 0; i < opt.threads; i++)
+    {
+        struct worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+        /* requests still in flight at the end are neither lost nor answered */
+        tot->sent += w->sent;
+        tot->received += w->received;
+        tot->lost += w->lost;
+        tot->late += w->late;
+        tot->stalled += w->stalled;
+        hist_add(&tot->rtt, &w->rtt);
+        hist_add(&tot->fwd, &w->fwd);
+        hist_add(&tot->back, &w->back);
+    }
+
+    secs = (double)(now_ns() < t_end ? now_ns() - t_measure : t_end - t_measure) / NS;
+    if (secs <= 0)
+        secs = 1e-9;
+    printf("clients %u outstanding %u mode %s rate %.0f request %u-%u response %u-%u threads %u\n",
+           opt.clients, opt.outstanding, mode_names[opt.mode], opt.rate, opt.req.min, opt.req.max,
+           opt.resp.min, opt.resp.max, opt.threads);
+    printf("sent %llu received %llu lost %llu late %llu stalled %llu in %.1f s, %.0f requests/s\n",
+           (unsigned long long)tot->sent, (unsigned long long)tot->received,
+           (unsigned long long)tot->lost, (unsigned long long)tot->late,
+           (unsigned long long)tot->stalled, secs, tot->received / secs);
+    hist_print(stdout, "rtt", &tot->rtt);
+    if (tot->fwd.count)
+    {
+        hist_print(stdout, "forward", &tot->fwd);
+        hist_print(stdout, "back", &tot->back);
+    }
+    if (opt.csv)
+        print_csv(tot, secs);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#!/bin/bash
+# Single host version of the three VM setup of README.md : sender, router
+# and receiver are network namespaces, linked by two veth pairs.
+#
+#   mfq_snd (10.0.1.2) snd0 <-> rtr0 mfq_rtr rtr1 <-> rcv0 (10.0.2.5) mfq_rcv
+#                           10.0.1.1         10.0.2.1
+#
+# The router runs the qdisc on the egress of both veths. As interface.sh
+# does on enp0s3, the ingress of rtr0 is redirected to an ifb device which
+# runs the qdisc too.
+#
+# Usage: netns.sh up [QDISC [OPTIONS...]]   create, marco_fq by default
+#        netns.sh qdisc QDISC [OPTIONS...]  replace the qdisc of the router
+#        netns.sh exec snd|rtr|rcv CMD...   run a command in a namespace
+#        netns.sh show                      qdisc statistics of the router
+#        netns.sh down
+#
+# RATE (e.g. RATE=100mbit) puts the qdisc under a tbf of that rate on each
+# router interface, so that it holds a queue. DELAY (e.g. DELAY=1ms) adds
+# netem delay on the sender and receiver veths. sender.py and receiver.py
+# run unchanged in mfq_snd and mfq_rcv, the receiver being 10.0.2.5.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SND=mfq_snd
+RTR=mfq_rtr
+RCV=mfq_rcv
+
+# tc with q_marco_fq.so, see tc_q/load.sh
+export TC_LIB_DIR=${TC_LIB_DIR:-$ROOT/tc_q/iproute2/tc}
+
+if [ "$(id -u)" != 0 ]; then
+	exec sudo -E "$0" "$@"
+fi
+
+ns() {
+	ip netns exec "$@"
+}
+
+load_module() {
+	if [ "$1" = marco_fq ] && ! grep -q '^marco_fq ' /proc/modules; then
+		insmod "$ROOT/tc_sch/marco_fq.ko"
+	fi
+}
+
+# $1 device, then the qdisc and its options
+set_qdisc() {
+	local dev=$1
+	shift
+	ns $RTR tc qdisc del dev "$dev" root 2>/dev/null || true
+	if [ -n "$RATE" ]; then
+		ns $RTR tc qdisc add dev "$dev" root handle 1: tbf rate "$RATE" burst 32k latency 1s
+		ns $RTR tc qdisc add dev "$dev" parent 1:1 handle 10: "$@"
+	else
+		ns $RTR tc qdisc add dev "$dev" root handle 10: "$@"
+	fi
+}
+
+qdisc() {
+	local q=${1:-marco_fq}
+	shift || true
+	load_module "$q"
+	for dev in rtr0 rtr1 ifb0; do
+		set_qdisc $dev "$q" "$@"
+	done
+}
+
+up() {
+	down 2>/dev/null
+	modprobe ifb numifbs=0 2>/dev/null || true
+	modprobe sch_netem 2>/dev/null || true
+
+	ip netns add $SND
+	ip netns add $RTR
+	ip netns add $RCV
+	ip link add snd0 netns $SND type veth peer name rtr0 netns $RTR
+	ip link add rcv0 netns $RCV type veth peer name rtr1 netns $RTR
+
+	ns $SND ip addr add 10.0.1.2/24 dev snd0
+	ns $RTR ip addr add 10.0.1.1/24 dev rtr0
+	ns $RTR ip addr add 10.0.2.1/24 dev rtr1
+	ns $RCV ip addr add 10.0.2.5/24 dev rcv0
+	for n in $SND $RTR $RCV; do
+		ns $n ip link set lo up
+	done
+	ns $SND ip link set snd0 up
+	ns $RTR ip link set rtr0 up
+	ns $RTR ip link set rtr1 up
+	ns $RCV ip link set rcv0 up
+	ns $SND ip route add default via 10.0.1.1
+	ns $RCV ip route add default via 10.0.2.1
+	ns $RTR sysctl -qw net.ipv4.ip_forward=1
+
+	if [ -n "$DELAY" ]; then
+		ns $SND tc qdisc add dev snd0 root netem delay "$DELAY"
+		ns $RCV tc qdisc add dev rcv0 root netem delay "$DELAY"
+	fi
+
+	# interface.sh
+	ns $RTR ip link add ifb0 type ifb
+	ns $RTR ip link set ifb0 up
+	ns $RTR tc qdisc add dev rtr0 ingress
+	ns $RTR tc filter add dev rtr0 parent ffff: protocol all u32 match u8 0 0 \
+		action mirred egress redirect dev ifb0
+
+	qdisc "$@"
+	if command -v ping >/dev/null; then
+		ns $SND ping -c 1 -W 2 10.0.2.5 >/dev/null
+	fi
+	echo "$SND -> $RTR -> $RCV up, qdisc ${1:-marco_fq}"
+}
+
+down() {
+	for n in $SND $RTR $RCV; do
+		ip netns del $n 2>/dev/null || true
+	done
+}
+
+show() {
+	for dev in rtr0 ifb0 rtr1; do
+		echo "== $dev"
+		ns $RTR tc -s qdisc show dev $dev
+	done
+}
+
+cmd=$1
+shift || true
+case "$cmd" in
+up) up "$@" ;;
+qdisc) qdisc "$@" ;;
+exec)
+	n=mfq_$1
+	shift
+	ns "$n" "$@"
+	;;
+show) show ;;
+down) down ;;
+*)
+	sed -n '2,/^$/s/^# \{0,1\}//p' "$0"
+	exit 1
+	;;
+esac
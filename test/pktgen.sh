@@ -0,0 +1,180 @@
+#!/bin/bash
+# Packets per second through marco_fq, fq and fq_codel, driven by the
+# kernel packet generator (pktgen) in queue_xmit mode, so that every packet
+# goes through the root qdisc of the device.
+#
+# Usage: pktgen.sh [CONFIG...]     pktgen/*.conf by default
+#
+# Each config (see pktgen/default.conf) is run once per qdisc of QDISCS,
+# in the network namespace mfq_pktgen, on a dummy device or, with VETH=1,
+# a veth pair. A run prints the Mpps pktgen sent and the qdisc passed,
+# and its drops; it appends a line to OUT and saves the pktgen results and
+# tc -s -d qdisc output (marco_fq xstats included) in OUT_DIR.
+#
+# Environment, overriding the configs :
+#   QDISCS     qdiscs compared                "marco_fq fq fq_codel"
+#   DURATION   seconds a run lasts                                10
+#   THREADS    pktgen threads, on CPUs 0 to THREADS-1               1
+#   VETH       1 : a veth pair instead of a dummy device
+#   OUT        CSV file                                     pktgen.csv
+#   OUT_DIR    pktgen and tc output of each run           pktgen.out
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+NS=mfq_pktgen
+DEV=pg0
+PGDIR=/proc/net/pktgen
+
+export TC_LIB_DIR=${TC_LIB_DIR:-$ROOT/tc_q/iproute2/tc}
+
+if [ "$(id -u)" != 0 ]; then
+	exec sudo -E "$0" "$@"
+fi
+
+ns() {
+	ip netns exec $NS "$@"
+}
+
+# $1 file, $2 command
+pg() {
+	ns sh -c "echo '$2' > $PGDIR/$1"
+}
+
+# Sent packets, drops, overlimits and requeues of the root qdisc
+qdisc_counters() {
+	ns tc -s qdisc show dev $DEV | awk '
+		/^ Sent/ && !done {
+			gsub(/[(),]/, " ")
+			print $4, $7, $9, $11
+			done = 1
+		}'
+}
+
+setup() {
+	teardown
+	modprobe pktgen 2>/dev/null || true
+	modprobe dummy 2>/dev/null || true
+
+	ip netns add $NS
+	if [ "$VETH" = 1 ]; then
+		ns ip link add $DEV type veth peer name pg1
+		ns ip link set pg1 up
+	else
+		ns ip link add $DEV type dummy
+	fi
+	ns ip link set $DEV up
+	if ! ns test -e $PGDIR/pgctrl; then
+		echo "pktgen is not available (CONFIG_NET_PKTGEN)" >&2
+		exit 1
+	fi
+}
+
+teardown() {
+	ip netns del $NS 2>/dev/null || true
+}
+
+# $1 config name, $2 qdisc
+run() {
+	local name=$1 q=$2 t before after opts=OPTS_$2
+	local out=$OUT_DIR/$name-$q
+
+	if [ "$q" = marco_fq ] && ! grep -q '^marco_fq ' /proc/modules; then
+		insmod "$ROOT/tc_sch/marco_fq.ko"
+	fi
+	ns tc qdisc replace dev $DEV root handle 1: $q ${!opts}
+
+	pg pgctrl reset
+	for t in $(seq 0 $((THREADS - 1))); do
+		pg kpktgend_$t rem_device_all
+		pg kpktgend_$t "add_device $DEV@$t"
+		pg $DEV@$t "xmit_mode queue_xmit"
+		pg $DEV@$t "count 0"
+		pg $DEV@$t "pkt_size $PKT_SIZE"
+		pg $DEV@$t "dst_mac 02:00:00:00:00:01"
+		pg $DEV@$t "src_min ${SRCS%-*}"
+		pg $DEV@$t "src_max ${SRCS#*-}"
+		pg $DEV@$t "dst_min ${DSTS%-*}"
+		pg $DEV@$t "dst_max ${DSTS#*-}"
+		pg $DEV@$t "udp_src_min $UDP_PORT"
+		pg $DEV@$t "udp_src_max $((UDP_PORT + FLOWS - 1))"
+		pg $DEV@$t "udp_dst_min 12345"
+		pg $DEV@$t "udp_dst_max 12345"
+		pg $DEV@$t "flag UDPSRC_RND"
+		pg $DEV@$t "flag IPSRC_RND"
+		pg $DEV@$t "flag IPDST_RND"
+		if [ "$RATE" != 0 ]; then
+			pg $DEV@$t "ratep $((RATE / THREADS))"
+		fi
+	done
+
+	before=$(qdisc_counters)
+	pg pgctrl start &
+	sleep "$DURATION"
+	pg pgctrl stop
+	wait
+	after=$(qdisc_counters)
+
+	for t in $(seq 0 $((THREADS - 1))); do
+		ns cat $PGDIR/$DEV@$t
+	done >"$out.pktgen"
+	ns tc -s -d qdisc show dev $DEV >"$out.tc"
+
+	# pktgen : "Result: OK: <us>(c..+d..) usec, <sent> (<size>byte,<frags>frags)"
+	# then "<pps>pps <rate>Mb/sec (<rate>bps) errors: <errors>"
+	awk -v name="$name" -v q="$q" -v before="$before" -v after="$after" \
+		-v duration="$DURATION" -v out="$OUT" -v cfg="$FLOWS,$SRCS,$DSTS,$PKT_SIZE,$RATE,$THREADS" '
+		/^Result: OK/ {
+			sent += $5
+			result = 1
+			next
+		}
+		result {
+			pps += $1
+			errors += $NF
+			result = 0
+		}
+		END {
+			split(before, b)
+			split(after, a)
+			qpps = (a[1] - b[1]) / duration
+			printf "%-10s %-10s pktgen %.3f Mpps errors %d qdisc %.3f Mpps dropped %d overlimits %d requeues %d\n",
+				name, q, pps / 1e6, errors, qpps / 1e6, a[2] - b[2], a[3] - b[3], a[4] - b[4]
+			printf "%s,%s,%s,%d,%d,%.0f,%d,%.0f,%d,%d,%d\n", name, q, cfg, duration, sent, pps, errors,
+				qpps, a[2] - b[2], a[3] - b[3], a[4] - b[4] >> out
+		}' "$out.pktgen"
+}
+
+QDISCS_ENV=$QDISCS
+DURATION_ENV=$DURATION
+THREADS_ENV=$THREADS
+OUT=${OUT:-pktgen.csv}
+OUT_DIR=${OUT_DIR:-pktgen.out}
+mkdir -p "$OUT_DIR"
+if [ ! -s "$OUT" ]; then
+	echo "config,qdisc,flows,srcs,dsts,pkt_size,rate,threads,duration,pktgen_sent,pktgen_pps,pktgen_errors,qdisc_pps,dropped,overlimits,requeues" >"$OUT"
+fi
+
+configs=("$@")
+if [ ${#configs[@]} = 0 ]; then
+	configs=("$(dirname "$0")"/pktgen/*.conf)
+fi
+
+trap teardown EXIT
+setup
+for conf in "${configs[@]}"; do
+	# defaults, the config, then the environment
+	FLOWS=1024 SRCS=10.0.1.2-10.0.1.2 DSTS=10.0.2.5-10.0.2.5 UDP_PORT=1024
+	PKT_SIZE=64 RATE=0 QDISCS="marco_fq fq fq_codel" DURATION=10 THREADS=1
+	unset ${!OPTS_*}
+	. "$conf"
+	QDISCS=${QDISCS_ENV:-$QDISCS}
+	DURATION=${DURATION_ENV:-$DURATION}
+	THREADS=${THREADS_ENV:-$THREADS}
+	case "$SRCS" in *-*) ;; *) SRCS=$SRCS-$SRCS ;; esac
+	case "$DSTS" in *-*) ;; *) DSTS=$DSTS-$DSTS ;; esac
+
+	for q in $QDISCS; do
+		run "$(basename "$conf" .conf)" "$q"
+	done
+done
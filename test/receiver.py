@@ -1,16 +1,58 @@
 import socket
+import struct
 import time
 
 server_ip = "10.0.2.5"
 server_port = 12345
+
+# In-band telemetry written by marco_fq routers (telemetry_option and
+# telemetry_dscp), see struct tc_marco_fq_telemetry in tc_sch/marco_fq.h
+IP_RECVOPTS = getattr(socket, "IP_RECVOPTS", 6)
+IP_RECVTOS = getattr(socket, "IP_RECVTOS", 13)
+TELEMETRY_OPT = 0x1e
+TELEMETRY_PENALIZED = 1
+
+
+def parse_telemetry(opts):
+    """Returns (sojourn_us, penalty_us, flags) for each marco_fq hop."""
+    hops = []
+    i = 0
+    while i < len(opts):
+        opt_type = opts[i]
+        if opt_type == 0:  # end of options
+            break
+        if opt_type == 1:  # no operation
+            i += 1
+            continue
+        if i + 1 >= len(opts) or opts[i + 1] < 2:
+            break
+        opt_len = opts[i + 1]
+        if opt_type == TELEMETRY_OPT and opt_len == 12:
+            flags, sojourn_us, penalty_us = struct.unpack("!HII", opts[i + 2:i + 12])
+            hops.append((sojourn_us, penalty_us, flags))
+        i += opt_len
+    return hops
+
+
 server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+server_socket.setsockopt(socket.IPPROTO_IP, IP_RECVOPTS, 1)
+server_socket.setsockopt(socket.IPPROTO_IP, IP_RECVTOS, 1)
 server_socket.bind((server_ip, server_port))
 print(f"Server started at {server_ip}:{server_port}")
 
 last_send_time = None
 while True:
-    data, addr = server_socket.recvfrom(1024)
+    data, ancdata, _, addr = server_socket.recvmsg(1024, socket.CMSG_SPACE(40) + socket.CMSG_SPACE(1))
    # print(f"Received {data} from {addr}")
+    for level, cmsg_type, cmsg_data in ancdata:
+        if level != socket.IPPROTO_IP:
+            continue
+        if cmsg_type == IP_RECVOPTS:
+            for hop, (sojourn_us, penalty_us, flags) in enumerate(parse_telemetry(cmsg_data)):
+                penalized = " (penalized)" if flags & TELEMETRY_PENALIZED else ""
+                print(f"{data.decode()}: hop {hop} queued {sojourn_us} us, penalty {penalty_us} us{penalized}")
+        elif cmsg_type == socket.IP_TOS and cmsg_data and cmsg_data[0] >> 2:
+            print(f"{data.decode()}: DSCP {cmsg_data[0] >> 2}")
     message = "ACK" + data.decode()
     if last_send_time is not None:
         time_difference = (time.time() - last_send_time)*1000
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * wire.h  Request and response header of loadgen and echo_server, and
+ *         the binary log record of echo_server.
+ *
+ * Both ends run on the same host (see netns.sh) or on hosts of the same
+ * byte order : fields are in host order. Times are CLOCK_REALTIME ns,
+ * the clock of SO_TIMESTAMPING, so that one-way delays can be taken
+ * when the clocks of both ends agree.
+ */
+#ifndef _MFQ_TEST_WIRE_H
+#define _MFQ_TEST_WIRE_H
+
+#include <stdint.h>
+
+#define WIRE_MAGIC 0x6d667131 /* "mfq1" */
+#define WIRE_MAX 65000        /* largest request or response */
+
+struct wire
+{
+    uint32_t magic;
+    uint32_t client;
+    uint32_t slot;     /* outstanding request of the client */
+    uint32_t seq;
+    uint32_t resp_len; /* bytes the server answers with, at least sizeof(struct wire) */
+    uint32_t pad;
+    uint64_t tx;       /* client send */
+    uint64_t srv_rx;   /* server receive, set in the response */
+    uint64_t srv_tx;   /* server send, set in the response */
+};
+
+/* echo_server -l : one record per answered request, in answer order.
+ * Times of a stage the kernel did not report are 0.
+ */
+struct wire_log
+{
+    uint32_t saddr;      /* client address, network order */
+    uint16_t sport;      /* client port, network order */
+    uint16_t len;        /* request bytes */
+    uint32_t client;     /* from the request, 0 when it is not a struct wire */
+    uint32_t seq;
+    uint64_t tx;         /* client send */
+    uint64_t rx;         /* SOF_TIMESTAMPING_RX_SOFTWARE of the request */
+    uint64_t sched;      /* SOF_TIMESTAMPING_TX_SCHED : response enters the qdisc */
+    uint64_t snd;        /* SOF_TIMESTAMPING_TX_SOFTWARE : response leaves the qdisc */
+    uint32_t sojourn_us; /* marco_fq telemetry of the request, first hop, */
+    uint32_t penalty_us; /* UINT32_MAX without telemetry */
+};
+
+#endif